@@ -0,0 +1,110 @@
+#include "arena.h"
+#include <stdlib.h> // calloc, exit, free, malloc
+#include <string.h> // memset
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGNMENT 16
+
+static char *arena_object_kind_names[] = {
+    [ARENA_OBJECT_KIND_IR] = "ir",
+    [ARENA_OBJECT_KIND_LOCAL_VARIABLE] = "local_variable",
+    [ARENA_OBJECT_KIND_NODE] = "node",
+    [ARENA_OBJECT_KIND_NODES] = "nodes",
+    [ARENA_OBJECT_KIND_SCOPE] = "scope",
+    [ARENA_OBJECT_KIND_SYMBOL_TABLE] = "symbol_table",
+    [ARENA_OBJECT_KIND_TYPE] = "type",
+};
+
+static ArenaBlock *new_arena_block(size_t capacity, ArenaBlock *next) {
+  ArenaBlock *block = malloc(sizeof(ArenaBlock) + capacity);
+  if (block == NULL) {
+    fprintf(stderr, "Failed to allocate arena block.\n");
+    exit(1);
+  }
+  block->next = next;
+  block->capacity = capacity;
+  block->used = 0;
+  return block;
+}
+
+Arena *new_arena(void) {
+  return calloc(1, sizeof(Arena));
+}
+
+// Returns zero-filled memory of the given size, which lives until the arena is reset or freed.
+void *arena_allocate(Arena *arena, size_t size, ArenaObjectKind kind) {
+  size_t aligned_size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+  ArenaBlock *block = arena->block;
+  if (block == NULL || block->capacity - block->used < aligned_size) {
+    size_t capacity = aligned_size > ARENA_BLOCK_SIZE ? aligned_size : ARENA_BLOCK_SIZE;
+    block = arena->block = new_arena_block(capacity, arena->block);
+    arena->reserved_bytes += capacity;
+  }
+  void *pointer = block->data + block->used;
+  block->used += aligned_size;
+  arena->bytes[kind] += size;
+  arena->counts[kind]++;
+  return memset(pointer, 0, size);
+}
+
+// Releases every object but keeps the most recent block for reuse.
+void reset_arena(Arena *arena) {
+  ArenaBlock *block = arena->block;
+  if (block != NULL) {
+    while (block->next != NULL) {
+      ArenaBlock *next = block->next;
+      arena->reserved_bytes -= next->capacity;
+      block->next = next->next;
+      free(next);
+    }
+    block->used = 0;
+  }
+  memset(arena->bytes, 0, sizeof(arena->bytes));
+  memset(arena->counts, 0, sizeof(arena->counts));
+}
+
+// Moves every object of other into arena, and frees other. Objects keep their addresses.
+void merge_arena(Arena *arena, Arena *other) {
+  if (other->block != NULL) {
+    ArenaBlock *last = other->block;
+    while (last->next != NULL) {
+      last = last->next;
+    }
+    // The current block of arena stays first, so that allocation continues in it.
+    if (arena->block == NULL) {
+      arena->block = other->block;
+    } else {
+      last->next = arena->block->next;
+      arena->block->next = other->block;
+    }
+  }
+  arena->reserved_bytes += other->reserved_bytes;
+  for (int kind = 0; kind < ARENA_OBJECT_KINDS_COUNT; kind++) {
+    arena->bytes[kind] += other->bytes[kind];
+    arena->counts[kind] += other->counts[kind];
+  }
+  free(other);
+}
+
+void free_arena(Arena *arena) {
+  ArenaBlock *block = arena->block;
+  while (block != NULL) {
+    ArenaBlock *next = block->next;
+    free(block);
+    block = next;
+  }
+  free(arena);
+}
+
+void print_arena_statistics(FILE *file, Arena *arena) {
+  size_t total_bytes = 0;
+  size_t total_count = 0;
+  fprintf(file, "%-16s %10s %12s\n", "kind", "objects", "bytes");
+  for (int kind = 0; kind < ARENA_OBJECT_KINDS_COUNT; kind++) {
+    fprintf(file, "%-16s %10zu %12zu\n", arena_object_kind_names[kind], arena->counts[kind], arena->bytes[kind]);
+    total_bytes += arena->bytes[kind];
+    total_count += arena->counts[kind];
+  }
+  fprintf(file, "%-16s %10zu %12zu\n", "total", total_count, total_bytes);
+  fprintf(file, "%-16s %10s %12zu\n", "reserved", "", arena->reserved_bytes);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stddef.h> // size_t
+#include <stdio.h>  // FILE
+
+typedef enum {
+  ARENA_OBJECT_KIND_IR,
+  ARENA_OBJECT_KIND_LOCAL_VARIABLE,
+  ARENA_OBJECT_KIND_NODE,
+  ARENA_OBJECT_KIND_NODES,
+  ARENA_OBJECT_KIND_SCOPE,
+  ARENA_OBJECT_KIND_SYMBOL_TABLE,
+  ARENA_OBJECT_KIND_TYPE,
+  ARENA_OBJECT_KINDS_COUNT,
+} ArenaObjectKind;
+
+typedef struct ArenaBlock ArenaBlock;
+
+struct ArenaBlock {
+  ArenaBlock *next;
+  size_t capacity;
+  size_t used;
+  _Alignas(16) char data[];
+};
+
+typedef struct Arena Arena;
+
+// Bump allocator. Every object allocated from an arena is released at once by free_arena.
+struct Arena {
+  ArenaBlock *block;
+  size_t reserved_bytes;
+  size_t bytes[ARENA_OBJECT_KINDS_COUNT];
+  size_t counts[ARENA_OBJECT_KINDS_COUNT];
+};
+
+Arena *new_arena(void);
+void *arena_allocate(Arena *arena, size_t size, ArenaObjectKind kind);
+void reset_arena(Arena *arena);
+void merge_arena(Arena *arena, Arena *other);
+void free_arena(Arena *arena);
+void print_arena_statistics(FILE *file, Arena *arena);
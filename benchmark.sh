@@ -0,0 +1,34 @@
+#!/bin/bash
+# Compares the bytecode VM (--vm) with the native backends, end to end from source to exit status.
+# The native times include assembling and linking by gcc where the backend needs them.
+
+measure() {
+  local label="$1"
+  shift
+  local start end
+  start=$(date +%s%N)
+  "$@" > /dev/null 2>&1
+  end=$(date +%s%N)
+  printf "  %-8s %6d ms\n" "$label" $(((end - start) / 1000000))
+}
+
+native() {
+  ./r7cc "$1" > tmp.s && gcc -o tmp tmp.s && ./tmp
+}
+
+object() {
+  ./r7cc -c -o tmp.o "$1" && gcc -o tmp tmp.o && ./tmp
+}
+
+benchmark() {
+  echo "$1"
+  measure "native" native "$2"
+  measure "-c" object "$2"
+  measure "--run" ./r7cc --run "$2"
+  measure "--ssa" ./r7cc --ssa --run "$2"
+  measure "--vm" ./r7cc --vm "$2"
+}
+
+benchmark "short-lived" "int main() { int a[10]; int i; for (i = 0; i < 10; i = i + 1) a[i] = i; return a[9]; }"
+benchmark "fib(30)" "int fib(int n) { if (n < 2) return n; return fib(n - 1) + fib(n - 2); } int main() { return fib(30) - 832000; }"
+benchmark "loops" "int a[100]; int main() { int i; int j; int s; s = 0; for (i = 0; i < 300000; i = i + 1) for (j = 0; j < 100; j = j + 1) { a[j] = a[j] + i; s = s + a[j] / 7; } return s - s / 256 * 256; }"
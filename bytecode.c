@@ -0,0 +1,424 @@
+#include "bytecode.h"
+#include <stdio.h>  // fprintf
+#include <stdlib.h> // calloc, exit, free, realloc
+
+// State of the function being compiled.
+static VmProgram *program;
+static VmFunction *function;
+
+// Registers are allocated as a stack, like the temporary registers of the native code generator, but without a limit.
+static int register_depth;
+
+static void compile(Node *node);
+
+static int align_to(int size, int unit) {
+  return (size + unit - 1) / unit * unit;
+}
+
+// Appends an instruction and returns its index, so that jumps can be patched once their targets are known.
+static int emit(VmOpcode opcode, int a, int b, int c) {
+  if (function->length == function->capacity) {
+    function->capacity = function->capacity == 0 ? 64 : function->capacity * 2;
+    function->code = realloc(function->code, sizeof(VmInstruction) * function->capacity);
+  }
+  function->code[function->length] = (VmInstruction){opcode, a, b, c};
+  return function->length++;
+}
+
+// Jumps are relative to the jump itself.
+static void patch_jump(int jump) {
+  function->code[jump].c = function->length - jump;
+}
+
+static int push_register(void) {
+  int register_ = register_depth++;
+  if (register_depth > function->registers_count) {
+    function->registers_count = register_depth;
+  }
+  return register_;
+}
+
+static int top_register(void) {
+  return register_depth - 1;
+}
+
+static int find_function(Symbol *symbol) {
+  for (int i = 0; i < program->functions_count; i++) {
+    if (program->functions[i].symbol == symbol) {
+      return i;
+    }
+  }
+  fprintf(stderr, "Undefined function: %.*s\n", symbol->name_length, symbol->name);
+  exit(1);
+}
+
+// Local variables of int and pointer types are loaded and stored by a single instruction.
+static bool is_direct_local(LocalVariable *variable) {
+  return !variable->is_global && (variable->type->kind == TYPE_KIND_INTEGER || variable->type->kind == TYPE_KIND_POINTER);
+}
+
+static VmOpcode load_opcode(Type *type) {
+  switch (type->size) {
+  case 1:
+    return VM_OPCODE_LOAD_BYTE;
+  case 4:
+    return VM_OPCODE_LOAD_LONG;
+  default:
+    return VM_OPCODE_LOAD_QUAD;
+  }
+}
+
+static VmOpcode store_opcode(Type *type) {
+  switch (type->size) {
+  case 1:
+    return VM_OPCODE_STORE_BYTE;
+  case 4:
+    return VM_OPCODE_STORE_LONG;
+  default:
+    return VM_OPCODE_STORE_QUAD;
+  }
+}
+
+static VmOpcode store_local_opcode(Type *type) {
+  return type->size == 4 ? VM_OPCODE_STORE_LOCAL_LONG : VM_OPCODE_STORE_LOCAL_QUAD;
+}
+
+static void compile_variable_address(LocalVariable *variable) {
+  emit(variable->is_global ? VM_OPCODE_GLOBAL_ADDRESS : VM_OPCODE_LOCAL_ADDRESS, push_register(), variable->offset, 0);
+}
+
+// Evaluates the address of a variable or a dereference.
+static void compile_address(Node *node) {
+  switch (node->kind) {
+  case NODE_KIND_ADDRESS:
+    compile_address(node->node);
+    break;
+  case NODE_KIND_DEREFERENCE:
+    compile(node->node);
+    break;
+  case NODE_KIND_LOCAL_VARIABLE:
+    compile_variable_address(node->local_variable);
+    break;
+  default:
+    fprintf(stderr, "Unexpected node.\n");
+    exit(1);
+  }
+}
+
+// Loads a variable or a dereference, sign-extending char and int.
+static void compile_load(Node *node) {
+  if (node->kind == NODE_KIND_LOCAL_VARIABLE && is_direct_local(node->local_variable)) {
+    emit(node->type->size == 4 ? VM_OPCODE_LOAD_LOCAL_LONG : VM_OPCODE_LOAD_LOCAL_QUAD, push_register(), node->local_variable->offset, 0);
+    return;
+  }
+  compile_address(node);
+  emit(load_opcode(node->type), top_register(), top_register(), 0);
+}
+
+// Evaluates both operands and combines them into the register of the left hand side.
+static void compile_binary(Node *node, VmOpcode opcode) {
+  compile(node->binary.lhs);
+  compile(node->binary.rhs);
+  register_depth--;
+  emit(opcode, top_register(), top_register(), register_depth);
+}
+
+// Offsets by a constant are scaled at compile time.
+static void compile_pointer_arithmetic(Node *node, int sign) {
+  int size = node->binary.lhs->type->pointed_type->size;
+  compile(node->binary.lhs);
+  if (node->binary.rhs->kind == NODE_KIND_NUMBER) {
+    emit(VM_OPCODE_ADD_IMMEDIATE, top_register(), top_register(), sign * node->binary.rhs->value * size);
+    return;
+  }
+  compile(node->binary.rhs);
+  emit(VM_OPCODE_MULTIPLY_IMMEDIATE, top_register(), top_register(), size);
+  register_depth--;
+  emit(sign > 0 ? VM_OPCODE_ADD : VM_OPCODE_SUBTRACT, top_register(), top_register(), register_depth);
+}
+
+static void compile_statement(Node *node) {
+  compile(node);
+  register_depth = 0;
+}
+
+// Evaluates condition and emits a jump taken when it is zero, returning the jump to be patched.
+// Comparisons jump on their operands directly instead of materializing 0 or 1.
+static int compile_condition(Node *condition) {
+  VmOpcode opcode;
+  switch (condition->kind) {
+  case NODE_KIND_EQ:
+    opcode = VM_OPCODE_JUMP_UNLESS_EQ;
+    break;
+  case NODE_KIND_LE:
+    opcode = VM_OPCODE_JUMP_UNLESS_LE;
+    break;
+  case NODE_KIND_LT:
+    opcode = VM_OPCODE_JUMP_UNLESS_LT;
+    break;
+  case NODE_KIND_NE:
+    opcode = VM_OPCODE_JUMP_UNLESS_NE;
+    break;
+  default:
+    compile(condition);
+    register_depth--;
+    return emit(VM_OPCODE_JUMP_IF_ZERO, register_depth, 0, 0);
+  }
+  int lhs = register_depth;
+  compile(condition->binary.lhs);
+  compile(condition->binary.rhs);
+  register_depth = lhs;
+  return emit(opcode, lhs, lhs + 1, 0);
+}
+
+static void compile_assign(Node *node) {
+  Node *lhs = node->binary.lhs;
+  compile(node->binary.rhs);
+  if (lhs->kind == NODE_KIND_LOCAL_VARIABLE && is_direct_local(lhs->local_variable)) {
+    emit(store_local_opcode(node->type), lhs->local_variable->offset, top_register(), 0);
+    return;
+  }
+  compile_address(lhs);
+  emit(store_opcode(node->type), top_register(), top_register() - 1, 0);
+  register_depth--;
+}
+
+static void compile_block(Node *node) {
+  for (Nodes *nodes = node->block.nodes; nodes != NULL; nodes = nodes->next) {
+    compile_statement(nodes->node);
+  }
+}
+
+static void compile_diff_pointer(Node *node) {
+  compile_binary(node, VM_OPCODE_SUBTRACT);
+  emit(VM_OPCODE_DIVIDE_IMMEDIATE, top_register(), top_register(), node->binary.lhs->type->pointed_type->size);
+}
+
+static void compile_for(Node *node) {
+  compile_statement(node->for_statement.initialization);
+  int begin = function->length;
+  int exit_jump = -1;
+  if (node->for_statement.condition) {
+    exit_jump = compile_condition(node->for_statement.condition);
+  }
+  compile_statement(node->for_statement.statement);
+  compile_statement(node->for_statement.afterthrough);
+  emit(VM_OPCODE_JUMP, 0, 0, begin - function->length);
+  if (exit_jump >= 0) {
+    patch_jump(exit_jump);
+  }
+}
+
+// Arguments are evaluated into consecutive registers, which become the first registers of the callee,
+// and the first of them receives the return value.
+static void compile_function_call(Node *node) {
+  int first = register_depth;
+  int arguments_count = 0;
+  for (Nodes *nodes = node->function_call.parameters; nodes != NULL; nodes = nodes->next) {
+    compile(nodes->node);
+    arguments_count++;
+  }
+  register_depth = first;
+  emit(VM_OPCODE_CALL, push_register(), find_function(node->function_call.symbol), arguments_count);
+}
+
+static void compile_function_definition(Node *node) {
+  function = &program->functions[find_function(node->function_definition.symbol)];
+  function->frame_size = align_to(node->function_definition.frame_size, 16);
+
+  // Arguments arrive in the first registers and are stored into their variables.
+  register_depth = 0;
+  for (Nodes *nodes = node->function_definition.parameters; nodes != NULL; nodes = nodes->next) {
+    push_register();
+  }
+  int i = 0;
+  for (Nodes *nodes = node->function_definition.parameters; nodes != NULL; nodes = nodes->next) {
+    LocalVariable *variable = nodes->node->local_variable;
+    if (is_direct_local(variable)) {
+      emit(store_local_opcode(variable->type), variable->offset, i, 0);
+    } else {
+      compile_variable_address(variable);
+      emit(store_opcode(variable->type), top_register(), i, 0);
+      register_depth--;
+    }
+    i++;
+  }
+
+  register_depth = 0;
+  compile(node->function_definition.block);
+
+  // Falling off the end returns 0, rather than running into the next function.
+  emit(VM_OPCODE_MOVE_IMMEDIATE, push_register(), 0, 0);
+  emit(VM_OPCODE_RETURN, top_register(), 0, 0);
+  register_depth = 0;
+}
+
+static void compile_global_variable_definition(Node *node) {
+  if (node->local_variable->offset > program->globals_size) {
+    program->globals_size = node->local_variable->offset;
+  }
+}
+
+static void compile_if(Node *node) {
+  int else_jump = compile_condition(node->if_statement.condition);
+  compile_statement(node->if_statement.true_statement);
+  if (node->if_statement.false_statement) {
+    int end_jump = emit(VM_OPCODE_JUMP, 0, 0, 0);
+    patch_jump(else_jump);
+    compile_statement(node->if_statement.false_statement);
+    patch_jump(end_jump);
+  } else {
+    patch_jump(else_jump);
+  }
+}
+
+static void compile_local_variable(Node *node) {
+  if (node->type->kind == TYPE_KIND_ARRAY) {
+    compile_address(node);
+  } else {
+    compile_load(node);
+  }
+}
+
+static void compile_dereference(Node *node) {
+  if (node->type->kind == TYPE_KIND_ARRAY) {
+    compile(node->node);
+  } else {
+    compile_load(node);
+  }
+}
+
+// Functions are numbered before any body is compiled, so that calls can refer to functions defined later.
+static void compile_program(Node *node) {
+  for (Nodes *nodes = node->program.nodes; nodes != NULL; nodes = nodes->next) {
+    if (nodes->node->kind == NODE_KIND_FUNCTION_DEFINITION) {
+      program->functions_count++;
+    }
+  }
+  program->functions = calloc(program->functions_count, sizeof(VmFunction));
+  int i = 0;
+  for (Nodes *nodes = node->program.nodes; nodes != NULL; nodes = nodes->next) {
+    if (nodes->node->kind == NODE_KIND_FUNCTION_DEFINITION) {
+      program->functions[i++].symbol = nodes->node->function_definition.symbol;
+    }
+  }
+  for (Nodes *nodes = node->program.nodes; nodes != NULL; nodes = nodes->next) {
+    compile(nodes->node);
+  }
+  program->globals_size = align_to(program->globals_size, 16);
+}
+
+static void compile_return(Node *node) {
+  compile(node->return_statement.expression);
+  emit(VM_OPCODE_RETURN, top_register(), 0, 0);
+}
+
+static void compile_while(Node *node) {
+  int begin = function->length;
+  int exit_jump = compile_condition(node->while_statement.condition);
+  compile_statement(node->while_statement.statement);
+  emit(VM_OPCODE_JUMP, 0, 0, begin - function->length);
+  patch_jump(exit_jump);
+}
+
+static void compile(Node *node) {
+  if (node == NULL) {
+    return;
+  }
+
+  switch (node->kind) {
+  case NODE_KIND_ADD:
+    compile_binary(node, VM_OPCODE_ADD);
+    break;
+  case NODE_KIND_ADD_POINTER:
+    compile_pointer_arithmetic(node, 1);
+    break;
+  case NODE_KIND_ADDRESS:
+    compile_address(node->node);
+    break;
+  case NODE_KIND_ASSIGN:
+    compile_assign(node);
+    break;
+  case NODE_KIND_BLOCK:
+    compile_block(node);
+    break;
+  case NODE_KIND_DEREFERENCE:
+    compile_dereference(node);
+    break;
+  case NODE_KIND_DIFF_POINTER:
+    compile_diff_pointer(node);
+    break;
+  case NODE_KIND_DIVIDE:
+    compile_binary(node, VM_OPCODE_DIVIDE);
+    break;
+  case NODE_KIND_EQ:
+    compile_binary(node, VM_OPCODE_EQ);
+    break;
+  case NODE_KIND_FOR:
+    compile_for(node);
+    break;
+  case NODE_KIND_FUNCTION_CALL:
+    compile_function_call(node);
+    break;
+  case NODE_KIND_FUNCTION_DEFINITION:
+    compile_function_definition(node);
+    break;
+  case NODE_KIND_GLOBAL_VARIABLE_DEFINITION:
+    compile_global_variable_definition(node);
+    break;
+  case NODE_KIND_IF:
+    compile_if(node);
+    break;
+  case NODE_KIND_LE:
+    compile_binary(node, VM_OPCODE_LE);
+    break;
+  case NODE_KIND_LOCAL_VARIABLE:
+    compile_local_variable(node);
+    break;
+  case NODE_KIND_LT:
+    compile_binary(node, VM_OPCODE_LT);
+    break;
+  case NODE_KIND_MULTIPLY:
+    compile_binary(node, VM_OPCODE_MULTIPLY);
+    break;
+  case NODE_KIND_NE:
+    compile_binary(node, VM_OPCODE_NE);
+    break;
+  case NODE_KIND_NUMBER:
+    emit(VM_OPCODE_MOVE_IMMEDIATE, push_register(), node->value, 0);
+    break;
+  case NODE_KIND_PROGRAM:
+    compile_program(node);
+    break;
+  case NODE_KIND_RETURN:
+    compile_return(node);
+    break;
+  case NODE_KIND_SUBTRACT:
+    compile_binary(node, VM_OPCODE_SUBTRACT);
+    break;
+  case NODE_KIND_SUBTRACT_POINTER:
+    compile_pointer_arithmetic(node, -1);
+    break;
+  case NODE_KIND_WHILE:
+    compile_while(node);
+    break;
+  default:
+    fprintf(stderr, "Unexpected node.\n");
+    exit(1);
+  }
+}
+
+// Lowers a parsed program to bytecode for the interpreter in vm.c.
+VmProgram *compile_bytecode(Node *node) {
+  program = calloc(1, sizeof(VmProgram));
+  compile(node);
+  return program;
+}
+
+void free_bytecode(VmProgram *program_) {
+  for (int i = 0; i < program_->functions_count; i++) {
+    free(program_->functions[i].code);
+  }
+  free(program_->functions);
+  free(program_);
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "parser.h" // Node
+#include "symbol.h" // Symbol
+
+// Instructions of a register machine. Registers hold 64-bit values, and each function call gets its own registers.
+// Operands are register numbers unless noted otherwise.
+typedef enum {
+  VM_OPCODE_ADD,                // a = b + c
+  VM_OPCODE_ADD_IMMEDIATE,      // a = b + immediate c
+  VM_OPCODE_CALL,               // a = function b(a, a + 1, ..., a + c - 1)
+  VM_OPCODE_DIVIDE,             // a = b / c
+  VM_OPCODE_DIVIDE_IMMEDIATE,   // a = b / immediate c
+  VM_OPCODE_EQ,                 // a = b == c
+  VM_OPCODE_GLOBAL_ADDRESS,     // a = address of the global variable at offset b
+  VM_OPCODE_JUMP,               // jump by c instructions
+  VM_OPCODE_JUMP_IF_ZERO,       // jump by c instructions if a == 0
+  VM_OPCODE_JUMP_UNLESS_EQ,     // jump by c instructions unless a == b
+  VM_OPCODE_JUMP_UNLESS_LE,     // jump by c instructions unless a <= b
+  VM_OPCODE_JUMP_UNLESS_LT,     // jump by c instructions unless a < b
+  VM_OPCODE_JUMP_UNLESS_NE,     // jump by c instructions unless a != b
+  VM_OPCODE_LE,                 // a = b <= c
+  VM_OPCODE_LOAD_BYTE,          // a = *(char *)b
+  VM_OPCODE_LOAD_LOCAL_LONG,    // a = *(int *)(frame pointer - b)
+  VM_OPCODE_LOAD_LOCAL_QUAD,    // a = *(long *)(frame pointer - b)
+  VM_OPCODE_LOAD_LONG,          // a = *(int *)b
+  VM_OPCODE_LOAD_QUAD,          // a = *(long *)b
+  VM_OPCODE_LOCAL_ADDRESS,      // a = frame pointer - b
+  VM_OPCODE_LT,                 // a = b < c
+  VM_OPCODE_MOVE_IMMEDIATE,     // a = immediate b
+  VM_OPCODE_MULTIPLY,           // a = b * c
+  VM_OPCODE_MULTIPLY_IMMEDIATE, // a = b * immediate c
+  VM_OPCODE_NE,                 // a = b != c
+  VM_OPCODE_RETURN,             // return a
+  VM_OPCODE_STORE_BYTE,         // *(char *)a = b
+  VM_OPCODE_STORE_LOCAL_LONG,   // *(int *)(frame pointer - a) = b
+  VM_OPCODE_STORE_LOCAL_QUAD,   // *(long *)(frame pointer - a) = b
+  VM_OPCODE_STORE_LONG,         // *(int *)a = b
+  VM_OPCODE_STORE_QUAD,         // *(long *)a = b
+  VM_OPCODE_SUBTRACT,           // a = b - c
+  VM_OPCODES_COUNT,
+} VmOpcode;
+
+typedef struct VmInstruction VmInstruction;
+
+struct VmInstruction {
+  VmOpcode opcode;
+  int a;
+  int b;
+  int c;
+};
+
+typedef struct VmFunction VmFunction;
+
+struct VmFunction {
+  Symbol *symbol;
+  VmInstruction *code;
+  int length;
+  int capacity;
+
+  // Bytes of local variables below the frame pointer.
+  int frame_size;
+  int registers_count;
+};
+
+typedef struct VmProgram VmProgram;
+
+struct VmProgram {
+  VmFunction *functions;
+  int functions_count;
+
+  // Bytes of global variables, addressed downward from the end of their area like local variables.
+  int globals_size;
+};
+
+VmProgram *compile_bytecode(Node *program);
+void free_bytecode(VmProgram *program);
@@ -1,69 +1,440 @@
+#define _POSIX_C_SOURCE 200809L // sysconf
+
+#include "code_generator.h"
+#include "frame.h"
+#include "instruction.h"
+#include "ir.h"
+#include "ir_code_generator.h"
+#include "ir_optimizer.h"
+#include "object.h"
+#include "output.h"
 #include "parser.h"
+#include "peephole.h"
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
-static char *register_names_1byte[] = {
-    "dil",
-    "sil",
-    "dl",
-    "cl",
-    "r8b",
-    "r9b"};
+static Register argument_registers[] = {
+    REGISTER_RDI,
+    REGISTER_RSI,
+    REGISTER_RDX,
+    REGISTER_RCX,
+    REGISTER_R8,
+    REGISTER_R9};
 
-static char *register_names_8byte[] = {
-    "rdi",
-    "rsi",
-    "rdx",
-    "rcx",
-    "r8",
-    "r9"};
+// Registers for intermediate values of expressions, used as a stack.
+// None of them is clobbered by idiv, and rcx is left as a scratch register for spilling.
+#define TEMPORARY_REGISTERS_COUNT 6
 
-int label_counter;
+static Register temporary_registers[] = {
+    REGISTER_RDI,
+    REGISTER_RSI,
+    REGISTER_R8,
+    REGISTER_R9,
+    REGISTER_R10,
+    REGISTER_R11};
+
+// Callee-saved registers holding local variables, so that they survive calls without being saved around them.
+#define PROMOTED_REGISTERS_COUNT 5
+
+static Register promoted_registers[] = {
+    REGISTER_RBX,
+    REGISTER_R12,
+    REGISTER_R13,
+    REGISTER_R14,
+    REGISTER_R15};
+
+typedef struct GeneratedFunction GeneratedFunction;
+
+// Function definition generated by a worker thread, kept until every function before it is written out.
+struct GeneratedFunction {
+  Node *definition;
+
+  // Instructions to be encoded into the object file.
+  InstructionList *instructions;
+
+  // Assembly, when no object file is being written.
+  Output *text;
+};
+
+int generator_jobs;
+bool generator_uses_ssa;
+bool generator_dumps_ir;
+
+// Function definitions of the program, taken by worker threads in turn.
+static GeneratedFunction *generated_functions;
+static int generated_functions_count;
+static atomic_int next_generated_function;
+
+// Functions generated so far by generate_definition, which number their labels.
+static int streamed_functions_count;
+
+// Section the assembly is in, so that a directive is emitted only when it changes.
+static char *current_section;
+
+// State of the function being generated. Each worker thread generates its own functions.
+// Labels are numbered from 0 in each function.
+_Thread_local int label_counter;
+
+// Number of temporary registers holding live values.
+_Thread_local int register_depth;
+
+// Bytes pushed onto the stack since the prologue, which leaves rsp aligned to 16 bytes.
+_Thread_local int stack_depth;
+
+// Instructions of the function being generated, printed after the peephole pass.
+_Thread_local InstructionList *instructions;
+
+// Variables of the function being generated that live in promoted_registers, in the same order.
+_Thread_local LocalVariable *promoted_variables[PROMOTED_REGISTERS_COUNT];
+_Thread_local int promoted_variables_count;
+
+// Offset from rbp of the area the promoted registers are saved into.
+_Thread_local int saved_registers_offset;
 
 int align(int target, int unit) {
-  return (target + unit) & ~(unit - 1);
+  return (target + unit - 1) & ~(unit - 1);
+}
+
+void generate(Node *node);
+void generate_address(Node *node);
+
+Operand register64(Register register_) {
+  return register_operand(register_, 8);
+}
+
+Operand register8(Register register_) {
+  return register_operand(register_, 1);
+}
+
+void instruction0(Opcode opcode) {
+  append_instruction(instructions, opcode, (Operand){0}, (Operand){0});
+}
+
+void instruction1(Opcode opcode, Operand operand) {
+  append_instruction(instructions, opcode, operand, (Operand){0});
+}
+
+void instruction2(Opcode opcode, Operand lhs, Operand rhs) {
+  append_instruction(instructions, opcode, lhs, rhs);
+}
+
+void label(int label) {
+  instruction1(OPCODE_LABEL, label_operand(label));
+}
+
+void push(Register register_) {
+  instruction1(OPCODE_PUSH, register64(register_));
+  stack_depth += 8;
+}
+
+void pop(Register register_) {
+  instruction1(OPCODE_POP, register64(register_));
+  stack_depth -= 8;
+}
+
+// Returns the register at the top of the register stack.
+Register top_register(void) {
+  return temporary_registers[register_depth - 1];
+}
+
+Register push_register(void) {
+  if (register_depth == TEMPORARY_REGISTERS_COUNT) {
+    fprintf(stderr, "Temporary registers are exhausted.\n");
+    exit(1);
+  }
+  return temporary_registers[register_depth++];
+}
+
+int combine_register_needs(int lhs, int rhs) {
+  if (lhs == rhs) {
+    return lhs + 1;
+  }
+  return lhs > rhs ? lhs : rhs;
+}
+
+int address_register_need(Node *node);
+
+// Sethi-Ullman number: how many registers are needed to evaluate node without spilling.
+int register_need(Node *node) {
+  if (node->register_need) {
+    return node->register_need;
+  }
+  int need;
+  switch (node->kind) {
+  case NODE_KIND_ADDRESS:
+    need = address_register_need(node->node);
+    break;
+  case NODE_KIND_ASSIGN:
+    need = combine_register_needs(address_register_need(node->binary.lhs), register_need(node->binary.rhs));
+    break;
+  case NODE_KIND_DEREFERENCE:
+    need = register_need(node->node);
+    break;
+  case NODE_KIND_ADD:
+  case NODE_KIND_ADD_POINTER:
+  case NODE_KIND_DIFF_POINTER:
+  case NODE_KIND_DIVIDE:
+  case NODE_KIND_EQ:
+  case NODE_KIND_LE:
+  case NODE_KIND_LT:
+  case NODE_KIND_MULTIPLY:
+  case NODE_KIND_NE:
+  case NODE_KIND_SUBTRACT:
+  case NODE_KIND_SUBTRACT_POINTER:
+    need = combine_register_needs(register_need(node->binary.lhs), register_need(node->binary.rhs));
+    break;
+  default:
+    // Function calls save the live registers and start from an empty register stack.
+    need = 1;
+  }
+  node->register_need = need;
+  return need;
+}
+
+int address_register_need(Node *node) {
+  if (node->kind == NODE_KIND_DEREFERENCE) {
+    return register_need(node->node);
+  }
+  return 1;
 }
 
-void load(Type *type) {
-  printf("  pop rax\n");
-  if (type->size == 1) {
-    printf("  movsx rax, BYTE PTR [rax]\n");
+typedef void (*Generator)(Node *node);
+
+// Evaluates two operands, the one needing more registers first, and stores the registers holding them.
+// The register stack grows by one, and the caller is expected to leave the result in its top.
+// When there is no register left for the second operand, the first one is spilled onto the stack.
+void generate_operands(Node *lhs, Generator lhs_generator, Node *rhs, Generator rhs_generator, Register *lhs_register, Register *rhs_register) {
+  bool swapped = register_need(rhs) > register_need(lhs);
+  Node *first = swapped ? rhs : lhs;
+  Node *second = swapped ? lhs : rhs;
+  Generator first_generator = swapped ? rhs_generator : lhs_generator;
+  Generator second_generator = swapped ? lhs_generator : rhs_generator;
+
+  Register first_register;
+  Register second_register;
+  first_generator(first);
+  if (register_depth == TEMPORARY_REGISTERS_COUNT) {
+    push(top_register());
+    register_depth--;
+    second_generator(second);
+    instruction2(OPCODE_MOV, register64(REGISTER_RCX), register64(top_register()));
+    pop(top_register());
+    first_register = top_register();
+    second_register = REGISTER_RCX;
   } else {
-    printf("  mov rax, [rax]\n");
+    second_generator(second);
+    first_register = temporary_registers[register_depth - 2];
+    second_register = top_register();
+    register_depth--;
+  }
+
+  *lhs_register = swapped ? second_register : first_register;
+  *rhs_register = swapped ? first_register : second_register;
+}
+
+void generate_binary_operands(Node *node, Register *lhs_register, Register *rhs_register) {
+  generate_operands(node->binary.lhs, generate, node->binary.rhs, generate, lhs_register, rhs_register);
+}
+
+// Moves the result of a binary operation into the top of the register stack.
+void move_to_top(Register register_) {
+  if (register_ != top_register()) {
+    instruction2(OPCODE_MOV, register64(top_register()), register64(register_));
   }
-  printf("  push rax\n");
 }
 
-void store(Type *type) {
-  printf("  pop rdi\n");
-  printf("  pop rax\n");
-  if (type->size == 1) {
-    printf("  mov [rax], dil\n");
+// Returns the set instruction of a comparison node, or OPCODE_NOP for other nodes.
+Opcode set_of_comparison(NodeKind kind) {
+  switch (kind) {
+  case NODE_KIND_EQ:
+    return OPCODE_SETE;
+  case NODE_KIND_LE:
+    return OPCODE_SETLE;
+  case NODE_KIND_LT:
+    return OPCODE_SETL;
+  case NODE_KIND_NE:
+    return OPCODE_SETNE;
+  default:
+    return OPCODE_NOP;
+  }
+}
+
+// Returns the set instruction testing the same condition with the operands of cmp swapped.
+Opcode swap_set(Opcode opcode) {
+  switch (opcode) {
+  case OPCODE_SETG:
+    return OPCODE_SETL;
+  case OPCODE_SETGE:
+    return OPCODE_SETLE;
+  case OPCODE_SETL:
+    return OPCODE_SETG;
+  case OPCODE_SETLE:
+    return OPCODE_SETGE;
+  default:
+    return opcode;
+  }
+}
+
+// Emits cmp for a comparison node, and returns the set instruction for its result.
+// A number operand is compared as an immediate, so a > 1, which is parsed as 1 < a, becomes cmp a, 1 and setg.
+// The register stack grows by one, like other binary operations.
+Opcode generate_compare(Node *node) {
+  Opcode opcode = set_of_comparison(node->kind);
+  if (node->binary.rhs->kind == NODE_KIND_NUMBER) {
+    generate(node->binary.lhs);
+    instruction2(OPCODE_CMP, register64(top_register()), immediate_operand(node->binary.rhs->value));
+    return opcode;
+  }
+  if (node->binary.lhs->kind == NODE_KIND_NUMBER) {
+    generate(node->binary.rhs);
+    instruction2(OPCODE_CMP, register64(top_register()), immediate_operand(node->binary.lhs->value));
+    return swap_set(opcode);
+  }
+  Register lhs;
+  Register rhs;
+  generate_binary_operands(node, &lhs, &rhs);
+  instruction2(OPCODE_CMP, register64(lhs), register64(rhs));
+  return opcode;
+}
+
+void generate_comparison(Node *node) {
+  Opcode opcode = generate_compare(node);
+  instruction1(opcode, register8(REGISTER_RAX));
+  instruction2(OPCODE_MOVZX, register64(top_register()), register8(REGISTER_RAX));
+}
+
+bool is_scale(int size) {
+  return size == 1 || size == 2 || size == 4 || size == 8;
+}
+
+// Whether p + i can be folded into [p+i*scale], leaving a register for i.
+bool can_index(Node *node) {
+  return node->kind == NODE_KIND_ADD_POINTER && is_scale(node->binary.lhs->type->pointed_type->size) && register_depth + 1 < TEMPORARY_REGISTERS_COUNT;
+}
+
+Register promoted_register(LocalVariable *variable) {
+  return promoted_registers[variable->promoted_index];
+}
+
+// Assigns a register to a promoted variable, narrowing it to char the way a store into memory would.
+void move_to_variable(LocalVariable *variable, Register value) {
+  if (variable->type->size == 1) {
+    instruction2(OPCODE_MOVSX, register64(promoted_register(variable)), register8(value));
   } else {
-    printf("  mov [rax], rdi\n");
+    instruction2(OPCODE_MOV, register64(promoted_register(variable)), register64(value));
   }
-  printf("  push rdi\n");
 }
 
-void generate(Node *node);
+Operand variable_operand(LocalVariable *variable, int size) {
+  if (variable->is_global) {
+    return global_memory_operand(variable->symbol, size);
+  }
+  return memory_operand(REGISTER_RBP, -variable->offset, size);
+}
+
+// Turns an addressing mode into [R] by computing the address into a register.
+Operand materialize_address(Operand operand, int *held_registers) {
+  register_depth -= *held_registers;
+  Register address = push_register();
+  instruction2(OPCODE_LEA, register64(address), operand);
+  *held_registers = 1;
+  return memory_operand(address, 0, 0);
+}
+
+// Evaluates pointer into an addressing mode instead of a register where possible,
+// so that variables become [rbp-off] or sym[rip], constant offsets become displacements, and p + i becomes [p+i*scale].
+// The registers used by the operand stay in the register stack, and their count is stored in held_registers.
+Operand generate_address_operand(Node *pointer, int *held_registers) {
+  if (pointer->kind == NODE_KIND_ADDRESS && pointer->node->kind == NODE_KIND_LOCAL_VARIABLE) {
+    *held_registers = 0;
+    return variable_operand(pointer->node->local_variable, 0);
+  }
+  if (pointer->kind == NODE_KIND_LOCAL_VARIABLE && pointer->type->kind == TYPE_KIND_ARRAY) {
+    *held_registers = 0;
+    return variable_operand(pointer->local_variable, 0);
+  }
+  if ((pointer->kind == NODE_KIND_ADD_POINTER || pointer->kind == NODE_KIND_SUBTRACT_POINTER) && pointer->binary.rhs->kind == NODE_KIND_NUMBER) {
+    Operand operand = generate_address_operand(pointer->binary.lhs, held_registers);
+    int offset = pointer->binary.rhs->value * pointer->binary.lhs->type->pointed_type->size;
+    operand.value += pointer->kind == NODE_KIND_ADD_POINTER ? offset : -offset;
+    return operand;
+  }
+  if (can_index(pointer)) {
+    Operand operand = generate_address_operand(pointer->binary.lhs, held_registers);
+    if (operand.base == REGISTER_RIP || operand.index != REGISTER_NONE) {
+      operand = materialize_address(operand, held_registers);
+    }
+    generate(pointer->binary.rhs);
+    (*held_registers)++;
+    operand.index = top_register();
+    operand.scale = pointer->binary.lhs->type->pointed_type->size;
+    return operand;
+  }
+  generate(pointer);
+  *held_registers = 1;
+  return memory_operand(top_register(), 0, 0);
+}
+
+// Evaluates a variable or a dereference into a memory operand.
+Operand generate_memory_operand(Node *node, int *held_registers) {
+  Operand operand;
+  if (node->kind == NODE_KIND_LOCAL_VARIABLE) {
+    *held_registers = 0;
+    operand = variable_operand(node->local_variable, 0);
+  } else {
+    operand = generate_address_operand(node->node, held_registers);
+  }
+  operand.size = node->type->size;
+  return operand;
+}
+
+// Loads a variable or a dereference into a new register with a single instruction.
+// char and int are sign-extended, so that registers always hold 64-bit values and arithmetic on them needs no narrowing.
+void generate_load(Node *node) {
+  int held_registers;
+  Operand memory = generate_memory_operand(node, &held_registers);
+  register_depth -= held_registers;
+  if (memory.size != 8) {
+    instruction2(OPCODE_MOVSX, register64(push_register()), memory);
+  } else {
+    instruction2(OPCODE_MOV, register64(push_register()), memory);
+  }
+}
+
+// Computes p + n, p - n and p + i by lea.
+void generate_lea(Node *node) {
+  int held_registers;
+  Operand operand = generate_address_operand(node, &held_registers);
+  register_depth -= held_registers;
+  Register address = push_register();
+  if (operand.base != address || operand.index != REGISTER_NONE || operand.value != 0) {
+    instruction2(OPCODE_LEA, register64(address), operand);
+  }
+}
 
 void generate_add(Node *node) {
-  generate(node->binary.lhs);
-  generate(node->binary.rhs);
-  printf("  pop rdi\n");
-  printf("  pop rax\n");
-  printf("  add rax, rdi\n");
-  printf("  push rax\n");
+  Register lhs;
+  Register rhs;
+  generate_binary_operands(node, &lhs, &rhs);
+  instruction2(OPCODE_ADD, register64(lhs), register64(rhs));
+  move_to_top(lhs);
 }
 
+// Offsets by a constant are scaled at compile time.
 void generate_add_pointer(Node *node) {
-  generate(node->binary.lhs);
-  generate(node->binary.rhs);
-  printf("  pop rdi\n");
-  printf("  pop rax\n");
-  printf("  imul rdi, %i\n", node->binary.lhs->type->pointed_type->size);
-  printf("  add rax, rdi\n");
-  printf("  push rax\n");
+  if (node->binary.rhs->kind == NODE_KIND_NUMBER || can_index(node)) {
+    generate_lea(node);
+    return;
+  }
+  Register lhs;
+  Register rhs;
+  generate_binary_operands(node, &lhs, &rhs);
+  instruction2(OPCODE_IMUL, register64(rhs), immediate_operand(node->binary.lhs->type->pointed_type->size));
+  instruction2(OPCODE_ADD, register64(lhs), register64(rhs));
+  move_to_top(lhs);
 }
 
 void generate_address(Node *node) {
@@ -75,272 +446,429 @@ void generate_address(Node *node) {
     generate(node->node);
     break;
   case NODE_KIND_LOCAL_VARIABLE:
-    if (node->local_variable->is_global) {
-      printf("  lea rax, %.*s[rip]\n", node->local_variable->name_length, node->local_variable->name);
-    } else {
-      printf("  mov rax, rbp\n");
-      printf("  sub rax, %d\n", node->local_variable->offset);
-    }
-    printf("  push rax\n");
+    instruction2(OPCODE_LEA, register64(push_register()), variable_operand(node->local_variable, 0));
     break;
   }
 }
 
+// The value is evaluated first, and stored by a single mov into the addressing mode of the left hand side.
+// When registers are too few for that, the address is computed into a register instead.
 void generate_assign(Node *node) {
-  generate_address(node->binary.lhs);
-  generate(node->binary.rhs);
-  store(node->type);
+  if (node->binary.lhs->kind == NODE_KIND_LOCAL_VARIABLE && node->binary.lhs->local_variable->is_promoted) {
+    generate(node->binary.rhs);
+    move_to_variable(node->binary.lhs->local_variable, top_register());
+    return;
+  }
+  if (register_depth + 3 <= TEMPORARY_REGISTERS_COUNT) {
+    generate(node->binary.rhs);
+    Register value = top_register();
+    int held_registers;
+    Operand memory = generate_memory_operand(node->binary.lhs, &held_registers);
+    instruction2(OPCODE_MOV, memory, register_operand(value, node->type->size));
+    register_depth -= held_registers;
+    return;
+  }
+  Register address;
+  Register value;
+  generate_operands(node->binary.lhs, generate_address, node->binary.rhs, generate, &address, &value);
+  instruction2(OPCODE_MOV, memory_operand(address, 0, node->type->size), register_operand(value, node->type->size));
+  move_to_top(value);
+}
+
+void generate_statement(Node *node) {
+  generate(node);
+  register_depth = 0;
 }
 
 void generate_block(Node *node) {
   for (Nodes *nodes = node->block.nodes; nodes != NULL; nodes = nodes->next) {
-    generate(nodes->node);
+    generate_statement(nodes->node);
   }
 }
 
 void generate_dereference(Node *node) {
-  generate(node->node);
-  if (node->type->kind != TYPE_KIND_ARRAY) {
-    load(node->type);
+  if (node->type->kind == TYPE_KIND_ARRAY) {
+    generate(node->node);
+  } else {
+    generate_load(node);
   }
 }
 
 void generate_diff_pointer(Node *node) {
-  generate(node->binary.lhs);
-  generate(node->binary.rhs);
-  printf("  pop rdi\n");
-  printf("  pop rax\n");
-  printf("  sub rax, rdi\n");
-  printf("  mov rdi, %i\n", node->binary.lhs->type->pointed_type->size);
-  printf("  cqo\n");
-  printf("  idiv rdi\n");
-  printf("  push rax\n");
+  Register lhs;
+  Register rhs;
+  generate_binary_operands(node, &lhs, &rhs);
+  instruction2(OPCODE_SUB, register64(lhs), register64(rhs));
+  instruction2(OPCODE_MOV, register64(REGISTER_RAX), register64(lhs));
+  instruction2(OPCODE_MOV, register64(REGISTER_RCX), immediate_operand(node->binary.lhs->type->pointed_type->size));
+  instruction0(OPCODE_CQO);
+  instruction1(OPCODE_IDIV, register64(REGISTER_RCX));
+  instruction2(OPCODE_MOV, register64(top_register()), register64(REGISTER_RAX));
 }
 
 void generate_divide(Node *node) {
-  generate(node->binary.lhs);
-  generate(node->binary.rhs);
-  printf("  pop rdi\n");
-  printf("  pop rax\n");
-  printf("  cqo\n");
-  printf("  idiv rdi\n");
-  printf("  push rax\n");
+  Register lhs;
+  Register rhs;
+  generate_binary_operands(node, &lhs, &rhs);
+  instruction2(OPCODE_MOV, register64(REGISTER_RAX), register64(lhs));
+  instruction0(OPCODE_CQO);
+  instruction1(OPCODE_IDIV, register64(rhs));
+  instruction2(OPCODE_MOV, register64(top_register()), register64(REGISTER_RAX));
 }
 
 void generate_eq(Node *node) {
-  generate(node->binary.lhs);
-  generate(node->binary.rhs);
-  printf("  pop rdi\n");
-  printf("  pop rax\n");
-  printf("  cmp rax, rdi\n");
-  printf("  sete al\n");
-  printf("  movzb rax, al\n");
-  printf("  push rax\n");
+  generate_comparison(node);
+}
+
+// Evaluates condition and jumps to the label when it is zero.
+// Comparisons jump on the flags of their own cmp instead of materializing 0 or 1.
+void generate_condition(Node *condition, int false_label) {
+  if (set_of_comparison(condition->kind) != OPCODE_NOP) {
+    Opcode opcode = generate_compare(condition);
+    instruction1(negate_condition(jump_of_set(opcode)), label_operand(false_label));
+  } else {
+    generate(condition);
+    instruction2(OPCODE_CMP, register64(top_register()), immediate_operand(0));
+    instruction1(OPCODE_JE, label_operand(false_label));
+  }
+  register_depth = 0;
 }
 
 void generate_for(Node *node) {
-  int label_count = label_counter++;
-  generate(node->for_statement.initialization);
-  printf(".Lbegin%i:\n", label_count);
+  int begin_label = label_counter++;
+  int end_label = label_counter++;
+  generate_statement(node->for_statement.initialization);
+  label(begin_label);
   if (node->for_statement.condition) {
-    generate(node->for_statement.condition);
-    printf("  pop rax\n");
-    printf("  cmp rax, 0\n");
-    printf("  je .Lend%i\n", label_count);
+    generate_condition(node->for_statement.condition, end_label);
   }
-  generate(node->for_statement.statement);
-  generate(node->for_statement.afterthrough);
-  printf("  jmp .Lbegin%i\n", label_count);
-  printf(".Lend%i:\n", label_count);
+  generate_statement(node->for_statement.statement);
+  generate_statement(node->for_statement.afterthrough);
+  instruction1(OPCODE_JMP, label_operand(begin_label));
+  label(end_label);
 }
 
+// Live temporary registers are saved on the stack, since they are all caller-saved.
+// Arguments are evaluated into the register stack, and then moved into the argument registers.
 void generate_function_call(Node *node) {
+  int saved_register_depth = register_depth;
+  for (int i = 0; i < saved_register_depth; i++) {
+    push(temporary_registers[i]);
+  }
+  register_depth = 0;
+
   int parameters_count = 0;
   for (Nodes *nodes = node->function_call.parameters; nodes != NULL; nodes = nodes->next) {
     generate(nodes->node);
     parameters_count++;
   }
-  while (parameters_count--) {
-    printf("  pop %s\n", register_names_8byte[parameters_count]);
-  }
-  int label_count = label_counter++;
-  printf("  mov rax, rsp\n");
-  printf("  and rax, 15\n");
-  printf("  jnz .Lcall%i\n", label_count);
-  printf("  mov rax, 0\n");
-  printf("  call %.*s\n", node->function_call.name_length, node->function_call.name);
-  printf("  jmp .Lend%i\n", label_count);
-  printf(".Lcall%i:\n", label_count);
-  printf("  sub rsp, 8\n");
-  printf("  mov rax, 0\n");
-  printf("  call %.*s\n", node->function_call.name_length, node->function_call.name);
-  printf("  add rsp, 8\n");
-  printf(".Lend%i:\n", label_count);
-  printf("  push rax\n");
+  for (int i = 0; i < parameters_count; i++) {
+    if (temporary_registers[i] != argument_registers[i]) {
+      instruction2(OPCODE_MOV, register64(argument_registers[i]), register64(temporary_registers[i]));
+    }
+  }
+  register_depth = saved_register_depth;
+
+  // The stack depth is known here, so rsp is padded to 16 bytes only when it needs to be.
+  bool padded = stack_depth % 16 != 0;
+  if (padded) {
+    instruction2(OPCODE_SUB, register64(REGISTER_RSP), immediate_operand(8));
+  }
+  instruction2(OPCODE_MOV, register64(REGISTER_RAX), immediate_operand(0));
+  instruction1(OPCODE_CALL, symbol_operand(node->function_call.symbol));
+  if (padded) {
+    instruction2(OPCODE_ADD, register64(REGISTER_RSP), immediate_operand(8));
+  }
+  // Only eax is defined by a callee returning int.
+  if (node->type->size == 4) {
+    instruction2(OPCODE_MOVSX, register64(push_register()), register_operand(REGISTER_RAX, 4));
+  } else {
+    instruction2(OPCODE_MOV, register64(push_register()), register64(REGISTER_RAX));
+  }
+
+  for (int i = saved_register_depth - 1; i >= 0; i--) {
+    pop(temporary_registers[i]);
+  }
 }
 
+// The most used variables whose address is never taken live in callee-saved registers, which are saved below the
+// other variables by the prologue and restored by each return.
 void generate_function_definition(Node *node) {
-  printf(".global %.*s\n", node->function_definition.name_length, node->function_definition.name);
-  printf("%.*s:\n", node->function_definition.name_length, node->function_definition.name);
-
-  int offset = 0;
-  for (LocalVariable *variable = node->function_definition.scope->local_variable; variable != NULL; variable = variable->next) {
-    offset += variable->type->size;
+  promoted_variables_count = promote_variables(node, promoted_variables, PROMOTED_REGISTERS_COUNT);
+  saved_registers_offset = align(node->function_definition.frame_size, 8);
+  int frame_size = saved_registers_offset + 8 * promoted_variables_count;
+  instruction1(OPCODE_PUSH, register64(REGISTER_RBP));
+  instruction2(OPCODE_MOV, register64(REGISTER_RBP), register64(REGISTER_RSP));
+  instruction2(OPCODE_SUB, register64(REGISTER_RSP), immediate_operand(align(frame_size, 16)));
+  stack_depth = 0;
+  for (int i = 0; i < promoted_variables_count; i++) {
+    instruction2(OPCODE_MOV, memory_operand(REGISTER_RBP, -saved_registers_offset - 8 * (i + 1), 8), register64(promoted_registers[i]));
   }
-  printf("  push rbp\n");
-  printf("  mov rbp, rsp\n");
-  printf("  sub rsp, %i\n", align(offset, 8));
 
   int i = 0;
   for (Nodes *nodes = node->function_definition.parameters; nodes != NULL; nodes = nodes->next) {
-    char *register_name;
-    if (nodes->node->local_variable->type->size == 1) {
-      register_name = register_names_1byte[i];
+    LocalVariable *variable = nodes->node->local_variable;
+    if (!variable->is_promoted) {
+      instruction2(OPCODE_MOV, memory_operand(REGISTER_RBP, -variable->offset, variable->type->size), register_operand(argument_registers[i], variable->type->size));
+    } else if (variable->type->size == 8) {
+      instruction2(OPCODE_MOV, register64(promoted_register(variable)), register64(argument_registers[i]));
     } else {
-      register_name = register_names_8byte[i];
+      // Callers may leave garbage above the argument, so it is sign-extended like a load.
+      instruction2(OPCODE_MOVSX, register64(promoted_register(variable)), register_operand(argument_registers[i], variable->type->size));
     }
-    printf("  mov [rbp-%d], %s\n", nodes->node->local_variable->offset, register_name);
     i++;
   }
 
+  register_depth = 0;
   generate(node->function_definition.block);
+  optimize_peephole(instructions);
+}
+
+// Lowers a function definition to SSA form, optimizes it and selects instructions from it.
+void generate_function_from_ssa(Node *definition) {
+  IrFunction *ir = lower_function(definition);
+  optimize_ir(ir);
+  if (generator_dumps_ir) {
+    flockfile(stderr);
+    print_ir_function(stderr, ir);
+    funlockfile(stderr);
+  }
+  select_instructions(ir, instructions);
+  optimize_peephole(instructions);
+  free_ir_function(ir);
+}
+
+// Generates a function into its own instruction list, and prints it into its own output unless an object file is written.
+void generate_function(GeneratedFunction *function, int label_namespace) {
+  Symbol *symbol = function->definition->function_definition.symbol;
+  instructions = new_instruction_list();
+  instructions->label_namespace = label_namespace;
+  label_counter = 0;
+  if (generator_uses_ssa) {
+    generate_function_from_ssa(function->definition);
+  } else {
+    generate(function->definition);
+  }
+  if (object_file) {
+    function->instructions = instructions;
+    return;
+  }
+  Output *saved_output = output;
+  output = new_output(-1);
+  emit(".global %.*s\n", symbol->name_length, symbol->name);
+  emit("%.*s:\n", symbol->name_length, symbol->name);
+  print_instructions(instructions);
+  function->text = output;
+  output = saved_output;
+  free_instruction_list(instructions);
+}
+
+void *generate_functions(void *unused) {
+  int index;
+  while ((index = atomic_fetch_add(&next_generated_function, 1)) < generated_functions_count) {
+    generate_function(&generated_functions[index], index);
+  }
+  return NULL;
+}
+
+// Encodes or writes out a generated function, and releases what it held.
+void write_generated_function(GeneratedFunction *function) {
+  if (object_file) {
+    define_object_function(object_file, function->definition->function_definition.symbol, function->instructions);
+    free_instruction_list(function->instructions);
+  } else {
+    write_output(output, function->text->data, function->text->length);
+    free_output(function->text);
+  }
+}
+
+// Generates function definitions on generator_jobs threads, or one per online processor when it is 0.
+// Nothing is shared among functions while they are generated, and they are written out in source order,
+// so the output does not depend on the number of threads.
+void generate_functions_in_parallel(void) {
+  int jobs = generator_jobs > 0 ? generator_jobs : sysconf(_SC_NPROCESSORS_ONLN);
+  if (jobs > generated_functions_count) {
+    jobs = generated_functions_count;
+  }
+  atomic_store(&next_generated_function, 0);
+  if (jobs <= 1) {
+    generate_functions(NULL);
+    return;
+  }
+  pthread_t *threads = calloc(jobs, sizeof(pthread_t));
+  for (int i = 0; i < jobs; i++) {
+    if (pthread_create(&threads[i], NULL, generate_functions, NULL) != 0) {
+      fprintf(stderr, "Failed to create a thread.\n");
+      exit(1);
+    }
+  }
+  for (int i = 0; i < jobs; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
 }
 
 void generate_global_variable_definition(Node *node) {
-  printf("%.*s:\n", node->local_variable->name_length, node->local_variable->name);
-  printf("  .zero %d\n", node->local_variable->type->size);
+  if (object_file) {
+    define_object_variable(object_file, node->local_variable->symbol, node->local_variable->type->size);
+    return;
+  }
+  emit("  .align %d\n", node->local_variable->type->alignment);
+  emit("%.*s:\n", node->local_variable->symbol->name_length, node->local_variable->symbol->name);
+  emit("  .zero %d\n", node->local_variable->type->size);
 }
 
 void generate_if(Node *node) {
-  int label_count = label_counter++;
+  int else_label = label_counter++;
+  int end_label = label_counter++;
   if (node->if_statement.false_statement) {
-    generate(node->if_statement.condition);
-    printf("  pop rax\n");
-    printf("  cmp rax, 0\n");
-    printf("  je .Lelse%i\n", label_count);
-    generate(node->if_statement.true_statement);
-    printf("  jmp .Lend%i\n", label_count);
-    printf(".Lelse%i:\n", label_count);
-    generate(node->if_statement.false_statement);
-    printf(".Lend%i:\n", label_count);
+    generate_condition(node->if_statement.condition, else_label);
+    generate_statement(node->if_statement.true_statement);
+    instruction1(OPCODE_JMP, label_operand(end_label));
+    label(else_label);
+    generate_statement(node->if_statement.false_statement);
+    label(end_label);
   } else {
-    generate(node->if_statement.condition);
-    printf("  pop rax\n");
-    printf("  cmp rax, 0\n");
-    printf("  je .Lend%i\n", label_count);
-    generate(node->if_statement.true_statement);
-    printf(".Lend%i:\n", label_count);
+    generate_condition(node->if_statement.condition, end_label);
+    generate_statement(node->if_statement.true_statement);
+    label(end_label);
   }
 }
 
 void generate_le(Node *node) {
-  generate(node->binary.lhs);
-  generate(node->binary.rhs);
-  printf("  pop rdi\n");
-  printf("  pop rax\n");
-  printf("  cmp rax, rdi\n");
-  printf("  setle al\n");
-  printf("  movzb rax, al\n");
-  printf("  push rax\n");
+  generate_comparison(node);
 }
 
 void generate_local_variable(Node *node) {
-  generate_address(node);
-  if (node->type->kind != TYPE_KIND_ARRAY) {
-    load(node->type);
+  if (node->type->kind == TYPE_KIND_ARRAY) {
+    generate_address(node);
+  } else if (node->local_variable->is_promoted) {
+    instruction2(OPCODE_MOV, register64(push_register()), register64(promoted_register(node->local_variable)));
+  } else {
+    generate_load(node);
   }
 }
 
 void generate_lt(Node *node) {
-  generate(node->binary.lhs);
-  generate(node->binary.rhs);
-  printf("  pop rdi\n");
-  printf("  pop rax\n");
-  printf("  cmp rax, rdi\n");
-  printf("  setl al\n");
-  printf("  movzb rax, al\n");
-  printf("  push rax\n");
+  generate_comparison(node);
 }
 
 void generate_multiply(Node *node) {
-  generate(node->binary.lhs);
-  generate(node->binary.rhs);
-  printf("  pop rdi\n");
-  printf("  pop rax\n");
-  printf("  imul rax, rdi\n");
-  printf("  push rax\n");
+  Register lhs;
+  Register rhs;
+  generate_binary_operands(node, &lhs, &rhs);
+  instruction2(OPCODE_IMUL, register64(lhs), register64(rhs));
+  move_to_top(lhs);
 }
 
 void generate_ne(Node *node) {
-  generate(node->binary.lhs);
-  generate(node->binary.rhs);
-  printf("  pop rdi\n");
-  printf("  pop rax\n");
-  printf("  cmp rax, rdi\n");
-  printf("  setne al\n");
-  printf("  movzb rax, al\n");
-  printf("  push rax\n");
+  generate_comparison(node);
 }
 
 void generate_number(Node *node) {
-  printf("  push %d\n", node->value);
+  instruction2(OPCODE_MOV, register64(push_register()), immediate_operand(node->value));
 }
 
-void generate_program(Node *node) {
-  printf(".intel_syntax noprefix\n");
+void switch_section(char *section) {
+  if (object_file == NULL && section != current_section) {
+    emit("%s\n", section);
+    current_section = section;
+  }
+}
 
-  printf(".data\n");
+void generate_program(Node *node) {
+  begin_generation();
+  switch_section(".data");
   for (Nodes *nodes = node->program.nodes; nodes != NULL; nodes = nodes->next) {
     if (nodes->node->kind == NODE_KIND_GLOBAL_VARIABLE_DEFINITION) {
       generate(nodes->node);
     }
   }
 
-  printf(".text\n");
+  generated_functions_count = 0;
   for (Nodes *nodes = node->program.nodes; nodes != NULL; nodes = nodes->next) {
     if (nodes->node->kind == NODE_KIND_FUNCTION_DEFINITION) {
-      generate(nodes->node);
+      generated_functions_count++;
+    }
+  }
+  generated_functions = calloc(generated_functions_count, sizeof(GeneratedFunction));
+  int i = 0;
+  for (Nodes *nodes = node->program.nodes; nodes != NULL; nodes = nodes->next) {
+    if (nodes->node->kind == NODE_KIND_FUNCTION_DEFINITION) {
+      generated_functions[i++].definition = nodes->node;
     }
   }
+  generate_functions_in_parallel();
+
+  switch_section(".text");
+  for (i = 0; i < generated_functions_count; i++) {
+    write_generated_function(&generated_functions[i]);
+  }
+  free(generated_functions);
+}
+
+// Starts a program that is generated one definition at a time by generate_definition.
+void begin_generation(void) {
+  current_section = NULL;
+  streamed_functions_count = 0;
+  if (object_file == NULL) {
+    emit(".intel_syntax noprefix\n");
+  }
+}
+
+// Generates a top-level definition right away, so that it can be released before the next one is parsed.
+void generate_definition(Node *node) {
+  if (node->kind == NODE_KIND_GLOBAL_VARIABLE_DEFINITION) {
+    switch_section(".data");
+    generate(node);
+    return;
+  }
+  switch_section(".text");
+  GeneratedFunction function = {.definition = node};
+  generate_function(&function, streamed_functions_count++);
+  write_generated_function(&function);
 }
 
 void generate_return(Node *node) {
   generate(node->return_statement.expression);
-  printf("  pop rax\n");
-  printf("  mov rsp, rbp\n");
-  printf("  pop rbp\n");
-  printf("  ret\n");
+  instruction2(OPCODE_MOV, register64(REGISTER_RAX), register64(top_register()));
+  for (int i = 0; i < promoted_variables_count; i++) {
+    instruction2(OPCODE_MOV, register64(promoted_registers[i]), memory_operand(REGISTER_RBP, -saved_registers_offset - 8 * (i + 1), 8));
+  }
+  instruction2(OPCODE_MOV, register64(REGISTER_RSP), register64(REGISTER_RBP));
+  instruction1(OPCODE_POP, register64(REGISTER_RBP));
+  instruction0(OPCODE_RET);
 }
 
 void generate_subtract(Node *node) {
-  generate(node->binary.lhs);
-  generate(node->binary.rhs);
-  printf("  pop rdi\n");
-  printf("  pop rax\n");
-  printf("  sub rax, rdi\n");
-  printf("  push rax\n");
+  Register lhs;
+  Register rhs;
+  generate_binary_operands(node, &lhs, &rhs);
+  instruction2(OPCODE_SUB, register64(lhs), register64(rhs));
+  move_to_top(lhs);
 }
 
 void generate_subtract_pointer(Node *node) {
-  generate(node->binary.lhs);
-  generate(node->binary.rhs);
-  printf("  pop rdi\n");
-  printf("  pop rax\n");
-  printf("  imul rdi, %i\n", node->binary.lhs->type->pointed_type->size);
-  printf("  sub rax, rdi\n");
-  printf("  push rax\n");
+  if (node->binary.rhs->kind == NODE_KIND_NUMBER) {
+    generate_lea(node);
+    return;
+  }
+  Register lhs;
+  Register rhs;
+  generate_binary_operands(node, &lhs, &rhs);
+  instruction2(OPCODE_IMUL, register64(rhs), immediate_operand(node->binary.lhs->type->pointed_type->size));
+  instruction2(OPCODE_SUB, register64(lhs), register64(rhs));
+  move_to_top(lhs);
 }
 
 void generate_while(Node *node) {
-  int label_count = label_counter++;
-  printf(".Lbegin%i:\n", label_count);
-  generate(node->while_statement.condition);
-  printf("  pop rax\n");
-  printf("  cmp rax, 0\n");
-  printf("  je .Lend%i\n", label_count);
-  generate(node->while_statement.statement);
-  printf("  jmp .Lbegin%i\n", label_count);
-  printf(".Lend%i:\n", label_count);
+  int begin_label = label_counter++;
+  int end_label = label_counter++;
+  label(begin_label);
+  generate_condition(node->while_statement.condition, end_label);
+  generate_statement(node->while_statement.statement);
+  instruction1(OPCODE_JMP, label_operand(begin_label));
+  label(end_label);
 }
 
 void generate(Node *node) {
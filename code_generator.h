@@ -1,5 +1,19 @@
 #pragma once
 
 #include "parser.h" // Node
+#include <stdbool.h>
+
+// Number of threads generating function definitions, or 0 for one per online processor.
+extern int generator_jobs;
+
+// Whether functions are lowered to SSA form and optimized before instruction selection, instead of generated from the tree.
+extern bool generator_uses_ssa;
+
+// Whether the optimized SSA form of each function is printed to stderr.
+extern bool generator_dumps_ir;
+
+int align(int target, int unit);
 
 void generate(Node *node);
+void begin_generation(void);
+void generate_definition(Node *node);
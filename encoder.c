@@ -0,0 +1,349 @@
+#include "encoder.h"
+#include <stdbool.h> // bool
+#include <stdio.h>   // fprintf
+#include <stdlib.h>  // exit, free, realloc
+#include <string.h>  // memcpy
+
+typedef struct LabelFixup LabelFixup;
+
+// rel32 field at offset, to be filled once the label is placed.
+struct LabelFixup {
+  size_t offset;
+  int label;
+};
+
+// State of the instructions being encoded.
+static ObjectFile *object;
+static size_t *label_offsets;
+static int label_offsets_capacity;
+static LabelFixup *fixups;
+static int fixups_count;
+static int fixups_capacity;
+
+static void encode_byte(int value) {
+  unsigned char byte = value;
+  append_text(object, &byte, 1);
+}
+
+static void encode_int32(int value) {
+  unsigned char bytes[4] = {value, value >> 8, value >> 16, value >> 24};
+  append_text(object, bytes, 4);
+}
+
+static bool is_int8(int value) {
+  return value >= -128 && value <= 127;
+}
+
+// Byte registers spl, bpl, sil and dil are only reachable with a REX prefix.
+static bool needs_rex_for_byte(Operand operand) {
+  return operand.kind == OPERAND_KIND_REGISTER && operand.size == 1 && operand.base >= REGISTER_RSP && operand.base <= REGISTER_RDI;
+}
+
+// Emits the REX prefix for an instruction with reg in ModRM.reg and rm in ModRM.rm, if it needs one.
+static void encode_rex(bool wide, int reg, Operand rm, bool force) {
+  int rex = 0x40;
+  if (wide) {
+    rex |= 8;
+  }
+  if (reg & 8) {
+    rex |= 4;
+  }
+  if (rm.kind == OPERAND_KIND_MEMORY && rm.base != REGISTER_RIP) {
+    if (rm.index != REGISTER_NONE && (rm.index & 8)) {
+      rex |= 2;
+    }
+    if (rm.base & 8) {
+      rex |= 1;
+    }
+  } else if (rm.kind == OPERAND_KIND_REGISTER && (rm.base & 8)) {
+    rex |= 1;
+  }
+  if (rex != 0x40 || force) {
+    encode_byte(rex);
+  }
+}
+
+// Emits ModRM, SIB and displacement. trailing_bytes is the size of the immediate following them,
+// which RIP-relative displacements are relative to the end of.
+static void encode_modrm(int reg, Operand rm, int trailing_bytes) {
+  if (rm.kind == OPERAND_KIND_REGISTER) {
+    encode_byte(0xc0 | (reg & 7) << 3 | (rm.base & 7));
+    return;
+  }
+  if (rm.base == REGISTER_RIP) {
+    encode_byte(0x05 | (reg & 7) << 3);
+    add_relocation(object, rm.symbol, RELOCATION_KIND_PC_RELATIVE, rm.value - 4 - trailing_bytes);
+    encode_int32(0);
+    return;
+  }
+  int base = rm.base & 7;
+  bool has_sib = rm.index != REGISTER_NONE || base == 4;
+  int mod = rm.value == 0 && base != 5 ? 0 : is_int8(rm.value) ? 1 : 2;
+  encode_byte(mod << 6 | (reg & 7) << 3 | (has_sib ? 4 : base));
+  if (has_sib) {
+    int scale_bits = rm.index == REGISTER_NONE ? 0 : rm.scale == 8 ? 3 : rm.scale == 4 ? 2 : rm.scale == 2 ? 1 : 0;
+    int index = rm.index == REGISTER_NONE ? 4 : rm.index & 7;
+    encode_byte(scale_bits << 6 | index << 3 | base);
+  }
+  if (mod == 1) {
+    encode_byte(rm.value);
+  } else if (mod == 2) {
+    encode_int32(rm.value);
+  }
+}
+
+// Emits an instruction of the form [REX] opcode ModRM, where opcode is one to three bytes.
+static void encode_rm(bool wide, int opcode, int reg, Operand rm, int trailing_bytes, bool force_rex) {
+  encode_rex(wide, reg, rm, force_rex);
+  if (opcode > 0xffff) {
+    encode_byte(opcode >> 16);
+  }
+  if (opcode > 0xff) {
+    encode_byte(opcode >> 8);
+  }
+  encode_byte(opcode);
+  encode_modrm(reg, rm, trailing_bytes);
+}
+
+static void unexpected_operands(Instruction *instruction) {
+  fprintf(stderr, "Unexpected operands of opcode %d.\n", instruction->opcode);
+  exit(1);
+}
+
+// add, and, sub and cmp share their encodings, differing only in base opcode and ModRM.reg extension.
+static void encode_arithmetic(Instruction *instruction, int base_opcode, int extension) {
+  Operand destination = instruction->operands[0];
+  Operand source = instruction->operands[1];
+  switch (source.kind) {
+  case OPERAND_KIND_IMMEDIATE:
+    if (is_int8(source.value)) {
+      encode_rm(true, 0x83, extension, destination, 1, false);
+      encode_byte(source.value);
+    } else {
+      encode_rm(true, 0x81, extension, destination, 4, false);
+      encode_int32(source.value);
+    }
+    break;
+  case OPERAND_KIND_REGISTER:
+    encode_rm(true, base_opcode + 1, source.base, destination, 0, false);
+    break;
+  case OPERAND_KIND_MEMORY:
+    encode_rm(true, base_opcode + 3, destination.base, source, 0, false);
+    break;
+  default:
+    unexpected_operands(instruction);
+  }
+}
+
+static void encode_imul(Instruction *instruction) {
+  Operand destination = instruction->operands[0];
+  Operand source = instruction->operands[1];
+  if (source.kind != OPERAND_KIND_IMMEDIATE) {
+    encode_rm(true, 0x0faf, destination.base, source, 0, false);
+  } else if (is_int8(source.value)) {
+    encode_rm(true, 0x6b, destination.base, destination, 1, false);
+    encode_byte(source.value);
+  } else {
+    encode_rm(true, 0x69, destination.base, destination, 4, false);
+    encode_int32(source.value);
+  }
+}
+
+static void encode_mov(Instruction *instruction) {
+  Operand destination = instruction->operands[0];
+  Operand source = instruction->operands[1];
+  if (source.kind == OPERAND_KIND_IMMEDIATE) {
+    if (destination.size == 1) {
+      encode_rm(false, 0xc6, 0, destination, 1, false);
+      encode_byte(source.value);
+    } else {
+      encode_rm(destination.size == 8, 0xc7, 0, destination, 4, false);
+      encode_int32(source.value);
+    }
+  } else if (source.kind == OPERAND_KIND_REGISTER && source.size == 1) {
+    encode_rm(false, 0x88, source.base, destination, 0, needs_rex_for_byte(source));
+  } else if (source.kind == OPERAND_KIND_REGISTER) {
+    encode_rm(source.size == 8, 0x89, source.base, destination, 0, false);
+  } else if (destination.kind == OPERAND_KIND_REGISTER) {
+    encode_rm(true, 0x8b, destination.base, source, 0, false);
+  } else {
+    unexpected_operands(instruction);
+  }
+}
+
+static void encode_push(Instruction *instruction) {
+  Operand operand = instruction->operands[0];
+  switch (operand.kind) {
+  case OPERAND_KIND_IMMEDIATE:
+    if (is_int8(operand.value)) {
+      encode_byte(0x6a);
+      encode_byte(operand.value);
+    } else {
+      encode_byte(0x68);
+      encode_int32(operand.value);
+    }
+    break;
+  case OPERAND_KIND_REGISTER:
+    if (operand.base & 8) {
+      encode_byte(0x41);
+    }
+    encode_byte(0x50 + (operand.base & 7));
+    break;
+  default:
+    encode_rm(false, 0xff, 6, operand, 0, false);
+  }
+}
+
+static void encode_pop(Instruction *instruction) {
+  Operand operand = instruction->operands[0];
+  if (operand.base & 8) {
+    encode_byte(0x41);
+  }
+  encode_byte(0x58 + (operand.base & 7));
+}
+
+// Returns the condition code shared by jcc and setcc.
+static int condition_code(Opcode opcode) {
+  switch (opcode) {
+  case OPCODE_JE:
+  case OPCODE_SETE:
+    return 0x4;
+  case OPCODE_JNE:
+  case OPCODE_SETNE:
+    return 0x5;
+  case OPCODE_JL:
+  case OPCODE_SETL:
+    return 0xc;
+  case OPCODE_JGE:
+  case OPCODE_SETGE:
+    return 0xd;
+  case OPCODE_JLE:
+  case OPCODE_SETLE:
+    return 0xe;
+  case OPCODE_JG:
+  case OPCODE_SETG:
+    return 0xf;
+  default:
+    fprintf(stderr, "Unexpected opcode.\n");
+    exit(1);
+  }
+}
+
+static void place_label(int label) {
+  if (label >= label_offsets_capacity) {
+    label_offsets_capacity = label_offsets_capacity == 0 ? 1024 : label_offsets_capacity * 2;
+    if (label >= label_offsets_capacity) {
+      label_offsets_capacity = label + 1;
+    }
+    label_offsets = realloc(label_offsets, sizeof(size_t) * label_offsets_capacity);
+  }
+  label_offsets[label] = object->text_length;
+}
+
+// Jumps always take rel32, so that their sizes are known before labels are placed.
+static void encode_jump(Instruction *instruction) {
+  if (instruction->opcode == OPCODE_JMP) {
+    encode_byte(0xe9);
+  } else {
+    encode_byte(0x0f);
+    encode_byte(0x80 | condition_code(instruction->opcode));
+  }
+  if (fixups_count == fixups_capacity) {
+    fixups_capacity = fixups_capacity == 0 ? 256 : fixups_capacity * 2;
+    fixups = realloc(fixups, sizeof(LabelFixup) * fixups_capacity);
+  }
+  fixups[fixups_count++] = (LabelFixup){object->text_length, instruction->operands[0].value};
+  encode_int32(0);
+}
+
+static void encode_instruction(Instruction *instruction) {
+  Operand destination = instruction->operands[0];
+  Operand source = instruction->operands[1];
+  switch (instruction->opcode) {
+  case OPCODE_ADD:
+    encode_arithmetic(instruction, 0x00, 0);
+    break;
+  case OPCODE_AND:
+    encode_arithmetic(instruction, 0x20, 4);
+    break;
+  case OPCODE_SUB:
+    encode_arithmetic(instruction, 0x28, 5);
+    break;
+  case OPCODE_CMP:
+    encode_arithmetic(instruction, 0x38, 7);
+    break;
+  case OPCODE_CALL:
+    encode_byte(0xe8);
+    add_relocation(object, destination.symbol, RELOCATION_KIND_CALL, -4);
+    encode_int32(0);
+    break;
+  case OPCODE_CQO:
+    encode_byte(0x48);
+    encode_byte(0x99);
+    break;
+  case OPCODE_IDIV:
+    encode_rm(true, 0xf7, 7, destination, 0, false);
+    break;
+  case OPCODE_IMUL:
+    encode_imul(instruction);
+    break;
+  case OPCODE_JE:
+  case OPCODE_JG:
+  case OPCODE_JGE:
+  case OPCODE_JL:
+  case OPCODE_JLE:
+  case OPCODE_JMP:
+  case OPCODE_JNE:
+    encode_jump(instruction);
+    break;
+  case OPCODE_LABEL:
+    place_label(destination.value);
+    break;
+  case OPCODE_LEA:
+    encode_rm(true, 0x8d, destination.base, source, 0, false);
+    break;
+  case OPCODE_MOV:
+    encode_mov(instruction);
+    break;
+  case OPCODE_MOVSX:
+    encode_rm(true, source.size == 4 ? 0x63 : 0x0fbe, destination.base, source, 0, false);
+    break;
+  case OPCODE_MOVZX:
+    encode_rm(true, 0x0fb6, destination.base, source, 0, false);
+    break;
+  case OPCODE_NOP:
+    break;
+  case OPCODE_POP:
+    encode_pop(instruction);
+    break;
+  case OPCODE_PUSH:
+    encode_push(instruction);
+    break;
+  case OPCODE_RET:
+    encode_byte(0xc3);
+    break;
+  case OPCODE_SETE:
+  case OPCODE_SETG:
+  case OPCODE_SETGE:
+  case OPCODE_SETL:
+  case OPCODE_SETLE:
+  case OPCODE_SETNE:
+    encode_rm(false, 0x0f90 | condition_code(instruction->opcode), 0, destination, 0, needs_rex_for_byte(destination));
+    break;
+  }
+}
+
+// Appends the machine code of instructions to the text of object.
+// Jumps are resolved here, and calls and RIP-relative operands are left to relocations.
+void encode_instructions(ObjectFile *object_, InstructionList *list) {
+  object = object_;
+  fixups_count = 0;
+  for (int i = 0; i < list->length; i++) {
+    encode_instruction(&list->instructions[i]);
+  }
+  for (int i = 0; i < fixups_count; i++) {
+    int displacement = label_offsets[fixups[i].label] - (fixups[i].offset + 4);
+    unsigned char bytes[4] = {displacement, displacement >> 8, displacement >> 16, displacement >> 24};
+    memcpy(object->text + fixups[i].offset, bytes, 4);
+  }
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "instruction.h" // InstructionList
+#include "object.h"      // ObjectFile
+
+void encode_instructions(ObjectFile *object, InstructionList *list);
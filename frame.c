@@ -0,0 +1,287 @@
+#include "frame.h"
+#include <limits.h> // INT_MAX
+#include <stdlib.h> // calloc, free, qsort
+
+#define MAXIMUM_LOOP_WEIGHT (1 << 18)
+
+typedef struct Slot Slot;
+
+// Stack area shared by variables whose lifetimes do not overlap.
+struct Slot {
+  int size;
+  int alignment;
+  int offset;
+
+  // Last statement referring to the latest variable in the slot.
+  int last_use;
+};
+
+// State of the function being laid out.
+// References in one statement share a point, since the code generator may evaluate the operands of an expression in any order.
+static _Thread_local int point;
+static _Thread_local Scope *function_scope;
+
+// Weight of a reference at the current loop depth.
+static _Thread_local int loop_weight;
+
+static void use_variable(LocalVariable *variable) {
+  if (variable->is_global) {
+    return;
+  }
+  if (variable->type->kind == TYPE_KIND_ARRAY) {
+    variable->is_address_taken = true;
+  }
+  if (variable->first_use < 0) {
+    variable->first_use = point;
+  }
+  variable->last_use = point;
+  variable->use_weight += loop_weight;
+}
+
+static void use_variables(Node *node) {
+  if (node == NULL) {
+    return;
+  }
+  switch (node->kind) {
+  case NODE_KIND_ADDRESS:
+    if (node->node->kind == NODE_KIND_LOCAL_VARIABLE) {
+      node->node->local_variable->is_address_taken = true;
+    }
+    use_variables(node->node);
+    break;
+  case NODE_KIND_DEREFERENCE:
+    use_variables(node->node);
+    break;
+  case NODE_KIND_FUNCTION_CALL:
+    for (Nodes *nodes = node->function_call.parameters; nodes != NULL; nodes = nodes->next) {
+      use_variables(nodes->node);
+    }
+    break;
+  case NODE_KIND_LOCAL_VARIABLE:
+    use_variable(node->local_variable);
+    break;
+  case NODE_KIND_NUMBER:
+    break;
+  default:
+    use_variables(node->binary.lhs);
+    use_variables(node->binary.rhs);
+  }
+}
+
+static void visit_expression(Node *node) {
+  use_variables(node);
+  point++;
+}
+
+// A variable referred to in a loop may carry its value from one iteration to the next, so it lives through the whole loop.
+// Inner loops are extended first, and the outer ones then see the extended lifetimes.
+static void extend_across_loop(int begin) {
+  int end = point - 1;
+  for (LocalVariable *variable = function_scope->local_variable; variable != NULL; variable = variable->next) {
+    if (variable->first_use < 0 || variable->first_use > end || variable->last_use < begin) {
+      continue;
+    }
+    if (variable->first_use > begin) {
+      variable->first_use = begin;
+    }
+    if (variable->last_use < end) {
+      variable->last_use = end;
+    }
+  }
+}
+
+// Each loop level weighs references 8 times more, up to a limit that keeps the sums from overflowing.
+static void enter_loop(void) {
+  if (loop_weight < MAXIMUM_LOOP_WEIGHT) {
+    loop_weight *= 8;
+  }
+}
+
+static void visit_statement(Node *node) {
+  if (node == NULL) {
+    return;
+  }
+  switch (node->kind) {
+  case NODE_KIND_BLOCK:
+    for (Nodes *nodes = node->block.nodes; nodes != NULL; nodes = nodes->next) {
+      visit_statement(nodes->node);
+    }
+    break;
+  case NODE_KIND_FOR: {
+    visit_expression(node->for_statement.initialization);
+    int begin = point;
+    int weight = loop_weight;
+    enter_loop();
+    visit_expression(node->for_statement.condition);
+    visit_statement(node->for_statement.statement);
+    visit_expression(node->for_statement.afterthrough);
+    loop_weight = weight;
+    extend_across_loop(begin);
+    break;
+  }
+  case NODE_KIND_IF:
+    visit_expression(node->if_statement.condition);
+    visit_statement(node->if_statement.true_statement);
+    visit_statement(node->if_statement.false_statement);
+    break;
+  case NODE_KIND_RETURN:
+    visit_expression(node->return_statement.expression);
+    break;
+  case NODE_KIND_WHILE: {
+    int begin = point;
+    int weight = loop_weight;
+    enter_loop();
+    visit_expression(node->while_statement.condition);
+    visit_statement(node->while_statement.statement);
+    loop_weight = weight;
+    extend_across_loop(begin);
+    break;
+  }
+  default:
+    visit_expression(node);
+  }
+}
+
+// Larger alignments come first, so that no padding is needed between slots.
+static int compare_slots(const void *a, const void *b) {
+  Slot *lhs = *(Slot **)a;
+  Slot *rhs = *(Slot **)b;
+  if (lhs->alignment != rhs->alignment) {
+    return rhs->alignment - lhs->alignment;
+  }
+  return lhs < rhs ? -1 : lhs > rhs;
+}
+
+static int compare_variables(const void *a, const void *b) {
+  LocalVariable *lhs = *(LocalVariable **)a;
+  LocalVariable *rhs = *(LocalVariable **)b;
+  if (lhs->first_use != rhs->first_use) {
+    return lhs->first_use < rhs->first_use ? -1 : 1;
+  }
+  return lhs->offset - rhs->offset;
+}
+
+static int compare_use_weights(const void *a, const void *b) {
+  LocalVariable *lhs = *(LocalVariable **)a;
+  LocalVariable *rhs = *(LocalVariable **)b;
+  if (lhs->use_weight != rhs->use_weight) {
+    return lhs->use_weight > rhs->use_weight ? -1 : 1;
+  }
+  return compare_variables(a, b);
+}
+
+// Assigns offsets to the variables in the frame, and sizes the frame to fit them.
+// Slots are allocated for variables in order of their first use, reusing the first slot freed before it.
+static void assign_slots(Node *function_definition) {
+  int count = 0;
+  LocalVariable **variables = calloc(function_scope->local_variables_count, sizeof(LocalVariable *));
+  for (LocalVariable *variable = function_scope->local_variable; variable != NULL; variable = variable->next) {
+    if (variable->first_use >= 0 && !variable->is_promoted) {
+      variables[count++] = variable;
+    }
+  }
+  qsort(variables, count, sizeof(LocalVariable *), compare_variables);
+
+  int slots_count = 0;
+  Slot *slots = calloc(count, sizeof(Slot));
+  Slot **assigned_slots = calloc(count, sizeof(Slot *));
+  for (int i = 0; i < count; i++) {
+    LocalVariable *variable = variables[i];
+    Slot *slot = NULL;
+    for (int j = 0; j < slots_count; j++) {
+      if (slots[j].alignment == variable->type->alignment && slots[j].last_use < variable->first_use) {
+        slot = &slots[j];
+        break;
+      }
+    }
+    if (slot == NULL) {
+      slot = &slots[slots_count++];
+      slot->alignment = variable->type->alignment;
+    }
+    if (slot->size < variable->type->size) {
+      slot->size = variable->type->size;
+    }
+    slot->last_use = variable->last_use;
+    assigned_slots[i] = slot;
+  }
+
+  Slot **ordered_slots = calloc(slots_count, sizeof(Slot *));
+  for (int i = 0; i < slots_count; i++) {
+    ordered_slots[i] = &slots[i];
+  }
+  qsort(ordered_slots, slots_count, sizeof(Slot *), compare_slots);
+  int offset = 0;
+  for (int i = 0; i < slots_count; i++) {
+    Slot *slot = ordered_slots[i];
+    offset = (offset + slot->size + slot->alignment - 1) / slot->alignment * slot->alignment;
+    slot->offset = offset;
+  }
+  for (int i = 0; i < count; i++) {
+    variables[i]->offset = assigned_slots[i]->offset;
+  }
+  function_definition->function_definition.frame_size = offset;
+
+  free(ordered_slots);
+  free(assigned_slots);
+  free(slots);
+  free(variables);
+}
+
+// Reassigns the offsets of the local variables of a function, and sizes its frame to fit them.
+// Each variable lives from the first to the last statement referring to it, and variables of the same alignment
+// whose lifetimes do not overlap share a slot. Variables never referred to get no slot, and address-taken ones
+// live for the whole function, since pointers to them may be used anywhere.
+void layout_frame(Node *function_definition) {
+  function_scope = function_definition->function_definition.scope;
+  for (LocalVariable *variable = function_scope->local_variable; variable != NULL; variable = variable->next) {
+    variable->first_use = -1;
+    variable->use_weight = 0;
+    variable->is_address_taken = false;
+    variable->is_promoted = false;
+  }
+
+  // Parameters are stored by the prologue.
+  point = 0;
+  loop_weight = 1;
+  for (Nodes *nodes = function_definition->function_definition.parameters; nodes != NULL; nodes = nodes->next) {
+    use_variable(nodes->node->local_variable);
+  }
+  point++;
+  visit_statement(function_definition->function_definition.block);
+
+  for (LocalVariable *variable = function_scope->local_variable; variable != NULL; variable = variable->next) {
+    if (variable->first_use >= 0 && variable->is_address_taken) {
+      variable->first_use = 0;
+      variable->last_use = INT_MAX;
+    }
+  }
+  assign_slots(function_definition);
+}
+
+// Chooses up to capacity variables of a laid out function to live in registers, the most used ones in loops first,
+// and lays out the frame again without them. Address-taken variables stay in memory, where pointers can reach them.
+// The chosen variables are stored into promoted, and their count is returned.
+int promote_variables(Node *function_definition, LocalVariable **promoted, int capacity) {
+  function_scope = function_definition->function_definition.scope;
+  int count = 0;
+  LocalVariable **candidates = calloc(function_scope->local_variables_count, sizeof(LocalVariable *));
+  for (LocalVariable *variable = function_scope->local_variable; variable != NULL; variable = variable->next) {
+    if (variable->first_use >= 0 && !variable->is_address_taken) {
+      candidates[count++] = variable;
+    }
+  }
+  qsort(candidates, count, sizeof(LocalVariable *), compare_use_weights);
+  if (count > capacity) {
+    count = capacity;
+  }
+  for (int i = 0; i < count; i++) {
+    candidates[i]->is_promoted = true;
+    candidates[i]->promoted_index = i;
+    promoted[i] = candidates[i];
+  }
+  free(candidates);
+  if (count > 0) {
+    assign_slots(function_definition);
+  }
+  return count;
+}
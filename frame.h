@@ -0,0 +1,6 @@
+#pragma once
+
+#include "parser.h" // LocalVariable, Node
+
+void layout_frame(Node *function_definition);
+int promote_variables(Node *function_definition, LocalVariable **promoted, int capacity);
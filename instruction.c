@@ -0,0 +1,257 @@
+#include "instruction.h"
+#include "output.h" // emit
+#include <stdio.h>  // fprintf
+#include <stdlib.h> // calloc, exit, free, realloc
+
+static char *register_names_1byte[] = {"al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil", "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b", "rip"};
+static char *register_names_4byte[] = {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi", "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d", "eip"};
+static char *register_names_8byte[] = {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15", "rip"};
+
+static char *opcode_names[] = {
+    [OPCODE_ADD] = "add",
+    [OPCODE_AND] = "and",
+    [OPCODE_CALL] = "call",
+    [OPCODE_CMP] = "cmp",
+    [OPCODE_CQO] = "cqo",
+    [OPCODE_IDIV] = "idiv",
+    [OPCODE_IMUL] = "imul",
+    [OPCODE_JE] = "je",
+    [OPCODE_JG] = "jg",
+    [OPCODE_JGE] = "jge",
+    [OPCODE_JL] = "jl",
+    [OPCODE_JLE] = "jle",
+    [OPCODE_JMP] = "jmp",
+    [OPCODE_JNE] = "jne",
+    [OPCODE_LEA] = "lea",
+    [OPCODE_MOV] = "mov",
+    [OPCODE_MOVSX] = "movsx",
+    [OPCODE_MOVZX] = "movzx",
+    [OPCODE_NOP] = "nop",
+    [OPCODE_POP] = "pop",
+    [OPCODE_PUSH] = "push",
+    [OPCODE_RET] = "ret",
+    [OPCODE_SETE] = "sete",
+    [OPCODE_SETG] = "setg",
+    [OPCODE_SETGE] = "setge",
+    [OPCODE_SETL] = "setl",
+    [OPCODE_SETLE] = "setle",
+    [OPCODE_SETNE] = "setne",
+    [OPCODE_SUB] = "sub",
+};
+
+Operand register_operand(Register register_, int size) {
+  return (Operand){.kind = OPERAND_KIND_REGISTER, .size = size, .base = register_, .index = REGISTER_NONE};
+}
+
+Operand immediate_operand(int value) {
+  return (Operand){.kind = OPERAND_KIND_IMMEDIATE, .value = value, .base = REGISTER_NONE, .index = REGISTER_NONE};
+}
+
+Operand memory_operand(Register base, int displacement, int size) {
+  return indexed_memory_operand(base, REGISTER_NONE, 1, displacement, size);
+}
+
+Operand indexed_memory_operand(Register base, Register index, int scale, int displacement, int size) {
+  return (Operand){.kind = OPERAND_KIND_MEMORY, .size = size, .base = base, .index = index, .scale = scale, .value = displacement};
+}
+
+Operand global_memory_operand(Symbol *symbol, int size) {
+  Operand operand = memory_operand(REGISTER_RIP, 0, size);
+  operand.symbol = symbol;
+  return operand;
+}
+
+Operand label_operand(int label) {
+  return (Operand){.kind = OPERAND_KIND_LABEL, .value = label, .base = REGISTER_NONE, .index = REGISTER_NONE};
+}
+
+Operand symbol_operand(Symbol *symbol) {
+  return (Operand){.kind = OPERAND_KIND_SYMBOL, .symbol = symbol, .base = REGISTER_NONE, .index = REGISTER_NONE};
+}
+
+bool is_register(Operand operand, Register register_) {
+  return operand.kind == OPERAND_KIND_REGISTER && operand.base == register_;
+}
+
+bool is_same_operand(Operand a, Operand b) {
+  return a.kind == b.kind && a.size == b.size && a.base == b.base && a.index == b.index && (a.index == REGISTER_NONE || a.scale == b.scale) && a.value == b.value && a.symbol == b.symbol;
+}
+
+InstructionList *new_instruction_list(void) {
+  return calloc(1, sizeof(InstructionList));
+}
+
+void free_instruction_list(InstructionList *list) {
+  free(list->instructions);
+  free(list);
+}
+
+void append_instruction(InstructionList *list, Opcode opcode, Operand lhs, Operand rhs) {
+  if (list->length == list->capacity) {
+    list->capacity = list->capacity == 0 ? 256 : list->capacity * 2;
+    list->instructions = realloc(list->instructions, sizeof(Instruction) * list->capacity);
+  }
+  Instruction *instruction = &list->instructions[list->length++];
+  instruction->opcode = opcode;
+  instruction->operands[0] = lhs;
+  instruction->operands[1] = rhs;
+}
+
+// Removes instructions replaced with OPCODE_NOP.
+void compact_instruction_list(InstructionList *list) {
+  int length = 0;
+  for (int i = 0; i < list->length; i++) {
+    if (list->instructions[i].opcode != OPCODE_NOP) {
+      list->instructions[length++] = list->instructions[i];
+    }
+  }
+  list->length = length;
+}
+
+bool is_conditional_jump(Opcode opcode) {
+  switch (opcode) {
+  case OPCODE_JE:
+  case OPCODE_JG:
+  case OPCODE_JGE:
+  case OPCODE_JL:
+  case OPCODE_JLE:
+  case OPCODE_JNE:
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool is_jump(Opcode opcode) {
+  return opcode == OPCODE_JMP || is_conditional_jump(opcode);
+}
+
+// Returns the jump taken when the given one is not.
+Opcode negate_condition(Opcode opcode) {
+  switch (opcode) {
+  case OPCODE_JE:
+    return OPCODE_JNE;
+  case OPCODE_JG:
+    return OPCODE_JLE;
+  case OPCODE_JGE:
+    return OPCODE_JL;
+  case OPCODE_JL:
+    return OPCODE_JGE;
+  case OPCODE_JLE:
+    return OPCODE_JG;
+  case OPCODE_JNE:
+    return OPCODE_JE;
+  default:
+    fprintf(stderr, "Unexpected opcode.\n");
+    exit(1);
+  }
+}
+
+// Returns the conditional jump taken when the given set instruction sets 1.
+Opcode jump_of_set(Opcode opcode) {
+  switch (opcode) {
+  case OPCODE_SETE:
+    return OPCODE_JE;
+  case OPCODE_SETG:
+    return OPCODE_JG;
+  case OPCODE_SETGE:
+    return OPCODE_JGE;
+  case OPCODE_SETL:
+    return OPCODE_JL;
+  case OPCODE_SETLE:
+    return OPCODE_JLE;
+  case OPCODE_SETNE:
+    return OPCODE_JNE;
+  default:
+    return OPCODE_NOP;
+  }
+}
+
+static char *register_name(Register register_, int size) {
+  switch (size) {
+  case 1:
+    return register_names_1byte[register_];
+  case 4:
+    return register_names_4byte[register_];
+  default:
+    return register_names_8byte[register_];
+  }
+}
+
+static void print_displacement(int displacement) {
+  if (displacement > 0) {
+    emit("+%d", displacement);
+  } else if (displacement < 0) {
+    emit("%d", displacement);
+  }
+}
+
+static void print_memory_operand(Operand operand) {
+  switch (operand.size) {
+  case 1:
+    emit("BYTE PTR ");
+    break;
+  case 4:
+    emit("DWORD PTR ");
+    break;
+  case 8:
+    emit("QWORD PTR ");
+    break;
+  }
+  if (operand.base == REGISTER_RIP) {
+    emit("%.*s", operand.symbol->name_length, operand.symbol->name);
+    print_displacement(operand.value);
+    emit("[rip]");
+    return;
+  }
+  emit("[%s", register_name(operand.base, 8));
+  if (operand.index != REGISTER_NONE) {
+    emit("+%s*%d", register_name(operand.index, 8), operand.scale);
+  }
+  print_displacement(operand.value);
+  emit("]");
+}
+
+static void print_operand(Operand operand, int label_namespace) {
+  switch (operand.kind) {
+  case OPERAND_KIND_IMMEDIATE:
+    emit("%d", operand.value);
+    break;
+  case OPERAND_KIND_LABEL:
+    emit(".L%d_%d", label_namespace, operand.value);
+    break;
+  case OPERAND_KIND_MEMORY:
+    print_memory_operand(operand);
+    break;
+  case OPERAND_KIND_REGISTER:
+    emit("%s", register_name(operand.base, operand.size));
+    break;
+  case OPERAND_KIND_SYMBOL:
+    emit("%.*s", operand.symbol->name_length, operand.symbol->name);
+    break;
+  default:
+    break;
+  }
+}
+
+// Writes instructions as Intel syntax assembly into output.
+void print_instructions(InstructionList *list) {
+  for (int i = 0; i < list->length; i++) {
+    Instruction *instruction = &list->instructions[i];
+    if (instruction->opcode == OPCODE_LABEL) {
+      emit(".L%d_%d:\n", list->label_namespace, instruction->operands[0].value);
+      continue;
+    }
+    // Sign extension from 32 bits has a mnemonic of its own.
+    if (instruction->opcode == OPCODE_MOVSX && instruction->operands[1].size == 4) {
+      emit("  movsxd");
+    } else {
+      emit("  %s", opcode_names[instruction->opcode]);
+    }
+    for (int j = 0; j < 2 && instruction->operands[j].kind != OPERAND_KIND_NONE; j++) {
+      emit(j == 0 ? " " : ", ");
+      print_operand(instruction->operands[j], list->label_namespace);
+    }
+    emit("\n");
+  }
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include "symbol.h"  // Symbol
+#include <stdbool.h> // bool
+
+// x86-64 general purpose registers, in the order of their encodings.
+typedef enum {
+  REGISTER_RAX,
+  REGISTER_RCX,
+  REGISTER_RDX,
+  REGISTER_RBX,
+  REGISTER_RSP,
+  REGISTER_RBP,
+  REGISTER_RSI,
+  REGISTER_RDI,
+  REGISTER_R8,
+  REGISTER_R9,
+  REGISTER_R10,
+  REGISTER_R11,
+  REGISTER_R12,
+  REGISTER_R13,
+  REGISTER_R14,
+  REGISTER_R15,
+  REGISTER_RIP,
+  REGISTER_NONE,
+} Register;
+
+typedef enum {
+  OPERAND_KIND_NONE,
+  OPERAND_KIND_IMMEDIATE,
+  OPERAND_KIND_LABEL,
+  OPERAND_KIND_MEMORY,
+  OPERAND_KIND_REGISTER,
+  OPERAND_KIND_SYMBOL,
+} OperandKind;
+
+typedef struct Operand Operand;
+
+struct Operand {
+  OperandKind kind;
+
+  // Size in bytes of the register or the memory access. 0 for addresses of lea.
+  int size;
+
+  // Register, or base register of memory. REGISTER_RIP for memory relative to symbol.
+  Register base;
+
+  // Index register of memory, or REGISTER_NONE.
+  Register index;
+  int scale;
+
+  // Immediate value, displacement of memory, or label number.
+  int value;
+
+  // Symbol of memory relative to RIP, or callee of call.
+  Symbol *symbol;
+};
+
+typedef enum {
+  OPCODE_ADD,
+  OPCODE_AND,
+  OPCODE_CALL,
+  OPCODE_CMP,
+  OPCODE_CQO,
+  OPCODE_IDIV,
+  OPCODE_IMUL,
+  OPCODE_JE,
+  OPCODE_JG,
+  OPCODE_JGE,
+  OPCODE_JL,
+  OPCODE_JLE,
+  OPCODE_JMP,
+  OPCODE_JNE,
+  OPCODE_LABEL,
+  OPCODE_LEA,
+  OPCODE_MOV,
+  OPCODE_MOVSX,
+  OPCODE_MOVZX,
+  OPCODE_NOP,
+  OPCODE_POP,
+  OPCODE_PUSH,
+  OPCODE_RET,
+  OPCODE_SETE,
+  OPCODE_SETG,
+  OPCODE_SETGE,
+  OPCODE_SETL,
+  OPCODE_SETLE,
+  OPCODE_SETNE,
+  OPCODE_SUB,
+} Opcode;
+
+typedef struct Instruction Instruction;
+
+struct Instruction {
+  Opcode opcode;
+  Operand operands[2];
+};
+
+typedef struct InstructionList InstructionList;
+
+struct InstructionList {
+  Instruction *instructions;
+  int length;
+  int capacity;
+
+  // Labels are numbered per function, so they are printed qualified by the number of their function. (e.g. .L3_0)
+  int label_namespace;
+};
+
+Operand register_operand(Register register_, int size);
+Operand immediate_operand(int value);
+Operand memory_operand(Register base, int displacement, int size);
+Operand indexed_memory_operand(Register base, Register index, int scale, int displacement, int size);
+Operand global_memory_operand(Symbol *symbol, int size);
+Operand label_operand(int label);
+Operand symbol_operand(Symbol *symbol);
+bool is_register(Operand operand, Register register_);
+bool is_same_operand(Operand a, Operand b);
+
+InstructionList *new_instruction_list(void);
+void free_instruction_list(InstructionList *list);
+void append_instruction(InstructionList *list, Opcode opcode, Operand lhs, Operand rhs);
+void compact_instruction_list(InstructionList *list);
+void print_instructions(InstructionList *list);
+
+bool is_jump(Opcode opcode);
+bool is_conditional_jump(Opcode opcode);
+Opcode negate_condition(Opcode opcode);
+Opcode jump_of_set(Opcode opcode);
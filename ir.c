@@ -0,0 +1,599 @@
+#include "ir.h"
+#include "frame.h"  // promote_variables
+#include <stdlib.h> // calloc, exit, free
+#include <string.h> // memcpy
+
+static char *ir_opcode_names[] = {
+    [IR_OPCODE_ADD] = "add",
+    [IR_OPCODE_BRANCH] = "branch",
+    [IR_OPCODE_CALL] = "call",
+    [IR_OPCODE_CONSTANT] = "constant",
+    [IR_OPCODE_DIVIDE] = "divide",
+    [IR_OPCODE_EQ] = "eq",
+    [IR_OPCODE_GLOBAL_ADDRESS] = "global_address",
+    [IR_OPCODE_JUMP] = "jump",
+    [IR_OPCODE_LE] = "le",
+    [IR_OPCODE_LOAD] = "load",
+    [IR_OPCODE_LOCAL_ADDRESS] = "local_address",
+    [IR_OPCODE_LT] = "lt",
+    [IR_OPCODE_MULTIPLY] = "multiply",
+    [IR_OPCODE_NE] = "ne",
+    [IR_OPCODE_PARAMETER] = "parameter",
+    [IR_OPCODE_PHI] = "phi",
+    [IR_OPCODE_RETURN] = "return",
+    [IR_OPCODE_SIGN_EXTEND] = "sign_extend",
+    [IR_OPCODE_STORE] = "store",
+    [IR_OPCODE_SUBTRACT] = "subtract",
+};
+
+// State of the function being lowered. Functions may be lowered on several threads at once.
+static _Thread_local IrFunction *function;
+static _Thread_local IrBlock *current_block;
+
+static void lower_statement(Node *node);
+static IrInstruction *lower_expression(Node *node);
+static IrInstruction *read_variable(LocalVariable *variable, IrBlock *block);
+
+static void *allocate(size_t size) {
+  return arena_allocate(function->arena, size, ARENA_OBJECT_KIND_IR);
+}
+
+// Grows an array allocated from the arena of function to hold one more element, doubling its capacity when full.
+static void *grow(IrFunction *function_, void *elements, int count, int *capacity, size_t element_size) {
+  if (count < *capacity) {
+    return elements;
+  }
+  int new_capacity = *capacity == 0 ? 4 : *capacity * 2;
+  void *new_elements = arena_allocate(function_->arena, element_size * new_capacity, ARENA_OBJECT_KIND_IR);
+  if (count > 0) {
+    memcpy(new_elements, elements, element_size * count);
+  }
+  *capacity = new_capacity;
+  return new_elements;
+}
+
+IrBlock *new_ir_block(IrFunction *function_) {
+  IrBlock *block = arena_allocate(function_->arena, sizeof(IrBlock), ARENA_OBJECT_KIND_IR);
+  block->id = function_->blocks_count;
+  block->definitions = arena_allocate(function_->arena, sizeof(IrInstruction *) * function_->promoted_variables_count, ARENA_OBJECT_KIND_IR);
+  function_->blocks = grow(function_, function_->blocks, function_->blocks_count, &function_->blocks_capacity, sizeof(IrBlock *));
+  function_->blocks[function_->blocks_count++] = block;
+  return block;
+}
+
+IrInstruction *new_ir_instruction(IrFunction *function_, IrOpcode opcode) {
+  IrInstruction *instruction = arena_allocate(function_->arena, sizeof(IrInstruction), ARENA_OBJECT_KIND_IR);
+  instruction->opcode = opcode;
+  instruction->id = function_->values_count++;
+  return instruction;
+}
+
+void add_ir_operand(IrFunction *function_, IrInstruction *instruction, IrInstruction *operand) {
+  instruction->operands = grow(function_, instruction->operands, instruction->operands_count, &instruction->operands_capacity, sizeof(IrInstruction *));
+  instruction->operands[instruction->operands_count++] = operand;
+}
+
+void add_ir_predecessor(IrFunction *function_, IrBlock *block, IrBlock *predecessor) {
+  block->predecessors = grow(function_, block->predecessors, block->predecessors_count, &block->predecessors_capacity, sizeof(IrBlock *));
+  block->predecessors[block->predecessors_count++] = predecessor;
+}
+
+IrInstruction *ir_terminator(IrBlock *block) {
+  if (block->instructions_count == 0) {
+    return NULL;
+  }
+  IrInstruction *last = block->instructions[block->instructions_count - 1];
+  switch (last->opcode) {
+  case IR_OPCODE_BRANCH:
+  case IR_OPCODE_JUMP:
+  case IR_OPCODE_RETURN:
+    return last;
+  default:
+    return NULL;
+  }
+}
+
+int ir_successors_count(IrBlock *block) {
+  switch (ir_terminator(block)->opcode) {
+  case IR_OPCODE_BRANCH:
+    return 2;
+  case IR_OPCODE_JUMP:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+IrInstruction *resolve_ir_value(IrInstruction *value) {
+  while (value->replacement != NULL) {
+    value = value->replacement;
+  }
+  return value;
+}
+
+// Instructions that must be kept even when their value is unused.
+bool has_ir_side_effects(IrInstruction *instruction) {
+  switch (instruction->opcode) {
+  case IR_OPCODE_BRANCH:
+  case IR_OPCODE_CALL:
+  case IR_OPCODE_JUMP:
+  case IR_OPCODE_RETURN:
+  case IR_OPCODE_STORE:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static void insert_instruction(IrBlock *block, int index, IrInstruction *instruction) {
+  block->instructions = grow(function, block->instructions, block->instructions_count, &block->instructions_capacity, sizeof(IrInstruction *));
+  for (int i = block->instructions_count; i > index; i--) {
+    block->instructions[i] = block->instructions[i - 1];
+  }
+  block->instructions[index] = instruction;
+  block->instructions_count++;
+  instruction->block = block;
+}
+
+static IrInstruction *emit(IrOpcode opcode) {
+  IrInstruction *instruction = new_ir_instruction(function, opcode);
+  insert_instruction(current_block, current_block->instructions_count, instruction);
+  return instruction;
+}
+
+static IrInstruction *emit_unary(IrOpcode opcode, IrInstruction *operand, int value) {
+  IrInstruction *instruction = emit(opcode);
+  add_ir_operand(function, instruction, operand);
+  instruction->value = value;
+  return instruction;
+}
+
+static IrInstruction *emit_binary(IrOpcode opcode, IrInstruction *lhs, IrInstruction *rhs) {
+  IrInstruction *instruction = emit(opcode);
+  add_ir_operand(function, instruction, lhs);
+  add_ir_operand(function, instruction, rhs);
+  return instruction;
+}
+
+static IrInstruction *emit_constant(int value) {
+  IrInstruction *instruction = emit(IR_OPCODE_CONSTANT);
+  instruction->value = value;
+  return instruction;
+}
+
+static void emit_jump(IrBlock *target) {
+  IrInstruction *instruction = emit(IR_OPCODE_JUMP);
+  instruction->targets[0] = target;
+  add_ir_predecessor(function, target, current_block);
+}
+
+static void emit_branch(IrInstruction *condition, IrBlock *true_target, IrBlock *false_target) {
+  IrInstruction *instruction = emit(IR_OPCODE_BRANCH);
+  add_ir_operand(function, instruction, condition);
+  instruction->targets[0] = true_target;
+  instruction->targets[1] = false_target;
+  add_ir_predecessor(function, true_target, current_block);
+  add_ir_predecessor(function, false_target, current_block);
+}
+
+// Variables are turned into SSA values while lowering, by the algorithm of Braun et al.,
+// "Simple and Efficient Construction of Static Single Assignment Form" (CC 2013):
+// a variable read in a block looks up its predecessors, placing a phi where they join,
+// and blocks whose predecessors are yet to be lowered, such as loop headers, get phis that are completed when sealed.
+static void write_variable(LocalVariable *variable, IrBlock *block, IrInstruction *value) {
+  block->definitions[variable->promoted_index] = value;
+}
+
+static IrInstruction *new_phi(LocalVariable *variable, IrBlock *block) {
+  IrInstruction *phi = new_ir_instruction(function, IR_OPCODE_PHI);
+  phi->variable = variable;
+  int index = 0;
+  while (index < block->instructions_count && block->instructions[index]->opcode == IR_OPCODE_PHI) {
+    index++;
+  }
+  insert_instruction(block, index, phi);
+  return phi;
+}
+
+static void add_phi_operands(IrInstruction *phi) {
+  for (int i = 0; i < phi->block->predecessors_count; i++) {
+    add_ir_operand(function, phi, read_variable(phi->variable, phi->block->predecessors[i]));
+  }
+}
+
+static IrInstruction *read_variable(LocalVariable *variable, IrBlock *block) {
+  IrInstruction *value = block->definitions[variable->promoted_index];
+  if (value != NULL) {
+    return value;
+  }
+  if (!block->is_sealed) {
+    value = new_phi(variable, block);
+    block->incomplete_phis = grow(function, block->incomplete_phis, block->incomplete_phis_count, &block->incomplete_phis_capacity, sizeof(IrInstruction *));
+    block->incomplete_phis[block->incomplete_phis_count++] = value;
+  } else if (block->predecessors_count == 0) {
+    // Read before any assignment.
+    value = new_ir_instruction(function, IR_OPCODE_CONSTANT);
+    insert_instruction(block, 0, value);
+  } else if (block->predecessors_count == 1) {
+    value = read_variable(variable, block->predecessors[0]);
+  } else {
+    value = new_phi(variable, block);
+    write_variable(variable, block, value);
+    add_phi_operands(value);
+  }
+  write_variable(variable, block, value);
+  return value;
+}
+
+static void seal_block(IrBlock *block) {
+  for (int i = 0; i < block->incomplete_phis_count; i++) {
+    add_phi_operands(block->incomplete_phis[i]);
+  }
+  block->incomplete_phis_count = 0;
+  block->is_sealed = true;
+}
+
+static IrBlock *new_sealed_block(void) {
+  IrBlock *block = new_ir_block(function);
+  block->is_sealed = true;
+  return block;
+}
+
+static IrInstruction *lower_address(Node *node) {
+  switch (node->kind) {
+  case NODE_KIND_DEREFERENCE:
+    return lower_expression(node->node);
+  case NODE_KIND_LOCAL_VARIABLE: {
+    IrInstruction *address = emit(node->local_variable->is_global ? IR_OPCODE_GLOBAL_ADDRESS : IR_OPCODE_LOCAL_ADDRESS);
+    address->variable = node->local_variable;
+    return address;
+  }
+  default:
+    fprintf(stderr, "Unexpected node.\n");
+    exit(1);
+  }
+}
+
+// Returns index * size, computed at compile time when index is a number.
+static IrInstruction *lower_scaled_index(Node *index, int size) {
+  if (index->kind == NODE_KIND_NUMBER) {
+    return emit_constant(index->value * size);
+  }
+  IrInstruction *value = lower_expression(index);
+  return size == 1 ? value : emit_binary(IR_OPCODE_MULTIPLY, value, emit_constant(size));
+}
+
+static IrInstruction *lower_binary(Node *node, IrOpcode opcode) {
+  IrInstruction *lhs = lower_expression(node->binary.lhs);
+  IrInstruction *rhs = lower_expression(node->binary.rhs);
+  return emit_binary(opcode, lhs, rhs);
+}
+
+static IrInstruction *lower_assign(Node *node) {
+  IrInstruction *value = lower_expression(node->binary.rhs);
+  Node *lhs = node->binary.lhs;
+  if (lhs->kind == NODE_KIND_LOCAL_VARIABLE && lhs->local_variable->is_promoted) {
+    if (lhs->type->size == 1) {
+      value = emit_unary(IR_OPCODE_SIGN_EXTEND, value, 1);
+    }
+    write_variable(lhs->local_variable, current_block, value);
+    return value;
+  }
+  IrInstruction *address = lower_address(lhs);
+  IrInstruction *store = emit_binary(IR_OPCODE_STORE, address, value);
+  store->value = node->type->size;
+  return value;
+}
+
+static IrInstruction *lower_function_call(Node *node) {
+  IrInstruction *call = new_ir_instruction(function, IR_OPCODE_CALL);
+  call->symbol = node->function_call.symbol;
+  call->value = node->type->size;
+  for (Nodes *nodes = node->function_call.parameters; nodes != NULL; nodes = nodes->next) {
+    add_ir_operand(function, call, lower_expression(nodes->node));
+  }
+  insert_instruction(current_block, current_block->instructions_count, call);
+  return call;
+}
+
+static IrInstruction *lower_expression(Node *node) {
+  switch (node->kind) {
+  case NODE_KIND_ADD:
+    return lower_binary(node, IR_OPCODE_ADD);
+  case NODE_KIND_ADD_POINTER: {
+    IrInstruction *pointer = lower_expression(node->binary.lhs);
+    return emit_binary(IR_OPCODE_ADD, pointer, lower_scaled_index(node->binary.rhs, node->binary.lhs->type->pointed_type->size));
+  }
+  case NODE_KIND_ADDRESS:
+    return lower_address(node->node);
+  case NODE_KIND_ASSIGN:
+    return lower_assign(node);
+  case NODE_KIND_DEREFERENCE:
+    if (node->type->kind == TYPE_KIND_ARRAY) {
+      return lower_expression(node->node);
+    }
+    return emit_unary(IR_OPCODE_LOAD, lower_expression(node->node), node->type->size);
+  case NODE_KIND_DIFF_POINTER: {
+    IrInstruction *difference = lower_binary(node, IR_OPCODE_SUBTRACT);
+    return emit_binary(IR_OPCODE_DIVIDE, difference, emit_constant(node->binary.lhs->type->pointed_type->size));
+  }
+  case NODE_KIND_DIVIDE:
+    return lower_binary(node, IR_OPCODE_DIVIDE);
+  case NODE_KIND_EQ:
+    return lower_binary(node, IR_OPCODE_EQ);
+  case NODE_KIND_FUNCTION_CALL:
+    return lower_function_call(node);
+  case NODE_KIND_LE:
+    return lower_binary(node, IR_OPCODE_LE);
+  case NODE_KIND_LOCAL_VARIABLE:
+    if (node->type->kind == TYPE_KIND_ARRAY) {
+      return lower_address(node);
+    }
+    if (node->local_variable->is_promoted) {
+      return read_variable(node->local_variable, current_block);
+    }
+    return emit_unary(IR_OPCODE_LOAD, lower_address(node), node->type->size);
+  case NODE_KIND_LT:
+    return lower_binary(node, IR_OPCODE_LT);
+  case NODE_KIND_MULTIPLY:
+    return lower_binary(node, IR_OPCODE_MULTIPLY);
+  case NODE_KIND_NE:
+    return lower_binary(node, IR_OPCODE_NE);
+  case NODE_KIND_NUMBER:
+    return emit_constant(node->value);
+  case NODE_KIND_SUBTRACT:
+    return lower_binary(node, IR_OPCODE_SUBTRACT);
+  case NODE_KIND_SUBTRACT_POINTER: {
+    IrInstruction *pointer = lower_expression(node->binary.lhs);
+    return emit_binary(IR_OPCODE_SUBTRACT, pointer, lower_scaled_index(node->binary.rhs, node->binary.lhs->type->pointed_type->size));
+  }
+  default:
+    fprintf(stderr, "Unexpected node.\n");
+    exit(1);
+  }
+}
+
+// Lowers condition at the end of the current block, branching to the given blocks.
+static void lower_condition(Node *condition, IrBlock *true_target, IrBlock *false_target) {
+  emit_branch(lower_expression(condition), true_target, false_target);
+}
+
+static void lower_for(Node *node) {
+  if (node->for_statement.initialization) {
+    lower_expression(node->for_statement.initialization);
+  }
+  IrBlock *header = new_ir_block(function);
+  IrBlock *body = new_ir_block(function);
+  IrBlock *exit_ = new_ir_block(function);
+  emit_jump(header);
+  current_block = header;
+  if (node->for_statement.condition) {
+    lower_condition(node->for_statement.condition, body, exit_);
+  } else {
+    emit_jump(body);
+  }
+  seal_block(body);
+  current_block = body;
+  lower_statement(node->for_statement.statement);
+  if (node->for_statement.afterthrough) {
+    lower_expression(node->for_statement.afterthrough);
+  }
+  emit_jump(header);
+  seal_block(header);
+  seal_block(exit_);
+  current_block = exit_;
+}
+
+static void lower_if(Node *node) {
+  IrBlock *true_block = new_sealed_block();
+  IrBlock *end = new_ir_block(function);
+  IrBlock *false_block = node->if_statement.false_statement ? new_sealed_block() : end;
+  lower_condition(node->if_statement.condition, true_block, false_block);
+  current_block = true_block;
+  lower_statement(node->if_statement.true_statement);
+  emit_jump(end);
+  if (node->if_statement.false_statement) {
+    current_block = false_block;
+    lower_statement(node->if_statement.false_statement);
+    emit_jump(end);
+  }
+  seal_block(end);
+  current_block = end;
+}
+
+// Code following a return is lowered into a block without predecessors, which dead code elimination removes.
+static void lower_return(Node *node) {
+  emit_unary(IR_OPCODE_RETURN, lower_expression(node->return_statement.expression), 0);
+  current_block = new_sealed_block();
+}
+
+static void lower_while(Node *node) {
+  IrBlock *header = new_ir_block(function);
+  IrBlock *body = new_ir_block(function);
+  IrBlock *exit_ = new_ir_block(function);
+  emit_jump(header);
+  current_block = header;
+  lower_condition(node->while_statement.condition, body, exit_);
+  seal_block(body);
+  current_block = body;
+  lower_statement(node->while_statement.statement);
+  emit_jump(header);
+  seal_block(header);
+  seal_block(exit_);
+  current_block = exit_;
+}
+
+static void lower_statement(Node *node) {
+  if (node == NULL) {
+    return;
+  }
+  switch (node->kind) {
+  case NODE_KIND_BLOCK:
+    for (Nodes *nodes = node->block.nodes; nodes != NULL; nodes = nodes->next) {
+      lower_statement(nodes->node);
+    }
+    break;
+  case NODE_KIND_FOR:
+    lower_for(node);
+    break;
+  case NODE_KIND_IF:
+    lower_if(node);
+    break;
+  case NODE_KIND_RETURN:
+    lower_return(node);
+    break;
+  case NODE_KIND_WHILE:
+    lower_while(node);
+    break;
+  default:
+    lower_expression(node);
+  }
+}
+
+// Builds the control-flow graph of a function definition whose frame has been laid out.
+// Every variable whose address is never taken becomes SSA values, and the frame is laid out again without them.
+// Falling off the end of the function returns 0.
+IrFunction *lower_function(Node *function_definition) {
+  function = calloc(1, sizeof(IrFunction));
+  function->definition = function_definition;
+  function->arena = new_arena();
+  Scope *scope = function_definition->function_definition.scope;
+  function->promoted_variables = allocate(sizeof(LocalVariable *) * scope->local_variables_count);
+  function->promoted_variables_count = promote_variables(function_definition, function->promoted_variables, scope->local_variables_count);
+
+  current_block = new_sealed_block();
+  // All parameters come first, since the prologue moves argument registers only for the leading run of them.
+  int index = 0;
+  for (Nodes *nodes = function_definition->function_definition.parameters; nodes != NULL; nodes = nodes->next) {
+    IrInstruction *parameter = emit(IR_OPCODE_PARAMETER);
+    parameter->value = index++;
+    parameter->variable = nodes->node->local_variable;
+  }
+  for (int i = 0; i < index; i++) {
+    IrInstruction *parameter = current_block->instructions[i];
+    LocalVariable *variable = parameter->variable;
+    if (variable->is_promoted) {
+      write_variable(variable, current_block, parameter);
+    } else {
+      IrInstruction *address = emit(IR_OPCODE_LOCAL_ADDRESS);
+      address->variable = variable;
+      emit_binary(IR_OPCODE_STORE, address, parameter)->value = variable->type->size;
+    }
+  }
+  lower_statement(function_definition->function_definition.block);
+  emit_unary(IR_OPCODE_RETURN, emit_constant(0), 0);
+  return function;
+}
+
+void free_ir_function(IrFunction *function_) {
+  free_arena(function_->arena);
+  free(function_);
+}
+
+static void visit_in_postorder(IrBlock *block, IrBlock **postorder, int *count) {
+  block->order = 0;
+  IrInstruction *terminator = ir_terminator(block);
+  for (int i = ir_successors_count(block) - 1; i >= 0; i--) {
+    IrBlock *successor = terminator->targets[i];
+    if (successor->order < 0) {
+      visit_in_postorder(successor, postorder, count);
+    }
+  }
+  postorder[(*count)++] = block;
+}
+
+static IrBlock *intersect_dominators(IrBlock *a, IrBlock *b) {
+  while (a != b) {
+    while (a->order > b->order) {
+      a = a->dominator;
+    }
+    while (b->order > a->order) {
+      b = b->dominator;
+    }
+  }
+  return a;
+}
+
+// Numbers the reachable blocks in reverse postorder and finds their immediate dominators,
+// by the iterative algorithm of Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm".
+void compute_dominators(IrFunction *function_) {
+  for (int i = 0; i < function_->blocks_count; i++) {
+    function_->blocks[i]->order = -1;
+    function_->blocks[i]->dominator = NULL;
+  }
+  IrBlock **postorder = calloc(function_->blocks_count, sizeof(IrBlock *));
+  int count = 0;
+  visit_in_postorder(function_->blocks[0], postorder, &count);
+  for (int i = 0; i < count; i++) {
+    postorder[i]->order = count - 1 - i;
+  }
+
+  IrBlock *entry = function_->blocks[0];
+  entry->dominator = entry;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = count - 2; i >= 0; i--) {
+      IrBlock *block = postorder[i];
+      IrBlock *dominator = NULL;
+      for (int j = 0; j < block->predecessors_count; j++) {
+        IrBlock *predecessor = block->predecessors[j];
+        if (predecessor->dominator == NULL) {
+          continue;
+        }
+        dominator = dominator == NULL ? predecessor : intersect_dominators(predecessor, dominator);
+      }
+      if (block->dominator != dominator) {
+        block->dominator = dominator;
+        changed = true;
+      }
+    }
+  }
+  free(postorder);
+}
+
+void print_ir_function(FILE *file, IrFunction *function_) {
+  Symbol *symbol = function_->definition->function_definition.symbol;
+  fprintf(file, "function %.*s\n", symbol->name_length, symbol->name);
+  for (int i = 0; i < function_->blocks_count; i++) {
+    IrBlock *block = function_->blocks[i];
+    fprintf(file, "b%d:", block->id);
+    for (int j = 0; j < block->predecessors_count; j++) {
+      fprintf(file, "%s b%d", j == 0 ? " ; from" : ",", block->predecessors[j]->id);
+    }
+    fprintf(file, "\n");
+    for (int j = 0; j < block->instructions_count; j++) {
+      IrInstruction *instruction = block->instructions[j];
+      fprintf(file, "  ");
+      if (!has_ir_side_effects(instruction) || instruction->opcode == IR_OPCODE_CALL) {
+        fprintf(file, "v%d = ", instruction->id);
+      }
+      fprintf(file, "%s", ir_opcode_names[instruction->opcode]);
+      switch (instruction->opcode) {
+      case IR_OPCODE_CALL:
+        fprintf(file, " %.*s", instruction->symbol->name_length, instruction->symbol->name);
+        break;
+      case IR_OPCODE_CONSTANT:
+      case IR_OPCODE_LOAD:
+      case IR_OPCODE_PARAMETER:
+      case IR_OPCODE_SIGN_EXTEND:
+      case IR_OPCODE_STORE:
+        fprintf(file, " %d", instruction->value);
+        break;
+      case IR_OPCODE_GLOBAL_ADDRESS:
+      case IR_OPCODE_LOCAL_ADDRESS:
+        fprintf(file, " %.*s", instruction->variable->symbol->name_length, instruction->variable->symbol->name);
+        break;
+      default:
+        break;
+      }
+      for (int k = 0; k < instruction->operands_count; k++) {
+        fprintf(file, "%s v%d", k == 0 ? "" : ",", resolve_ir_value(instruction->operands[k])->id);
+      }
+      for (int k = 0; k < 2 && instruction->targets[k] != NULL; k++) {
+        fprintf(file, "%s b%d", k == 0 && instruction->operands_count == 0 ? "" : ",", instruction->targets[k]->id);
+      }
+      fprintf(file, "\n");
+    }
+  }
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include "arena.h"  // Arena
+#include "parser.h" // LocalVariable, Node
+#include "symbol.h" // Symbol
+#include <stdbool.h>
+#include <stdio.h> // FILE
+
+// Three-address instructions in SSA form. Each instruction defines at most one value, which is the instruction itself.
+typedef enum {
+  IR_OPCODE_ADD,            // operands[0] + operands[1]
+  IR_OPCODE_BRANCH,         // jump to targets[0] if operands[0] != 0, and to targets[1] otherwise
+  IR_OPCODE_CALL,           // symbol(operands...), whose result of value bytes is sign-extended
+  IR_OPCODE_CONSTANT,       // value
+  IR_OPCODE_DIVIDE,         // operands[0] / operands[1]
+  IR_OPCODE_EQ,             // operands[0] == operands[1]
+  IR_OPCODE_GLOBAL_ADDRESS, // address of variable
+  IR_OPCODE_JUMP,           // jump to targets[0]
+  IR_OPCODE_LE,             // operands[0] <= operands[1]
+  IR_OPCODE_LOAD,           // value bytes at operands[0], sign-extended
+  IR_OPCODE_LOCAL_ADDRESS,  // address of variable in the frame
+  IR_OPCODE_LT,             // operands[0] < operands[1]
+  IR_OPCODE_MULTIPLY,       // operands[0] * operands[1]
+  IR_OPCODE_NE,             // operands[0] != operands[1]
+  IR_OPCODE_PARAMETER,      // argument number value, of the size of variable
+  IR_OPCODE_PHI,            // operands[i] when coming from predecessors[i] of the block
+  IR_OPCODE_RETURN,         // return operands[0]
+  IR_OPCODE_SIGN_EXTEND,    // lowest value bytes of operands[0], sign-extended
+  IR_OPCODE_STORE,          // value bytes at operands[0] = operands[1]
+  IR_OPCODE_SUBTRACT,       // operands[0] - operands[1]
+  IR_OPCODES_COUNT,
+} IrOpcode;
+
+typedef struct IrBlock IrBlock;
+typedef struct IrInstruction IrInstruction;
+
+struct IrInstruction {
+  IrOpcode opcode;
+  IrBlock *block;
+
+  // Number of the value, unique in the function.
+  int id;
+
+  IrInstruction **operands;
+  int operands_count;
+  int operands_capacity;
+
+  int value;
+  LocalVariable *variable;
+  Symbol *symbol;
+  IrBlock *targets[2];
+
+  // Value that replaces this one once a pass has removed it. Operands are redirected by the next copy propagation.
+  IrInstruction *replacement;
+};
+
+struct IrBlock {
+  int id;
+
+  IrInstruction **instructions;
+  int instructions_count;
+  int instructions_capacity;
+
+  IrBlock **predecessors;
+  int predecessors_count;
+  int predecessors_capacity;
+
+  // Whether every predecessor is known, so that variables can be looked up through them.
+  bool is_sealed;
+
+  // Value of each promoted variable at the end of the block as far as it has been built, indexed by promoted_index.
+  IrInstruction **definitions;
+
+  // Phis created before the block was sealed, completed once it is.
+  IrInstruction **incomplete_phis;
+  int incomplete_phis_count;
+  int incomplete_phis_capacity;
+
+  // Immediate dominator, computed by compute_dominators.
+  IrBlock *dominator;
+
+  // Position in reverse postorder, or -1 when the block is unreachable.
+  int order;
+};
+
+typedef struct IrFunction IrFunction;
+
+// Control-flow graph of a function definition. Every block ends with a branch, a jump or a return.
+struct IrFunction {
+  Node *definition;
+  Arena *arena;
+
+  // blocks[0] is the entry.
+  IrBlock **blocks;
+  int blocks_count;
+  int blocks_capacity;
+
+  int values_count;
+
+  // Variables kept as SSA values instead of in the frame.
+  LocalVariable **promoted_variables;
+  int promoted_variables_count;
+};
+
+IrFunction *lower_function(Node *function_definition);
+void free_ir_function(IrFunction *function);
+void print_ir_function(FILE *file, IrFunction *function);
+
+IrBlock *new_ir_block(IrFunction *function);
+IrInstruction *new_ir_instruction(IrFunction *function, IrOpcode opcode);
+void add_ir_operand(IrFunction *function, IrInstruction *instruction, IrInstruction *operand);
+void add_ir_predecessor(IrFunction *function, IrBlock *block, IrBlock *predecessor);
+IrInstruction *ir_terminator(IrBlock *block);
+int ir_successors_count(IrBlock *block);
+IrInstruction *resolve_ir_value(IrInstruction *value);
+bool has_ir_side_effects(IrInstruction *instruction);
+void compute_dominators(IrFunction *function);
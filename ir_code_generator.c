@@ -0,0 +1,989 @@
+#include "ir_code_generator.h"
+#include "code_generator.h" // align
+#include <limits.h>         // INT_MAX
+#include <stdint.h>         // uint64_t
+#include <stdlib.h>         // calloc, free, qsort
+
+static Register argument_registers[] = {
+    REGISTER_RDI,
+    REGISTER_RSI,
+    REGISTER_RDX,
+    REGISTER_RCX,
+    REGISTER_R8,
+    REGISTER_R9};
+
+// Registers values are allocated to, in order of preference. rax, rcx and rdx are left as scratch registers,
+// which idiv, calls and memory operands of spilled values need.
+#define CALLER_SAVED_REGISTERS_COUNT 6
+
+static Register caller_saved_registers[] = {
+    REGISTER_RDI,
+    REGISTER_RSI,
+    REGISTER_R8,
+    REGISTER_R9,
+    REGISTER_R10,
+    REGISTER_R11};
+
+// Values live across a call are allocated to these, which are saved by the prologue and restored by each return.
+#define CALLEE_SAVED_REGISTERS_COUNT 5
+
+static Register callee_saved_registers[] = {
+    REGISTER_RBX,
+    REGISTER_R12,
+    REGISTER_R13,
+    REGISTER_R14,
+    REGISTER_R15};
+
+#define REGISTERS_COUNT 16
+
+typedef struct Move Move;
+
+// Move of a parallel move, where every source is read before any destination is written.
+struct Move {
+  Operand destination;
+  Operand source;
+
+  // Whether the address of source is moved, by lea.
+  bool is_address;
+};
+
+// State of the function being selected. Functions may be selected on several threads at once.
+static _Thread_local IrFunction *function;
+static _Thread_local InstructionList *list;
+
+// Blocks in the order they are emitted, which is reverse postorder. The label of a block is its position.
+static _Thread_local IrBlock **layout;
+static _Thread_local int layout_count;
+
+// Indexed by the id of an instruction.
+static _Thread_local int *use_counts;
+static _Thread_local bool *is_folded;
+static _Thread_local Operand *locations;
+
+// Values held in registers or spill slots, numbered densely.
+static _Thread_local IrInstruction **values;
+static _Thread_local int values_count;
+static _Thread_local int *value_indices;
+static _Thread_local int *interval_starts;
+static _Thread_local int *interval_ends;
+
+static _Thread_local int saved_registers_offset;
+static _Thread_local Register saved_registers[CALLEE_SAVED_REGISTERS_COUNT];
+static _Thread_local int saved_registers_count;
+
+static Operand register64(Register register_) {
+  return register_operand(register_, 8);
+}
+
+static void append0(Opcode opcode) {
+  append_instruction(list, opcode, (Operand){0}, (Operand){0});
+}
+
+static void append1(Opcode opcode, Operand operand) {
+  append_instruction(list, opcode, operand, (Operand){0});
+}
+
+static void append2(Opcode opcode, Operand lhs, Operand rhs) {
+  append_instruction(list, opcode, lhs, rhs);
+}
+
+static bool is_comparison(IrOpcode opcode) {
+  switch (opcode) {
+  case IR_OPCODE_EQ:
+  case IR_OPCODE_LE:
+  case IR_OPCODE_LT:
+  case IR_OPCODE_NE:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static bool is_address(IrInstruction *value) {
+  return value->opcode == IR_OPCODE_GLOBAL_ADDRESS || value->opcode == IR_OPCODE_LOCAL_ADDRESS;
+}
+
+// Constants and addresses of variables are recomputed by each use instead of being held anywhere.
+static bool is_rematerialized(IrInstruction *value) {
+  return value->opcode == IR_OPCODE_CONSTANT || is_address(value);
+}
+
+static bool has_location(IrInstruction *value) {
+  switch (value->opcode) {
+  case IR_OPCODE_BRANCH:
+  case IR_OPCODE_JUMP:
+  case IR_OPCODE_RETURN:
+  case IR_OPCODE_STORE:
+    return false;
+  default:
+    return use_counts[value->id] > 0 && !is_rematerialized(value) && !is_folded[value->id];
+  }
+}
+
+// Inserts a block on each edge from a block with several successors to one with several predecessors,
+// so that the moves of phis can be placed at the end of the predecessor.
+static void split_critical_edges(void) {
+  int blocks_count = function->blocks_count;
+  for (int i = 0; i < blocks_count; i++) {
+    IrBlock *block = function->blocks[i];
+    IrInstruction *terminator = ir_terminator(block);
+    if (ir_successors_count(block) < 2) {
+      continue;
+    }
+    for (int j = 0; j < 2; j++) {
+      IrBlock *successor = terminator->targets[j];
+      if (successor->predecessors_count < 2) {
+        continue;
+      }
+      IrBlock *edge = new_ir_block(function);
+      IrInstruction *jump = new_ir_instruction(function, IR_OPCODE_JUMP);
+      jump->block = edge;
+      jump->targets[0] = successor;
+      edge->instructions = arena_allocate(function->arena, sizeof(IrInstruction *), ARENA_OBJECT_KIND_IR);
+      edge->instructions[0] = jump;
+      edge->instructions_count = edge->instructions_capacity = 1;
+      add_ir_predecessor(function, edge, block);
+      terminator->targets[j] = edge;
+      for (int k = 0; k < successor->predecessors_count; k++) {
+        if (successor->predecessors[k] == block) {
+          successor->predecessors[k] = edge;
+          break;
+        }
+      }
+    }
+  }
+}
+
+// Index of the first instruction after the phis of a block.
+static int phis_count(IrBlock *block) {
+  int count = 0;
+  while (count < block->instructions_count && block->instructions[count]->opcode == IR_OPCODE_PHI) {
+    count++;
+  }
+  return count;
+}
+
+static bool is_scale(int value) {
+  return value == 1 || value == 2 || value == 4 || value == 8;
+}
+
+// Decides which instructions are not computed on their own but folded into their users:
+// a comparison only branched on right after it becomes a jump on the flags, and an addition only used as the address of
+// loads and stores becomes their memory operand, along with a multiplication by 1, 2, 4 or 8 it adds as an index.
+static void fold_instructions(void) {
+  int *address_use_counts = calloc(function->values_count, sizeof(int));
+  for (int i = 0; i < layout_count; i++) {
+    IrBlock *block = layout[i];
+    for (int j = 0; j < block->instructions_count; j++) {
+      IrInstruction *instruction = block->instructions[j];
+      for (int k = 0; k < instruction->operands_count; k++) {
+        use_counts[instruction->operands[k]->id]++;
+      }
+      if (instruction->opcode == IR_OPCODE_LOAD || instruction->opcode == IR_OPCODE_STORE) {
+        address_use_counts[instruction->operands[0]->id]++;
+      }
+    }
+  }
+
+  for (int i = 0; i < layout_count; i++) {
+    IrBlock *block = layout[i];
+    for (int j = 0; j < block->instructions_count; j++) {
+      IrInstruction *instruction = block->instructions[j];
+      if (is_comparison(instruction->opcode) && use_counts[instruction->id] == 1 && j == block->instructions_count - 2) {
+        IrInstruction *terminator = block->instructions[j + 1];
+        is_folded[instruction->id] = terminator->opcode == IR_OPCODE_BRANCH && terminator->operands[0] == instruction;
+      }
+      if (instruction->opcode != IR_OPCODE_ADD || use_counts[instruction->id] != address_use_counts[instruction->id]) {
+        continue;
+      }
+      IrInstruction *base = instruction->operands[0];
+      IrInstruction *offset = instruction->operands[1];
+      if (base->opcode == IR_OPCODE_CONSTANT || base->opcode == IR_OPCODE_GLOBAL_ADDRESS || is_address(offset)) {
+        continue;
+      }
+      is_folded[instruction->id] = true;
+      if (offset->opcode == IR_OPCODE_MULTIPLY && use_counts[offset->id] == 1 && offset->operands[1]->opcode == IR_OPCODE_CONSTANT && is_scale(offset->operands[1]->value) && !is_rematerialized(offset->operands[0])) {
+        is_folded[offset->id] = true;
+      }
+    }
+  }
+  free(address_use_counts);
+}
+
+// Calls visit with each value held in a register or spill slot that using value reads, looking through folded instructions.
+static void visit_used_values(IrInstruction *value, void (*visit)(IrInstruction *value, void *data), void *data) {
+  if (is_folded[value->id]) {
+    for (int i = 0; i < value->operands_count; i++) {
+      visit_used_values(value->operands[i], visit, data);
+    }
+  } else if (has_location(value)) {
+    visit(value, data);
+  }
+}
+
+static _Thread_local int bit_set_words_count;
+
+static bool add_bit(uint64_t *words, int index) {
+  uint64_t bit = (uint64_t)1 << (index % 64);
+  bool is_new = !(words[index / 64] & bit);
+  words[index / 64] |= bit;
+  return is_new;
+}
+
+static bool has_bit(uint64_t *words, int index) {
+  return (words[index / 64] >> (index % 64)) & 1;
+}
+
+static void add_to_set(IrInstruction *value, void *words) {
+  add_bit(words, value_indices[value->id]);
+}
+
+static _Thread_local int extended_position;
+
+static void extend_interval(int index, int position) {
+  if (interval_starts[index] > position) {
+    interval_starts[index] = position;
+  }
+  if (interval_ends[index] < position) {
+    interval_ends[index] = position;
+  }
+}
+
+static void extend_to_position(IrInstruction *value, void *unused) {
+  extend_interval(value_indices[value->id], extended_position);
+}
+
+// Computes the live range of every value as a single interval over the positions of the instructions in layout order,
+// each instruction reading its operands at an even position and defining its value at the next, odd one.
+// A value covers each block it is live into or out of, which keeps intervals correct across loops.
+static void compute_intervals(void) {
+  values = calloc(function->values_count, sizeof(IrInstruction *));
+  values_count = 0;
+  int *block_starts = calloc(layout_count, sizeof(int));
+  int *block_ends = calloc(layout_count, sizeof(int));
+  int position = 0;
+  for (int i = 0; i < layout_count; i++) {
+    IrBlock *block = layout[i];
+    block_starts[i] = position;
+    for (int j = 0; j < block->instructions_count; j++) {
+      IrInstruction *instruction = block->instructions[j];
+      if (has_location(instruction)) {
+        value_indices[instruction->id] = values_count;
+        values[values_count++] = instruction;
+      }
+      position += 2;
+    }
+    block_ends[i] = position - 1;
+  }
+
+  bit_set_words_count = (values_count + 63) / 64;
+  uint64_t *uses = calloc((size_t)layout_count * bit_set_words_count, sizeof(uint64_t));
+  uint64_t *live_in = calloc((size_t)layout_count * bit_set_words_count, sizeof(uint64_t));
+  uint64_t *live_out = calloc((size_t)layout_count * bit_set_words_count, sizeof(uint64_t));
+  uint64_t *definitions = calloc((size_t)layout_count * bit_set_words_count, sizeof(uint64_t));
+  for (int i = 0; i < layout_count; i++) {
+    IrBlock *block = layout[i];
+    uint64_t *block_uses = &uses[(size_t)i * bit_set_words_count];
+    uint64_t *block_definitions = &definitions[(size_t)i * bit_set_words_count];
+    for (int j = 0; j < block->instructions_count; j++) {
+      IrInstruction *instruction = block->instructions[j];
+      if (has_location(instruction)) {
+        add_bit(block_definitions, value_indices[instruction->id]);
+      }
+      if (instruction->opcode == IR_OPCODE_PHI || is_folded[instruction->id]) {
+        continue;
+      }
+      for (int k = 0; k < instruction->operands_count; k++) {
+        visit_used_values(instruction->operands[k], add_to_set, block_uses);
+      }
+    }
+    // A value defined in the block is used after its definition, so only values from other blocks are live into it.
+    for (int k = 0; k < bit_set_words_count; k++) {
+      block_uses[k] &= ~block_definitions[k];
+    }
+  }
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = layout_count - 1; i >= 0; i--) {
+      IrBlock *block = layout[i];
+      uint64_t *out = &live_out[(size_t)i * bit_set_words_count];
+      IrInstruction *terminator = ir_terminator(block);
+      for (int j = 0; j < ir_successors_count(block); j++) {
+        IrBlock *successor = terminator->targets[j];
+        uint64_t *in = &live_in[(size_t)successor->order * bit_set_words_count];
+        for (int k = 0; k < bit_set_words_count; k++) {
+          out[k] |= in[k];
+        }
+        int index = 0;
+        while (successor->predecessors[index] != block) {
+          index++;
+        }
+        for (int k = 0; k < phis_count(successor); k++) {
+          visit_used_values(successor->instructions[k]->operands[index], add_to_set, out);
+        }
+      }
+      uint64_t *in = &live_in[(size_t)i * bit_set_words_count];
+      uint64_t *block_uses = &uses[(size_t)i * bit_set_words_count];
+      uint64_t *block_definitions = &definitions[(size_t)i * bit_set_words_count];
+      for (int k = 0; k < bit_set_words_count; k++) {
+        uint64_t word = block_uses[k] | (out[k] & ~block_definitions[k]);
+        if (word != in[k]) {
+          in[k] = word;
+          changed = true;
+        }
+      }
+    }
+  }
+
+  interval_starts = calloc(values_count, sizeof(int));
+  interval_ends = calloc(values_count, sizeof(int));
+  for (int i = 0; i < values_count; i++) {
+    interval_starts[i] = INT_MAX;
+    interval_ends[i] = -1;
+  }
+  position = 0;
+  for (int i = 0; i < layout_count; i++) {
+    IrBlock *block = layout[i];
+    for (int j = 0; j < values_count; j++) {
+      if (has_bit(&live_in[(size_t)i * bit_set_words_count], j)) {
+        extend_interval(j, block_starts[i]);
+      }
+      if (has_bit(&live_out[(size_t)i * bit_set_words_count], j)) {
+        extend_interval(j, block_ends[i]);
+      }
+    }
+    for (int j = 0; j < block->instructions_count; j++) {
+      IrInstruction *instruction = block->instructions[j];
+      if (instruction->opcode == IR_OPCODE_PHI) {
+        extend_interval(value_indices[instruction->id], block_starts[i]);
+      } else if (!is_folded[instruction->id]) {
+        extended_position = position;
+        for (int k = 0; k < instruction->operands_count; k++) {
+          visit_used_values(instruction->operands[k], extend_to_position, NULL);
+        }
+        if (has_location(instruction)) {
+          extend_interval(value_indices[instruction->id], position + 1);
+        }
+      }
+      position += 2;
+    }
+  }
+
+  free(definitions);
+  free(live_out);
+  free(live_in);
+  free(uses);
+  free(block_ends);
+  free(block_starts);
+}
+
+static int compare_intervals(const void *a, const void *b) {
+  int lhs = *(int *)a;
+  int rhs = *(int *)b;
+  if (interval_starts[lhs] != interval_starts[rhs]) {
+    return interval_starts[lhs] < interval_starts[rhs] ? -1 : 1;
+  }
+  return lhs - rhs;
+}
+
+// Register the allocation of value would like, so that a phi and the values it merges share a register and need no moves,
+// and an operation can update its first operand in place.
+static Register preferred_register(IrInstruction *value, int *phi_users) {
+  Operand operand = (Operand){0};
+  if (value->opcode == IR_OPCODE_PHI) {
+    for (int i = 0; i < value->operands_count && operand.kind != OPERAND_KIND_REGISTER; i++) {
+      operand = locations[value->operands[i]->id];
+    }
+  } else if (phi_users[value_indices[value->id]] >= 0) {
+    operand = locations[values[phi_users[value_indices[value->id]]]->id];
+  }
+  if (operand.kind != OPERAND_KIND_REGISTER && value->operands_count > 0 && value->opcode != IR_OPCODE_CALL) {
+    operand = locations[value->operands[0]->id];
+  }
+  return operand.kind == OPERAND_KIND_REGISTER ? operand.base : REGISTER_NONE;
+}
+
+// Allocates registers to the intervals by linear scan, in order of their starts.
+// When none is free, the interval ending last among the active ones and the new one is spilled to its own slot in the frame.
+// Returns the size of the frame, including the saved registers and the spill slots.
+static int allocate_registers(int frame_size) {
+  int *call_positions = calloc(function->values_count, sizeof(int));
+  int calls_count = 0;
+  int *phi_users = calloc(values_count, sizeof(int));
+  for (int i = 0; i < values_count; i++) {
+    phi_users[i] = -1;
+  }
+  int position = 0;
+  for (int i = 0; i < layout_count; i++) {
+    IrBlock *block = layout[i];
+    for (int j = 0; j < block->instructions_count; j++) {
+      IrInstruction *instruction = block->instructions[j];
+      if (instruction->opcode == IR_OPCODE_CALL) {
+        call_positions[calls_count++] = position;
+      }
+      if (instruction->opcode == IR_OPCODE_PHI && has_location(instruction)) {
+        for (int k = 0; k < instruction->operands_count; k++) {
+          if (has_location(instruction->operands[k])) {
+            phi_users[value_indices[instruction->operands[k]->id]] = value_indices[instruction->id];
+          }
+        }
+      }
+      position += 2;
+    }
+  }
+
+  int *order = calloc(values_count, sizeof(int));
+  for (int i = 0; i < values_count; i++) {
+    order[i] = i;
+  }
+  qsort(order, values_count, sizeof(int), compare_intervals);
+
+  int owners[REGISTERS_COUNT];
+  for (int i = 0; i < REGISTERS_COUNT; i++) {
+    owners[i] = -1;
+  }
+  bool is_saved[REGISTERS_COUNT] = {0};
+  int spill_slots_count = 0;
+  int next_call = 0;
+  for (int i = 0; i < values_count; i++) {
+    int index = order[i];
+    int start = interval_starts[index];
+    int end = interval_ends[index];
+    for (int r = 0; r < REGISTERS_COUNT; r++) {
+      if (owners[r] >= 0 && interval_ends[owners[r]] < start) {
+        owners[r] = -1;
+      }
+    }
+    while (next_call < calls_count && call_positions[next_call] <= start) {
+      next_call++;
+    }
+    bool crosses_call = next_call < calls_count && call_positions[next_call] < end;
+
+    Register candidates[CALLER_SAVED_REGISTERS_COUNT + CALLEE_SAVED_REGISTERS_COUNT];
+    int candidates_count = 0;
+    if (!crosses_call) {
+      for (int r = 0; r < CALLER_SAVED_REGISTERS_COUNT; r++) {
+        candidates[candidates_count++] = caller_saved_registers[r];
+      }
+    }
+    for (int r = 0; r < CALLEE_SAVED_REGISTERS_COUNT; r++) {
+      candidates[candidates_count++] = callee_saved_registers[r];
+    }
+
+    Register chosen = REGISTER_NONE;
+    Register preferred = preferred_register(values[index], phi_users);
+    for (int r = 0; r < candidates_count; r++) {
+      if (owners[candidates[r]] < 0 && (chosen == REGISTER_NONE || candidates[r] == preferred)) {
+        chosen = candidates[r];
+      }
+    }
+    if (chosen == REGISTER_NONE) {
+      Register victim = REGISTER_NONE;
+      for (int r = 0; r < candidates_count; r++) {
+        if (victim == REGISTER_NONE || interval_ends[owners[candidates[r]]] > interval_ends[owners[victim]]) {
+          victim = candidates[r];
+        }
+      }
+      if (interval_ends[owners[victim]] > end) {
+        int spilled = owners[victim];
+        locations[values[spilled]->id] = memory_operand(REGISTER_RBP, -8 * ++spill_slots_count, 8);
+        chosen = victim;
+      } else {
+        locations[values[index]->id] = memory_operand(REGISTER_RBP, -8 * ++spill_slots_count, 8);
+        continue;
+      }
+    }
+    owners[chosen] = index;
+    locations[values[index]->id] = register64(chosen);
+    is_saved[chosen] = true;
+  }
+
+  saved_registers_count = 0;
+  for (int r = 0; r < CALLEE_SAVED_REGISTERS_COUNT; r++) {
+    if (is_saved[callee_saved_registers[r]]) {
+      saved_registers[saved_registers_count++] = callee_saved_registers[r];
+    }
+  }
+
+  // Spill slots are placed below the saved registers, whose number is only known now.
+  saved_registers_offset = align(frame_size, 8);
+  int spill_base = saved_registers_offset + 8 * saved_registers_count;
+  for (int i = 0; i < values_count; i++) {
+    if (locations[values[i]->id].kind == OPERAND_KIND_MEMORY) {
+      locations[values[i]->id].value -= spill_base;
+    }
+  }
+  free(order);
+  free(phi_users);
+  free(call_positions);
+  return spill_base + 8 * spill_slots_count;
+}
+
+// Memory operand addressing the frame slot or global of a variable, offset by displacement bytes.
+static Operand variable_address(IrInstruction *address, int displacement, int size) {
+  if (address->opcode == IR_OPCODE_GLOBAL_ADDRESS) {
+    return global_memory_operand(address->variable->symbol, size);
+  }
+  return memory_operand(REGISTER_RBP, -address->variable->offset + displacement, size);
+}
+
+// Moves value into register_, unless it is already there.
+static void move_to_register(Register register_, IrInstruction *value) {
+  if (value->opcode == IR_OPCODE_CONSTANT) {
+    append2(OPCODE_MOV, register64(register_), immediate_operand(value->value));
+  } else if (is_address(value)) {
+    append2(OPCODE_LEA, register64(register_), variable_address(value, 0, 0));
+  } else if (!is_register(locations[value->id], register_)) {
+    append2(OPCODE_MOV, register64(register_), locations[value->id]);
+  }
+}
+
+// Register holding value, which is loaded into scratch unless it is allocated to a register.
+static Register value_register(IrInstruction *value, Register scratch) {
+  if (!is_rematerialized(value) && locations[value->id].kind == OPERAND_KIND_REGISTER) {
+    return locations[value->id].base;
+  }
+  move_to_register(scratch, value);
+  return scratch;
+}
+
+// Operand reading value: an immediate, its register or spill slot, or scratch holding its address.
+static Operand value_operand(IrInstruction *value, Register scratch) {
+  if (value->opcode == IR_OPCODE_CONSTANT) {
+    return immediate_operand(value->value);
+  }
+  if (is_address(value)) {
+    move_to_register(scratch, value);
+    return register64(scratch);
+  }
+  return locations[value->id];
+}
+
+// Memory operand of size bytes at address, whose base and index are loaded into rcx and rdx when they are spilled.
+static Operand memory_at(IrInstruction *address, int size) {
+  if (is_address(address)) {
+    return variable_address(address, 0, size);
+  }
+  if (!is_folded[address->id]) {
+    return memory_operand(value_register(address, REGISTER_RCX), 0, size);
+  }
+  IrInstruction *base = address->operands[0];
+  IrInstruction *offset = address->operands[1];
+  if (offset->opcode == IR_OPCODE_CONSTANT) {
+    if (base->opcode == IR_OPCODE_LOCAL_ADDRESS) {
+      return variable_address(base, offset->value, size);
+    }
+    return memory_operand(value_register(base, REGISTER_RCX), offset->value, size);
+  }
+  Register index;
+  int scale = 1;
+  if (is_folded[offset->id]) {
+    index = value_register(offset->operands[0], REGISTER_RDX);
+    scale = offset->operands[1]->value;
+  } else {
+    index = value_register(offset, REGISTER_RDX);
+  }
+  if (base->opcode == IR_OPCODE_LOCAL_ADDRESS) {
+    return indexed_memory_operand(REGISTER_RBP, index, scale, -base->variable->offset, size);
+  }
+  return indexed_memory_operand(value_register(base, REGISTER_RCX), index, scale, 0, size);
+}
+
+// Writes value computed into register_ to its location, unless it is already there.
+static void move_result(IrInstruction *value, Register register_) {
+  if (!is_register(locations[value->id], register_)) {
+    append2(OPCODE_MOV, locations[value->id], register64(register_));
+  }
+}
+
+// Register an instruction defining value computes into: its own, or rax when value is spilled.
+static Register result_register(IrInstruction *value) {
+  return locations[value->id].kind == OPERAND_KIND_REGISTER ? locations[value->id].base : REGISTER_RAX;
+}
+
+static bool reads_location(Move *move, Operand location) {
+  return !move->is_address && (move->source.kind == OPERAND_KIND_REGISTER || move->source.kind == OPERAND_KIND_MEMORY) && is_same_operand(move->source, location);
+}
+
+static void emit_move(Move *move) {
+  if (move->is_address || move->source.kind == OPERAND_KIND_MEMORY) {
+    if (move->destination.kind == OPERAND_KIND_REGISTER) {
+      append2(move->is_address ? OPCODE_LEA : OPCODE_MOV, move->destination, move->source);
+      return;
+    }
+    // Memory cannot be moved to memory directly. rcx is never a destination of moves into memory.
+    append2(move->is_address ? OPCODE_LEA : OPCODE_MOV, register64(REGISTER_RCX), move->source);
+    append2(OPCODE_MOV, move->destination, register64(REGISTER_RCX));
+    return;
+  }
+  append2(OPCODE_MOV, move->destination, move->source);
+}
+
+// Performs moves as if all at once. A move whose destination no other move reads is done first,
+// and when only cycles are left, the destination of one of them is saved in rax to break it.
+static void emit_parallel_move(Move *moves, int count) {
+  int pending = 0;
+  for (int i = 0; i < count; i++) {
+    if (moves[i].is_address || !is_same_operand(moves[i].destination, moves[i].source)) {
+      moves[pending++] = moves[i];
+    }
+  }
+  while (pending > 0) {
+    int ready = -1;
+    for (int i = 0; i < pending && ready < 0; i++) {
+      ready = i;
+      for (int j = 0; j < pending; j++) {
+        if (j != i && reads_location(&moves[j], moves[i].destination)) {
+          ready = -1;
+          break;
+        }
+      }
+    }
+    if (ready < 0) {
+      Operand saved = moves[0].destination;
+      append2(OPCODE_MOV, register64(REGISTER_RAX), saved);
+      for (int j = 0; j < pending; j++) {
+        if (reads_location(&moves[j], saved)) {
+          moves[j].source = register64(REGISTER_RAX);
+        }
+      }
+      continue;
+    }
+    emit_move(&moves[ready]);
+    moves[ready] = moves[--pending];
+  }
+}
+
+static Move move_of_value(Operand destination, IrInstruction *value) {
+  if (value->opcode == IR_OPCODE_CONSTANT) {
+    return (Move){destination, immediate_operand(value->value), false};
+  }
+  if (is_address(value)) {
+    return (Move){destination, variable_address(value, 0, 0), true};
+  }
+  return (Move){destination, locations[value->id], false};
+}
+
+// Moves the operands phis of successor take from block into the phis.
+static void emit_phi_moves(IrBlock *block, IrBlock *successor) {
+  int index = 0;
+  while (successor->predecessors[index] != block) {
+    index++;
+  }
+  int count = phis_count(successor);
+  Move *moves = calloc(count, sizeof(Move));
+  int moves_count = 0;
+  for (int i = 0; i < count; i++) {
+    IrInstruction *phi = successor->instructions[i];
+    if (has_location(phi)) {
+      moves[moves_count++] = move_of_value(locations[phi->id], phi->operands[index]);
+    }
+  }
+  emit_parallel_move(moves, moves_count);
+  free(moves);
+}
+
+static void emit_prologue(int frame_size) {
+  append1(OPCODE_PUSH, register64(REGISTER_RBP));
+  append2(OPCODE_MOV, register64(REGISTER_RBP), register64(REGISTER_RSP));
+  append2(OPCODE_SUB, register64(REGISTER_RSP), immediate_operand(align(frame_size, 16)));
+  for (int i = 0; i < saved_registers_count; i++) {
+    append2(OPCODE_MOV, memory_operand(REGISTER_RBP, -saved_registers_offset - 8 * (i + 1), 8), register64(saved_registers[i]));
+  }
+
+  // Callers may leave garbage above arguments narrower than 8 bytes, so they are sign-extended like loads.
+  IrBlock *entry = layout[0];
+  Move moves[6];
+  int moves_count = 0;
+  for (int i = 0; i < entry->instructions_count && entry->instructions[i]->opcode == IR_OPCODE_PARAMETER; i++) {
+    IrInstruction *parameter = entry->instructions[i];
+    if (!has_location(parameter)) {
+      continue;
+    }
+    Register argument = argument_registers[parameter->value];
+    int size = parameter->variable->type->size;
+    if (size != 8) {
+      append2(OPCODE_MOVSX, register64(argument), register_operand(argument, size));
+    }
+    moves[moves_count++] = (Move){locations[parameter->id], register64(argument), false};
+  }
+  emit_parallel_move(moves, moves_count);
+}
+
+static Opcode set_opcode(IrOpcode opcode) {
+  switch (opcode) {
+  case IR_OPCODE_EQ:
+    return OPCODE_SETE;
+  case IR_OPCODE_LE:
+    return OPCODE_SETLE;
+  case IR_OPCODE_LT:
+    return OPCODE_SETL;
+  default:
+    return OPCODE_SETNE;
+  }
+}
+
+// Compares the operands of a comparison, returning the set instruction of its result.
+static Opcode emit_compare(IrInstruction *comparison) {
+  Operand lhs = value_operand(comparison->operands[0], REGISTER_RAX);
+  Operand rhs = value_operand(comparison->operands[1], REGISTER_RCX);
+  if (lhs.kind == OPERAND_KIND_IMMEDIATE || lhs.kind == OPERAND_KIND_MEMORY && rhs.kind == OPERAND_KIND_MEMORY) {
+    append2(OPCODE_MOV, register64(REGISTER_RAX), lhs);
+    lhs = register64(REGISTER_RAX);
+  }
+  append2(OPCODE_CMP, lhs, rhs);
+  return set_opcode(comparison->opcode);
+}
+
+static void emit_comparison(IrInstruction *comparison) {
+  Opcode set = emit_compare(comparison);
+  append1(set, register_operand(REGISTER_RAX, 1));
+  Register result = result_register(comparison);
+  append2(OPCODE_MOVZX, register64(result), register_operand(REGISTER_RAX, 1));
+  move_result(comparison, result);
+}
+
+static Opcode arithmetic_opcode(IrOpcode opcode) {
+  switch (opcode) {
+  case IR_OPCODE_ADD:
+    return OPCODE_ADD;
+  case IR_OPCODE_MULTIPLY:
+    return OPCODE_IMUL;
+  default:
+    return OPCODE_SUB;
+  }
+}
+
+// Two-address arithmetic into the register of the result. The result is computed in rax instead when it is spilled,
+// or when its register holds the right operand, which the first move would overwrite.
+static void emit_arithmetic(IrInstruction *instruction) {
+  IrInstruction *lhs = instruction->operands[0];
+  IrInstruction *rhs = instruction->operands[1];
+  Operand result = locations[instruction->id];
+  bool is_commutative = instruction->opcode != IR_OPCODE_SUBTRACT;
+  if (is_commutative && (lhs->opcode == IR_OPCODE_CONSTANT || is_same_operand(locations[rhs->id], result) && !is_rematerialized(rhs))) {
+    IrInstruction *operand = lhs;
+    lhs = rhs;
+    rhs = operand;
+  }
+  Register work = result_register(instruction);
+  if (!is_rematerialized(rhs) && is_same_operand(locations[rhs->id], result) && !(!is_rematerialized(lhs) && is_same_operand(locations[lhs->id], result))) {
+    work = REGISTER_RAX;
+  }
+  move_to_register(work, lhs);
+  append2(arithmetic_opcode(instruction->opcode), register64(work), value_operand(rhs, REGISTER_RCX));
+  if (!is_register(result, work)) {
+    append2(OPCODE_MOV, result, register64(work));
+  }
+}
+
+static void emit_divide(IrInstruction *instruction) {
+  move_to_register(REGISTER_RAX, instruction->operands[0]);
+  Operand divisor = value_operand(instruction->operands[1], REGISTER_RCX);
+  if (divisor.kind == OPERAND_KIND_IMMEDIATE) {
+    append2(OPCODE_MOV, register64(REGISTER_RCX), divisor);
+    divisor = register64(REGISTER_RCX);
+  }
+  append0(OPCODE_CQO);
+  append1(OPCODE_IDIV, divisor);
+  move_result(instruction, REGISTER_RAX);
+}
+
+static void emit_load(IrInstruction *load) {
+  Operand memory = memory_at(load->operands[0], load->value);
+  Register result = result_register(load);
+  append2(load->value == 8 ? OPCODE_MOV : OPCODE_MOVSX, register64(result), memory);
+  move_result(load, result);
+}
+
+static void emit_store(IrInstruction *store) {
+  int size = store->value;
+  IrInstruction *value = store->operands[1];
+  Operand source;
+  if (value->opcode == IR_OPCODE_CONSTANT) {
+    source = immediate_operand(size == 1 ? (signed char)value->value : value->value);
+  } else {
+    source = register_operand(value_register(value, REGISTER_RAX), size);
+  }
+  append2(OPCODE_MOV, memory_at(store->operands[0], size), source);
+}
+
+static void emit_sign_extend(IrInstruction *instruction) {
+  IrInstruction *value = instruction->operands[0];
+  Operand source = locations[value->id];
+  if (source.kind == OPERAND_KIND_REGISTER) {
+    source = register_operand(source.base, instruction->value);
+  } else if (source.kind == OPERAND_KIND_MEMORY) {
+    source.size = instruction->value;
+  } else {
+    move_to_register(REGISTER_RAX, value);
+    source = register_operand(REGISTER_RAX, instruction->value);
+  }
+  Register result = result_register(instruction);
+  append2(OPCODE_MOVSX, register64(result), source);
+  move_result(instruction, result);
+}
+
+static void emit_call(IrInstruction *call) {
+  Move moves[6];
+  for (int i = 0; i < call->operands_count; i++) {
+    moves[i] = move_of_value(register64(argument_registers[i]), call->operands[i]);
+  }
+  emit_parallel_move(moves, call->operands_count);
+  append2(OPCODE_MOV, register64(REGISTER_RAX), immediate_operand(0));
+  append1(OPCODE_CALL, symbol_operand(call->symbol));
+  if (!has_location(call)) {
+    return;
+  }
+  // Only eax is defined by a callee returning int.
+  if (call->value == 4) {
+    Register result = result_register(call);
+    append2(OPCODE_MOVSX, register64(result), register_operand(REGISTER_RAX, 4));
+    move_result(call, result);
+  } else {
+    move_result(call, REGISTER_RAX);
+  }
+}
+
+static void emit_return(IrInstruction *instruction) {
+  move_to_register(REGISTER_RAX, instruction->operands[0]);
+  for (int i = 0; i < saved_registers_count; i++) {
+    append2(OPCODE_MOV, register64(saved_registers[i]), memory_operand(REGISTER_RBP, -saved_registers_offset - 8 * (i + 1), 8));
+  }
+  append2(OPCODE_MOV, register64(REGISTER_RSP), register64(REGISTER_RBP));
+  append1(OPCODE_POP, register64(REGISTER_RBP));
+  append0(OPCODE_RET);
+}
+
+// Jumps to true_target when condition holds and to false_target otherwise, falling through to the next block when it can.
+static void emit_conditional_jump(Opcode jump, IrBlock *block, IrBlock *true_target, IrBlock *false_target) {
+  if (true_target->order == block->order + 1) {
+    append1(negate_condition(jump), label_operand(false_target->order));
+    return;
+  }
+  append1(jump, label_operand(true_target->order));
+  if (false_target->order != block->order + 1) {
+    append1(OPCODE_JMP, label_operand(false_target->order));
+  }
+}
+
+static void emit_branch(IrInstruction *branch) {
+  IrInstruction *condition = branch->operands[0];
+  Opcode jump;
+  if (is_folded[condition->id]) {
+    jump = jump_of_set(emit_compare(condition));
+  } else {
+    Operand operand = value_operand(condition, REGISTER_RAX);
+    if (operand.kind == OPERAND_KIND_IMMEDIATE) {
+      append2(OPCODE_MOV, register64(REGISTER_RAX), operand);
+      operand = register64(REGISTER_RAX);
+    }
+    append2(OPCODE_CMP, operand, immediate_operand(0));
+    jump = OPCODE_JNE;
+  }
+  emit_conditional_jump(jump, branch->block, branch->targets[0], branch->targets[1]);
+}
+
+static void emit_jump(IrInstruction *jump) {
+  emit_phi_moves(jump->block, jump->targets[0]);
+  if (jump->targets[0]->order != jump->block->order + 1) {
+    append1(OPCODE_JMP, label_operand(jump->targets[0]->order));
+  }
+}
+
+static void emit_instruction(IrInstruction *instruction) {
+  if (is_folded[instruction->id]) {
+    return;
+  }
+  switch (instruction->opcode) {
+  case IR_OPCODE_ADD:
+  case IR_OPCODE_MULTIPLY:
+  case IR_OPCODE_SUBTRACT:
+    emit_arithmetic(instruction);
+    break;
+  case IR_OPCODE_BRANCH:
+    emit_branch(instruction);
+    break;
+  case IR_OPCODE_CALL:
+    emit_call(instruction);
+    break;
+  case IR_OPCODE_DIVIDE:
+    emit_divide(instruction);
+    break;
+  case IR_OPCODE_EQ:
+  case IR_OPCODE_LE:
+  case IR_OPCODE_LT:
+  case IR_OPCODE_NE:
+    emit_comparison(instruction);
+    break;
+  case IR_OPCODE_JUMP:
+    emit_jump(instruction);
+    break;
+  case IR_OPCODE_LOAD:
+    emit_load(instruction);
+    break;
+  case IR_OPCODE_RETURN:
+    emit_return(instruction);
+    break;
+  case IR_OPCODE_SIGN_EXTEND:
+    emit_sign_extend(instruction);
+    break;
+  case IR_OPCODE_STORE:
+    emit_store(instruction);
+    break;
+  default:
+    // Constants and addresses are rematerialized by their users, parameters are moved by the prologue,
+    // and phis by the predecessors of their blocks.
+    break;
+  }
+}
+
+static int compare_layout_order(const void *a, const void *b) {
+  return (*(IrBlock **)a)->order - (*(IrBlock **)b)->order;
+}
+
+// Appends the instructions of an optimized function to list: blocks are laid out in reverse postorder,
+// values are allocated to registers by linear scan over their live intervals, and phis become moves on incoming edges.
+void select_instructions(IrFunction *function_, InstructionList *list_) {
+  function = function_;
+  list = list_;
+  split_critical_edges();
+  compute_dominators(function);
+  layout = calloc(function->blocks_count, sizeof(IrBlock *));
+  layout_count = 0;
+  for (int i = 0; i < function->blocks_count; i++) {
+    if (function->blocks[i]->order >= 0) {
+      layout[layout_count++] = function->blocks[i];
+    }
+  }
+  qsort(layout, layout_count, sizeof(IrBlock *), compare_layout_order);
+
+  use_counts = calloc(function->values_count, sizeof(int));
+  is_folded = calloc(function->values_count, sizeof(bool));
+  locations = calloc(function->values_count, sizeof(Operand));
+  value_indices = calloc(function->values_count, sizeof(int));
+  fold_instructions();
+  compute_intervals();
+
+  emit_prologue(allocate_registers(function->definition->function_definition.frame_size));
+  for (int i = 0; i < layout_count; i++) {
+    IrBlock *block = layout[i];
+    if (block->predecessors_count > 0) {
+      append1(OPCODE_LABEL, label_operand(block->order));
+    }
+    for (int j = 0; j < block->instructions_count; j++) {
+      emit_instruction(block->instructions[j]);
+    }
+  }
+
+  free(interval_ends);
+  free(interval_starts);
+  free(values);
+  free(value_indices);
+  free(locations);
+  free(is_folded);
+  free(use_counts);
+  free(layout);
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "instruction.h" // InstructionList
+#include "ir.h"          // IrFunction
+
+void select_instructions(IrFunction *function, InstructionList *list);
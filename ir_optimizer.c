@@ -0,0 +1,453 @@
+#include "ir_optimizer.h"
+#include <limits.h> // INT_MIN
+#include <stdlib.h> // calloc, free
+
+typedef struct IrPass IrPass;
+
+// Pass over the IR of a function, returning whether it changed anything.
+struct IrPass {
+  char *name;
+  bool (*run)(IrFunction *function);
+};
+
+static IrPass ir_passes[] = {
+    {"copy-propagation", propagate_ir_copies},
+    {"value-numbering", number_ir_values},
+    {"dead-code-elimination", eliminate_dead_ir_code},
+};
+
+#define IR_PASSES_COUNT (sizeof(ir_passes) / sizeof(IrPass))
+
+// Runs the passes in turn until none of them changes anything. Every pass only removes or simplifies instructions, so this ends.
+// Copy propagation runs last, which leaves no operand referring to a replaced value.
+void optimize_ir(IrFunction *function) {
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = 0; i < IR_PASSES_COUNT; i++) {
+      if (ir_passes[i].run(function)) {
+        changed = true;
+      }
+    }
+  }
+  propagate_ir_copies(function);
+}
+
+// Removes the instructions of block for which keep returns false, preserving the order of the others.
+static void remove_instructions(IrBlock *block, bool (*keep)(IrInstruction *instruction)) {
+  int count = 0;
+  for (int i = 0; i < block->instructions_count; i++) {
+    if (keep(block->instructions[i])) {
+      block->instructions[count++] = block->instructions[i];
+    }
+  }
+  block->instructions_count = count;
+}
+
+static bool is_not_replaced(IrInstruction *instruction) {
+  return instruction->replacement == NULL;
+}
+
+// Returns the only value a phi merges other than itself, or NULL when it merges several.
+static IrInstruction *trivial_phi_value(IrInstruction *phi) {
+  IrInstruction *value = NULL;
+  for (int i = 0; i < phi->operands_count; i++) {
+    IrInstruction *operand = resolve_ir_value(phi->operands[i]);
+    if (operand == phi || operand == value) {
+      continue;
+    }
+    if (value != NULL) {
+      return NULL;
+    }
+    value = operand;
+  }
+  return value;
+}
+
+// Whether value is already sign-extended from its lowest size bytes.
+static bool is_sign_extended(IrInstruction *value, int size) {
+  switch (value->opcode) {
+  case IR_OPCODE_CONSTANT:
+    return size == 1 ? value->value == (signed char)value->value : true;
+  case IR_OPCODE_LOAD:
+  case IR_OPCODE_SIGN_EXTEND:
+    return value->value <= size;
+  case IR_OPCODE_PARAMETER:
+    return value->variable->type->size <= size;
+  default:
+    return false;
+  }
+}
+
+// Redirects operands to the values replacing them, and removes phis merging a single value and redundant sign extensions.
+bool propagate_ir_copies(IrFunction *function) {
+  bool changed = false;
+  bool simplified = true;
+  while (simplified) {
+    simplified = false;
+    for (int i = 0; i < function->blocks_count; i++) {
+      IrBlock *block = function->blocks[i];
+      for (int j = 0; j < block->instructions_count; j++) {
+        IrInstruction *instruction = block->instructions[j];
+        if (instruction->replacement != NULL) {
+          continue;
+        }
+        IrInstruction *value = NULL;
+        if (instruction->opcode == IR_OPCODE_PHI) {
+          value = trivial_phi_value(instruction);
+        } else if (instruction->opcode == IR_OPCODE_SIGN_EXTEND && is_sign_extended(resolve_ir_value(instruction->operands[0]), instruction->value)) {
+          value = resolve_ir_value(instruction->operands[0]);
+        }
+        if (value != NULL) {
+          instruction->replacement = value;
+          simplified = true;
+        }
+      }
+    }
+  }
+
+  for (int i = 0; i < function->blocks_count; i++) {
+    IrBlock *block = function->blocks[i];
+    for (int j = 0; j < block->instructions_count; j++) {
+      IrInstruction *instruction = block->instructions[j];
+      if (instruction->replacement != NULL) {
+        changed = true;
+      }
+      for (int k = 0; k < instruction->operands_count; k++) {
+        instruction->operands[k] = resolve_ir_value(instruction->operands[k]);
+      }
+    }
+    remove_instructions(block, is_not_replaced);
+  }
+  return changed;
+}
+
+static bool is_commutative(IrOpcode opcode) {
+  switch (opcode) {
+  case IR_OPCODE_ADD:
+  case IR_OPCODE_EQ:
+  case IR_OPCODE_MULTIPLY:
+  case IR_OPCODE_NE:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Instructions computing the same value from the same operands wherever they are.
+static bool is_pure(IrOpcode opcode) {
+  switch (opcode) {
+  case IR_OPCODE_ADD:
+  case IR_OPCODE_CONSTANT:
+  case IR_OPCODE_DIVIDE:
+  case IR_OPCODE_EQ:
+  case IR_OPCODE_GLOBAL_ADDRESS:
+  case IR_OPCODE_LE:
+  case IR_OPCODE_LOCAL_ADDRESS:
+  case IR_OPCODE_LT:
+  case IR_OPCODE_MULTIPLY:
+  case IR_OPCODE_NE:
+  case IR_OPCODE_SIGN_EXTEND:
+  case IR_OPCODE_SUBTRACT:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Evaluates a binary operation on two constants like the tree optimizer.
+// Returns false when it cannot be evaluated at compile time.
+static bool evaluate(IrOpcode opcode, int lhs, int rhs, int *result) {
+  long value;
+  switch (opcode) {
+  case IR_OPCODE_ADD:
+    value = (long)lhs + rhs;
+    break;
+  case IR_OPCODE_SUBTRACT:
+    value = (long)lhs - rhs;
+    break;
+  case IR_OPCODE_MULTIPLY:
+    value = (long)lhs * rhs;
+    break;
+  case IR_OPCODE_DIVIDE:
+    if (rhs == 0) {
+      return false;
+    }
+    value = (long)lhs / rhs;
+    break;
+  case IR_OPCODE_EQ:
+    value = lhs == rhs;
+    break;
+  case IR_OPCODE_NE:
+    value = lhs != rhs;
+    break;
+  case IR_OPCODE_LT:
+    value = lhs < rhs;
+    break;
+  case IR_OPCODE_LE:
+    value = lhs <= rhs;
+    break;
+  default:
+    return false;
+  }
+  // Results that do not fit in int are left to run time rather than folded with wraparound.
+  if (value < INT_MIN || value > INT_MAX) {
+    return false;
+  }
+  *result = value;
+  return true;
+}
+
+// Turns an instruction whose operands are all constants into a constant in place.
+static bool fold_constants(IrInstruction *instruction) {
+  int result;
+  if (instruction->opcode == IR_OPCODE_SIGN_EXTEND && instruction->operands[0]->opcode == IR_OPCODE_CONSTANT) {
+    result = instruction->value == 1 ? (signed char)instruction->operands[0]->value : instruction->operands[0]->value;
+  } else if (instruction->operands_count != 2 || instruction->operands[0]->opcode != IR_OPCODE_CONSTANT || instruction->operands[1]->opcode != IR_OPCODE_CONSTANT || !evaluate(instruction->opcode, instruction->operands[0]->value, instruction->operands[1]->value, &result)) {
+    return false;
+  }
+  instruction->opcode = IR_OPCODE_CONSTANT;
+  instruction->operands_count = 0;
+  instruction->value = result;
+  return true;
+}
+
+// State of value numbering, which walks the dominator tree with a table of the values available at each block.
+static _Thread_local IrInstruction **table;
+static _Thread_local int table_capacity;
+static _Thread_local int *inserted_slots;
+static _Thread_local int inserted_slots_count;
+static _Thread_local IrBlock ***children;
+static _Thread_local int *children_counts;
+
+// Operands of an instruction in the order they are compared in, which ignores the order of commutative operands.
+static void ordered_operands(IrInstruction *instruction, IrInstruction **operands) {
+  operands[0] = instruction->operands_count > 0 ? instruction->operands[0] : NULL;
+  operands[1] = instruction->operands_count > 1 ? instruction->operands[1] : NULL;
+  if (is_commutative(instruction->opcode) && operands[0]->id > operands[1]->id) {
+    IrInstruction *operand = operands[0];
+    operands[0] = operands[1];
+    operands[1] = operand;
+  }
+}
+
+static unsigned int hash_instruction(IrInstruction *instruction) {
+  IrInstruction *operands[2];
+  ordered_operands(instruction, operands);
+  unsigned int hash = instruction->opcode * 31u + (unsigned int)instruction->value;
+  hash = hash * 31u + (unsigned int)(size_t)instruction->variable;
+  for (int i = 0; i < 2; i++) {
+    hash = hash * 31u + (operands[i] ? (unsigned int)operands[i]->id : 0);
+  }
+  return hash ^ hash >> 15;
+}
+
+static bool is_same_value(IrInstruction *a, IrInstruction *b) {
+  if (a->opcode != b->opcode || a->value != b->value || a->variable != b->variable || a->operands_count != b->operands_count) {
+    return false;
+  }
+  IrInstruction *a_operands[2];
+  IrInstruction *b_operands[2];
+  ordered_operands(a, a_operands);
+  ordered_operands(b, b_operands);
+  return a_operands[0] == b_operands[0] && a_operands[1] == b_operands[1];
+}
+
+// Returns an equal value already in the table, or inserts instruction and returns NULL.
+static IrInstruction *find_or_insert(IrInstruction *instruction) {
+  int slot = hash_instruction(instruction) & (table_capacity - 1);
+  while (table[slot] != NULL) {
+    if (is_same_value(table[slot], instruction)) {
+      return table[slot];
+    }
+    slot = (slot + 1) & (table_capacity - 1);
+  }
+  table[slot] = instruction;
+  inserted_slots[inserted_slots_count++] = slot;
+  return NULL;
+}
+
+// Values in the table are available in every block the block they are in dominates.
+// Entries are removed in the reverse order of their insertion on the way back up, which keeps the probe sequences intact.
+static bool number_block(IrBlock *block) {
+  bool changed = false;
+  int saved_inserted_slots_count = inserted_slots_count;
+  for (int i = 0; i < block->instructions_count; i++) {
+    IrInstruction *instruction = block->instructions[i];
+    for (int j = 0; j < instruction->operands_count; j++) {
+      instruction->operands[j] = resolve_ir_value(instruction->operands[j]);
+    }
+    if (!is_pure(instruction->opcode)) {
+      continue;
+    }
+    if (fold_constants(instruction)) {
+      changed = true;
+    }
+    IrInstruction *value = find_or_insert(instruction);
+    if (value != NULL) {
+      instruction->replacement = value;
+      changed = true;
+    }
+  }
+  for (int i = 0; i < children_counts[block->order]; i++) {
+    if (number_block(children[block->order][i])) {
+      changed = true;
+    }
+  }
+  while (inserted_slots_count > saved_inserted_slots_count) {
+    table[inserted_slots[--inserted_slots_count]] = NULL;
+  }
+  return changed;
+}
+
+// Global value numbering over the dominator tree: a pure instruction equal to one in a dominating block is replaced by it,
+// and instructions on constants are folded first so that the results are numbered too.
+bool number_ir_values(IrFunction *function) {
+  compute_dominators(function);
+  int count = 0;
+  for (int i = 0; i < function->blocks_count; i++) {
+    if (function->blocks[i]->order >= 0) {
+      count++;
+    }
+  }
+  children = calloc(count, sizeof(IrBlock **));
+  children_counts = calloc(count, sizeof(int));
+  for (int i = 0; i < function->blocks_count; i++) {
+    IrBlock *block = function->blocks[i];
+    if (block->order > 0) {
+      children_counts[block->dominator->order]++;
+    }
+  }
+  for (int i = 0; i < count; i++) {
+    children[i] = calloc(children_counts[i], sizeof(IrBlock *));
+    children_counts[i] = 0;
+  }
+  for (int i = 0; i < function->blocks_count; i++) {
+    IrBlock *block = function->blocks[i];
+    if (block->order > 0) {
+      int parent = block->dominator->order;
+      children[parent][children_counts[parent]++] = block;
+    }
+  }
+
+  table_capacity = 16;
+  while (table_capacity < function->values_count * 2) {
+    table_capacity *= 2;
+  }
+  table = calloc(table_capacity, sizeof(IrInstruction *));
+  inserted_slots = calloc(function->values_count, sizeof(int));
+  inserted_slots_count = 0;
+  bool changed = number_block(function->blocks[0]);
+
+  free(inserted_slots);
+  free(table);
+  for (int i = 0; i < count; i++) {
+    free(children[i]);
+  }
+  free(children);
+  free(children_counts);
+  return changed;
+}
+
+// Removes the edge from block to its successor, along with the operands the phis of the successor take from it.
+static void remove_edge(IrBlock *block, IrBlock *successor) {
+  int index = 0;
+  while (successor->predecessors[index] != block) {
+    index++;
+  }
+  successor->predecessors_count--;
+  for (int i = index; i < successor->predecessors_count; i++) {
+    successor->predecessors[i] = successor->predecessors[i + 1];
+  }
+  for (int i = 0; i < successor->instructions_count && successor->instructions[i]->opcode == IR_OPCODE_PHI; i++) {
+    IrInstruction *phi = successor->instructions[i];
+    phi->operands_count--;
+    for (int j = index; j < phi->operands_count; j++) {
+      phi->operands[j] = phi->operands[j + 1];
+    }
+  }
+}
+
+// Liveness of the instructions of the function being swept, indexed by id.
+static _Thread_local bool *live;
+
+static bool is_live(IrInstruction *instruction) {
+  return live[instruction->id];
+}
+
+static void mark(IrInstruction *instruction, IrInstruction **worklist, int *worklist_count) {
+  instruction = resolve_ir_value(instruction);
+  if (!live[instruction->id]) {
+    live[instruction->id] = true;
+    worklist[(*worklist_count)++] = instruction;
+  }
+}
+
+// Turns branches on constants into jumps, removes the blocks no longer reachable from the entry,
+// and removes the instructions whose values are never used by ones with side effects.
+bool eliminate_dead_ir_code(IrFunction *function) {
+  bool changed = false;
+  for (int i = 0; i < function->blocks_count; i++) {
+    IrBlock *block = function->blocks[i];
+    IrInstruction *branch = ir_terminator(block);
+    if (branch->opcode != IR_OPCODE_BRANCH || resolve_ir_value(branch->operands[0])->opcode != IR_OPCODE_CONSTANT) {
+      continue;
+    }
+    bool is_taken = resolve_ir_value(branch->operands[0])->value != 0;
+    IrBlock *target = branch->targets[is_taken ? 0 : 1];
+    IrBlock *skipped = branch->targets[is_taken ? 1 : 0];
+    remove_edge(block, skipped);
+    branch->opcode = IR_OPCODE_JUMP;
+    branch->operands_count = 0;
+    branch->targets[0] = target;
+    branch->targets[1] = NULL;
+    changed = true;
+  }
+
+  compute_dominators(function);
+  int count = 0;
+  for (int i = 0; i < function->blocks_count; i++) {
+    IrBlock *block = function->blocks[i];
+    if (block->order < 0) {
+      IrInstruction *terminator = ir_terminator(block);
+      for (int j = 0; j < ir_successors_count(block); j++) {
+        if (terminator->targets[j]->order >= 0) {
+          remove_edge(block, terminator->targets[j]);
+        }
+      }
+      changed = true;
+    } else {
+      function->blocks[count++] = block;
+    }
+  }
+  function->blocks_count = count;
+
+  live = calloc(function->values_count, sizeof(bool));
+  IrInstruction **worklist = calloc(function->values_count, sizeof(IrInstruction *));
+  int worklist_count = 0;
+  for (int i = 0; i < function->blocks_count; i++) {
+    IrBlock *block = function->blocks[i];
+    for (int j = 0; j < block->instructions_count; j++) {
+      if (has_ir_side_effects(block->instructions[j])) {
+        mark(block->instructions[j], worklist, &worklist_count);
+      }
+    }
+  }
+  while (worklist_count > 0) {
+    IrInstruction *instruction = worklist[--worklist_count];
+    for (int i = 0; i < instruction->operands_count; i++) {
+      mark(instruction->operands[i], worklist, &worklist_count);
+    }
+  }
+  for (int i = 0; i < function->blocks_count; i++) {
+    IrBlock *block = function->blocks[i];
+    int count_before = block->instructions_count;
+    remove_instructions(block, is_live);
+    if (block->instructions_count != count_before) {
+      changed = true;
+    }
+  }
+  free(worklist);
+  free(live);
+  return changed;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "ir.h" // IrFunction
+
+void optimize_ir(IrFunction *function);
+bool propagate_ir_copies(IrFunction *function);
+bool number_ir_values(IrFunction *function);
+bool eliminate_dead_ir_code(IrFunction *function);
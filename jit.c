@@ -0,0 +1,100 @@
+#define _GNU_SOURCE // MAP_ANONYMOUS, RTLD_DEFAULT
+
+#include "jit.h"
+#include <dlfcn.h>    // dlsym
+#include <stdint.h>   // INT32_MAX, INT32_MIN, intptr_t, uint64_t
+#include <stdio.h>    // fprintf
+#include <stdlib.h>   // calloc, exit, free
+#include <string.h>   // memcpy
+#include <sys/mman.h> // mmap, mprotect, munmap
+#include <unistd.h>   // sysconf
+
+// jmp QWORD PTR [rip+0] followed by the absolute address, padded to 16 bytes.
+#define STUB_SIZE 16
+
+static size_t align_to(size_t size, size_t unit) {
+  return (size + unit - 1) / unit * unit;
+}
+
+static void *resolve_external_symbol(Symbol *symbol) {
+  char *name = calloc(symbol->name_length + 1, 1);
+  memcpy(name, symbol->name, symbol->name_length);
+  void *address = dlsym(RTLD_DEFAULT, name);
+  free(name);
+  if (address == NULL) {
+    fprintf(stderr, "Undefined symbol: %.*s\n", symbol->name_length, symbol->name);
+    exit(1);
+  }
+  return address;
+}
+
+// Loads object into executable memory, calls its main, and returns what main returns.
+// The text is followed by a stub for each undefined symbol, so that calls into the host process,
+// which may be mapped far beyond the reach of rel32, go through an absolute jump. .bss follows on its own pages.
+int run_object_file(ObjectFile *object) {
+  int main_index = find_object_symbol(object, find_symbol(intern("main", 4)));
+  if (object->symbols[main_index].section != OBJECT_SECTION_TEXT) {
+    fprintf(stderr, "main is not defined.\n");
+    exit(1);
+  }
+
+  int undefined_symbols_count = 0;
+  for (int i = 0; i < object->symbols_count; i++) {
+    undefined_symbols_count += object->symbols[i].section == OBJECT_SECTION_UNDEFINED;
+  }
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t stubs_offset = align_to(object->text_length, STUB_SIZE);
+  size_t code_size = align_to(stubs_offset + STUB_SIZE * undefined_symbols_count, page_size);
+  size_t size = code_size + align_to(object->bss_size, page_size);
+  unsigned char *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "Failed to map memory.\n");
+    exit(1);
+  }
+  memcpy(base, object->text, object->text_length);
+
+  unsigned char **addresses = calloc(object->symbols_count, sizeof(unsigned char *));
+  unsigned char *stub = base + stubs_offset;
+  for (int i = 0; i < object->symbols_count; i++) {
+    ObjectSymbol *symbol = &object->symbols[i];
+    switch (symbol->section) {
+    case OBJECT_SECTION_TEXT:
+      addresses[i] = base + symbol->offset;
+      break;
+    case OBJECT_SECTION_BSS:
+      addresses[i] = base + code_size + symbol->offset;
+      break;
+    case OBJECT_SECTION_UNDEFINED: {
+      uint64_t target = (uint64_t)(intptr_t)resolve_external_symbol(symbol->symbol);
+      unsigned char jump[6] = {0xff, 0x25, 0, 0, 0, 0};
+      memcpy(stub, jump, sizeof(jump));
+      memcpy(stub + sizeof(jump), &target, sizeof(target));
+      addresses[i] = stub;
+      stub += STUB_SIZE;
+      break;
+    }
+    }
+  }
+
+  for (int i = 0; i < object->relocations_count; i++) {
+    Relocation *relocation = &object->relocations[i];
+    intptr_t value = (intptr_t)addresses[relocation->symbol_index] + relocation->addend - (intptr_t)(base + relocation->offset);
+    if (value < INT32_MIN || value > INT32_MAX) {
+      fprintf(stderr, "Relocation out of range.\n");
+      exit(1);
+    }
+    int32_t field = value;
+    memcpy(base + relocation->offset, &field, sizeof(field));
+  }
+
+  if (mprotect(base, code_size, PROT_READ | PROT_EXEC) != 0) {
+    fprintf(stderr, "Failed to make code executable.\n");
+    exit(1);
+  }
+
+  long (*main_function)(void) = (long (*)(void))addresses[main_index];
+  int status = main_function();
+  munmap(base, size);
+  free(addresses);
+  return status;
+}
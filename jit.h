@@ -0,0 +1,5 @@
+#pragma once
+
+#include "object.h" // ObjectFile
+
+int run_object_file(ObjectFile *object);
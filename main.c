@@ -1,15 +1,172 @@
-#include "code_generator.h" // generator
-#include "parser.h"         // parse
+#include "arena.h"          // new_arena, reset_arena, free_arena, print_arena_statistics
+#include "bytecode.h"       // compile_bytecode, free_bytecode
+#include "code_generator.h" // generate, generator_jobs, generator_uses_ssa, generator_dumps_ir, begin_generation, generate_definition
+#include "jit.h"            // run_object_file
+#include "object.h"         // new_object_file, write_object_file, free_object_file
+#include "optimizer.h"      // optimize
+#include "output.h"         // new_output, flush_output, free_output
+#include "parser.h"         // parse, parser_jobs, begin_parse, parse_definition, end_parse
+#include "peephole.h"       // print_peephole_statistics
+#include "pipeline.h"       // compile_pipelined
+#include "source.h"         // new_source, read_source, free_source
+#include "vm.h"             // run_vm_program
+#include <fcntl.h>          // open
+#include <stdbool.h>        // bool
 #include <stdio.h>          // fprintf
-#include <stdlib.h>         // exit
+#include <stdlib.h>         // atoi, exit
+#include <string.h>         // strcmp
+#include <unistd.h>         // close
+
+// Parses, optimizes and generates one top-level definition at a time.
+// Only global declarations are kept in arena, so memory use depends on the largest definition instead of the program.
+void compile_definitions(Arena *arena, Source *source) {
+  Arena *definition_arena = new_arena();
+  begin_parse(arena, source);
+  begin_generation();
+  Node *definition;
+  while ((definition = parse_definition(definition_arena)) != NULL) {
+    optimize(definition);
+    generate_definition(definition);
+    reset_arena(definition_arena);
+  }
+  end_parse();
+  free_arena(definition_arena);
+}
+
+void usage(void) {
+  fprintf(stderr, "Usage: r7cc [--arena-stats] [--peephole-stats] [--ssa [--dump-ir]] [-c | --run | --vm] [-j <jobs> | --stream | --pipeline] [-o <path>] [<program> | -f <path>]\n");
+  fprintf(stderr, "  --ssa optimizes each function in SSA form before selecting its instructions, and --dump-ir prints that form.\n");
+  fprintf(stderr, "  -c writes an ELF object file instead of assembly.\n");
+  fprintf(stderr, "  --run compiles the program into memory and runs it, exiting with the status main returns.\n");
+  fprintf(stderr, "  -j parses and generates functions on <jobs> threads, one per processor by default.\n");
+  fprintf(stderr, "  --stream compiles one top-level definition at a time, releasing each before reading the next.\n");
+  fprintf(stderr, "  --pipeline is --stream with tokenizing, parsing and code generation running concurrently.\n");
+  fprintf(stderr, "  --vm compiles the program into bytecode and interprets it, without generating machine code.\n");
+  fprintf(stderr, "  The program is read from stdin when neither <program> nor -f is given, or <path> is -.\n");
+  exit(1);
+}
 
 int main(int argc, char **argv) {
-  if (argc != 2) {
-    fprintf(stderr, "Expected arguments count is 2, got %i\n", argc);
-    exit(1);
+  bool arena_stats = false;
+  bool peephole_stats = false;
+  bool object = false;
+  bool run = false;
+  bool vm = false;
+  bool stream = false;
+  bool pipeline = false;
+  char *input = NULL;
+  char *input_path = NULL;
+  char *output_path = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--arena-stats")) {
+      arena_stats = true;
+    } else if (!strcmp(argv[i], "--peephole-stats")) {
+      peephole_stats = true;
+    } else if (!strcmp(argv[i], "--ssa")) {
+      generator_uses_ssa = true;
+    } else if (!strcmp(argv[i], "--dump-ir")) {
+      generator_dumps_ir = true;
+    } else if (!strcmp(argv[i], "-c")) {
+      object = true;
+    } else if (!strcmp(argv[i], "--run")) {
+      run = true;
+    } else if (!strcmp(argv[i], "--vm")) {
+      vm = true;
+    } else if (!strcmp(argv[i], "--stream")) {
+      stream = true;
+    } else if (!strcmp(argv[i], "--pipeline")) {
+      pipeline = true;
+    } else if (!strcmp(argv[i], "-j")) {
+      if (i + 1 == argc) {
+        usage();
+      }
+      parser_jobs = generator_jobs = atoi(argv[++i]);
+      if (generator_jobs <= 0) {
+        usage();
+      }
+    } else if (!strcmp(argv[i], "-o")) {
+      if (i + 1 == argc) {
+        usage();
+      }
+      output_path = argv[++i];
+    } else if (!strcmp(argv[i], "-f")) {
+      if (i + 1 == argc || input != NULL || input_path != NULL) {
+        usage();
+      }
+      input_path = argv[++i];
+    } else if (input == NULL && input_path == NULL) {
+      input = argv[i];
+    } else {
+      usage();
+    }
+  }
+  if (((stream || pipeline || generator_uses_ssa) && vm) || (generator_dumps_ir && !generator_uses_ssa)) {
+    usage();
+  }
+  if (stream + pipeline + (generator_jobs > 0) > 1) {
+    usage();
   }
 
-  generate(parse(argv[1]));
+  Source *source;
+  if (input != NULL) {
+    source = new_source(input);
+  } else {
+    source = read_source(input_path == NULL ? "-" : input_path);
+  }
+
+  int fd = 1;
+  if (output_path != NULL) {
+    fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      fprintf(stderr, "Failed to open %s.\n", output_path);
+      exit(1);
+    }
+  }
+  output = new_output(fd);
+
+  Arena *arena = new_arena();
+  int status = 0;
+  if (vm) {
+    Node *program = parse(arena, source);
+    optimize(program);
+    VmProgram *bytecode = compile_bytecode(program);
+    status = run_vm_program(bytecode);
+    free_bytecode(bytecode);
+  } else {
+    if (object || run) {
+      object_file = new_object_file();
+    }
+    if (pipeline) {
+      compile_pipelined(arena, source);
+    } else if (stream) {
+      compile_definitions(arena, source);
+    } else {
+      Node *program = parse(arena, source);
+      optimize(program);
+      generate(program);
+    }
+    if (run) {
+      status = run_object_file(object_file);
+    } else if (object) {
+      write_object_file(object_file, output);
+    }
+    if (object_file) {
+      free_object_file(object_file);
+    }
+  }
+  flush_output(output);
+  free_output(output);
+  if (fd != 1) {
+    close(fd);
+  }
+  if (arena_stats) {
+    print_arena_statistics(stderr, arena);
+  }
+  if (peephole_stats) {
+    print_peephole_statistics(stderr);
+  }
+  free_arena(arena);
+  free_source(source);
 
-  return 0;
+  return status;
 }
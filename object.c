@@ -0,0 +1,228 @@
+#include "object.h"
+#include "encoder.h" // encode_instructions
+#include <elf.h>     // Elf64_Ehdr, Elf64_Rela, Elf64_Shdr, Elf64_Sym
+#include <stdbool.h> // bool
+#include <stdlib.h>  // calloc, free, realloc
+#include <string.h>  // memcpy, memset
+
+#define TEXT_ALIGNMENT 16
+#define BSS_ALIGNMENT 16
+
+ObjectFile *object_file;
+
+typedef enum {
+  SECTION_INDEX_NULL,
+  SECTION_INDEX_TEXT,
+  SECTION_INDEX_BSS,
+  SECTION_INDEX_RELA_TEXT,
+  SECTION_INDEX_SYMTAB,
+  SECTION_INDEX_STRTAB,
+  SECTION_INDEX_SHSTRTAB,
+  SECTION_INDEX_NOTE_GNU_STACK,
+  SECTIONS_COUNT,
+} SectionIndex;
+
+static char section_names[] = "\0.text\0.bss\0.rela.text\0.symtab\0.strtab\0.shstrtab\0.note.GNU-stack";
+
+ObjectFile *new_object_file(void) {
+  return calloc(1, sizeof(ObjectFile));
+}
+
+void free_object_file(ObjectFile *object) {
+  free(object->text);
+  free(object->symbols);
+  free(object->symbol_indices);
+  free(object->relocations);
+  free(object);
+}
+
+// Returns the index of symbol in object, adding it as undefined on first use.
+int find_object_symbol(ObjectFile *object, Symbol *symbol) {
+  if (symbol->id >= object->symbol_indices_capacity) {
+    int capacity = object->symbol_indices_capacity == 0 ? 256 : object->symbol_indices_capacity;
+    while (symbol->id >= capacity) {
+      capacity *= 2;
+    }
+    object->symbol_indices = realloc(object->symbol_indices, sizeof(int) * capacity);
+    memset(object->symbol_indices + object->symbol_indices_capacity, 0, sizeof(int) * (capacity - object->symbol_indices_capacity));
+    object->symbol_indices_capacity = capacity;
+  }
+  if (object->symbol_indices[symbol->id]) {
+    return object->symbol_indices[symbol->id] - 1;
+  }
+  if (object->symbols_count == object->symbols_capacity) {
+    object->symbols_capacity = object->symbols_capacity == 0 ? 64 : object->symbols_capacity * 2;
+    object->symbols = realloc(object->symbols, sizeof(ObjectSymbol) * object->symbols_capacity);
+  }
+  object->symbols[object->symbols_count] = (ObjectSymbol){.symbol = symbol, .section = OBJECT_SECTION_UNDEFINED};
+  object->symbol_indices[symbol->id] = ++object->symbols_count;
+  return object->symbols_count - 1;
+}
+
+void append_text(ObjectFile *object, void *data, size_t length) {
+  if (object->text_length + length > object->text_capacity) {
+    object->text_capacity = object->text_capacity == 0 ? 4096 : object->text_capacity;
+    while (object->text_length + length > object->text_capacity) {
+      object->text_capacity *= 2;
+    }
+    object->text = realloc(object->text, object->text_capacity);
+  }
+  memcpy(object->text + object->text_length, data, length);
+  object->text_length += length;
+}
+
+// Adds a relocation for the 32-bit field at the end of the text.
+void add_relocation(ObjectFile *object, Symbol *symbol, RelocationKind kind, int addend) {
+  if (object->relocations_count == object->relocations_capacity) {
+    object->relocations_capacity = object->relocations_capacity == 0 ? 256 : object->relocations_capacity * 2;
+    object->relocations = realloc(object->relocations, sizeof(Relocation) * object->relocations_capacity);
+  }
+  object->relocations[object->relocations_count++] = (Relocation){object->text_length, find_object_symbol(object, symbol), kind, addend};
+}
+
+void define_object_function(ObjectFile *object, Symbol *symbol, InstructionList *list) {
+  while (object->text_length % TEXT_ALIGNMENT) {
+    unsigned char int3 = 0xcc;
+    append_text(object, &int3, 1);
+  }
+  // Symbols may move while encoding adds the callees, so the symbol is referred to by index.
+  int index = find_object_symbol(object, symbol);
+  size_t offset = object->text_length;
+  encode_instructions(object, list);
+  object->symbols[index].section = OBJECT_SECTION_TEXT;
+  object->symbols[index].offset = offset;
+  object->symbols[index].size = object->text_length - offset;
+}
+
+void define_object_variable(ObjectFile *object, Symbol *symbol, int size) {
+  int index = find_object_symbol(object, symbol);
+  ObjectSymbol *object_symbol = &object->symbols[index];
+  object->bss_size = (object->bss_size + BSS_ALIGNMENT - 1) & ~(size_t)(BSS_ALIGNMENT - 1);
+  object_symbol->section = OBJECT_SECTION_BSS;
+  object_symbol->offset = object->bss_size;
+  object_symbol->size = size;
+  object->bss_size += size;
+}
+
+static void write_padding(Output *output_, size_t *offset, size_t alignment) {
+  static char zeros[16];
+  size_t padding = (alignment - *offset % alignment) % alignment;
+  write_output(output_, zeros, padding);
+  *offset += padding;
+}
+
+// Writes a relocatable ELF64 object for x86-64.
+// Variables are local symbols and functions are global, as in the assembly output.
+// Local symbols must come first in .symtab, so symbols are renumbered with variables ahead of functions.
+void write_object_file(ObjectFile *object, Output *output_) {
+  int *symbol_numbers = calloc(object->symbols_count, sizeof(int));
+  Elf64_Sym *symbols = calloc(object->symbols_count + 1, sizeof(Elf64_Sym));
+  size_t string_table_size = 1;
+  for (int i = 0; i < object->symbols_count; i++) {
+    string_table_size += object->symbols[i].symbol->name_length + 1;
+  }
+  char *string_table = calloc(string_table_size, 1);
+
+  int symbols_count = 1;
+  size_t string_table_length = 1;
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < object->symbols_count; i++) {
+      ObjectSymbol *object_symbol = &object->symbols[i];
+      bool is_local = object_symbol->section == OBJECT_SECTION_BSS;
+      if (is_local != (pass == 0)) {
+        continue;
+      }
+      Elf64_Sym *symbol = &symbols[symbols_count];
+      symbol->st_name = string_table_length;
+      memcpy(string_table + string_table_length, object_symbol->symbol->name, object_symbol->symbol->name_length);
+      string_table_length += object_symbol->symbol->name_length + 1;
+      switch (object_symbol->section) {
+      case OBJECT_SECTION_BSS:
+        symbol->st_info = ELF64_ST_INFO(STB_LOCAL, STT_OBJECT);
+        symbol->st_shndx = SECTION_INDEX_BSS;
+        break;
+      case OBJECT_SECTION_TEXT:
+        symbol->st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+        symbol->st_shndx = SECTION_INDEX_TEXT;
+        break;
+      case OBJECT_SECTION_UNDEFINED:
+        symbol->st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE);
+        symbol->st_shndx = SHN_UNDEF;
+        break;
+      }
+      symbol->st_value = object_symbol->offset;
+      symbol->st_size = object_symbol->size;
+      symbol_numbers[i] = symbols_count++;
+    }
+  }
+  int first_global_symbol = 1;
+  while (first_global_symbol < symbols_count && ELF64_ST_BIND(symbols[first_global_symbol].st_info) == STB_LOCAL) {
+    first_global_symbol++;
+  }
+
+  Elf64_Rela *relocations = calloc(object->relocations_count, sizeof(Elf64_Rela));
+  for (int i = 0; i < object->relocations_count; i++) {
+    Relocation *relocation = &object->relocations[i];
+    int type = relocation->kind == RELOCATION_KIND_CALL ? R_X86_64_PLT32 : R_X86_64_PC32;
+    relocations[i].r_offset = relocation->offset;
+    relocations[i].r_info = ELF64_R_INFO(symbol_numbers[relocation->symbol_index], type);
+    relocations[i].r_addend = relocation->addend;
+  }
+
+  Elf64_Shdr sections[SECTIONS_COUNT] = {0};
+  size_t offset = sizeof(Elf64_Ehdr);
+  sections[SECTION_INDEX_TEXT] = (Elf64_Shdr){.sh_name = 1, .sh_type = SHT_PROGBITS, .sh_flags = SHF_ALLOC | SHF_EXECINSTR, .sh_size = object->text_length, .sh_addralign = TEXT_ALIGNMENT};
+  sections[SECTION_INDEX_BSS] = (Elf64_Shdr){.sh_name = 7, .sh_type = SHT_NOBITS, .sh_flags = SHF_ALLOC | SHF_WRITE, .sh_size = object->bss_size, .sh_addralign = BSS_ALIGNMENT};
+  sections[SECTION_INDEX_RELA_TEXT] = (Elf64_Shdr){.sh_name = 12, .sh_type = SHT_RELA, .sh_flags = SHF_INFO_LINK, .sh_size = sizeof(Elf64_Rela) * object->relocations_count, .sh_link = SECTION_INDEX_SYMTAB, .sh_info = SECTION_INDEX_TEXT, .sh_addralign = 8, .sh_entsize = sizeof(Elf64_Rela)};
+  sections[SECTION_INDEX_SYMTAB] = (Elf64_Shdr){.sh_name = 23, .sh_type = SHT_SYMTAB, .sh_size = sizeof(Elf64_Sym) * symbols_count, .sh_link = SECTION_INDEX_STRTAB, .sh_info = first_global_symbol, .sh_addralign = 8, .sh_entsize = sizeof(Elf64_Sym)};
+  sections[SECTION_INDEX_STRTAB] = (Elf64_Shdr){.sh_name = 31, .sh_type = SHT_STRTAB, .sh_size = string_table_size, .sh_addralign = 1};
+  sections[SECTION_INDEX_SHSTRTAB] = (Elf64_Shdr){.sh_name = 39, .sh_type = SHT_STRTAB, .sh_size = sizeof(section_names), .sh_addralign = 1};
+  sections[SECTION_INDEX_NOTE_GNU_STACK] = (Elf64_Shdr){.sh_name = 49, .sh_type = SHT_PROGBITS, .sh_addralign = 1};
+  for (int i = 1; i < SECTIONS_COUNT; i++) {
+    if (sections[i].sh_type == SHT_NOBITS) {
+      continue;
+    }
+    offset = (offset + sections[i].sh_addralign - 1) & ~(sections[i].sh_addralign - 1);
+    sections[i].sh_offset = offset;
+    offset += sections[i].sh_size;
+  }
+  size_t section_headers_offset = (offset + 7) & ~(size_t)7;
+
+  Elf64_Ehdr header = {
+      .e_ident = {ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3, ELFCLASS64, ELFDATA2LSB, EV_CURRENT, ELFOSABI_SYSV},
+      .e_type = ET_REL,
+      .e_machine = EM_X86_64,
+      .e_version = EV_CURRENT,
+      .e_shoff = section_headers_offset,
+      .e_ehsize = sizeof(Elf64_Ehdr),
+      .e_shentsize = sizeof(Elf64_Shdr),
+      .e_shnum = SECTIONS_COUNT,
+      .e_shstrndx = SECTION_INDEX_SHSTRTAB,
+  };
+  void *contents[SECTIONS_COUNT] = {
+      [SECTION_INDEX_TEXT] = object->text,
+      [SECTION_INDEX_RELA_TEXT] = relocations,
+      [SECTION_INDEX_SYMTAB] = symbols,
+      [SECTION_INDEX_STRTAB] = string_table,
+      [SECTION_INDEX_SHSTRTAB] = section_names,
+  };
+
+  offset = 0;
+  write_output(output_, (char *)&header, sizeof(header));
+  offset += sizeof(header);
+  for (int i = 1; i < SECTIONS_COUNT; i++) {
+    if (sections[i].sh_type == SHT_NOBITS || sections[i].sh_size == 0) {
+      continue;
+    }
+    write_padding(output_, &offset, sections[i].sh_addralign);
+    write_output(output_, contents[i], sections[i].sh_size);
+    offset += sections[i].sh_size;
+  }
+  write_padding(output_, &offset, 8);
+  write_output(output_, (char *)sections, sizeof(sections));
+
+  free(relocations);
+  free(string_table);
+  free(symbols);
+  free(symbol_numbers);
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "instruction.h" // InstructionList
+#include "output.h"      // Output
+#include "symbol.h"      // Symbol
+#include <stddef.h>      // size_t
+
+typedef enum {
+  OBJECT_SECTION_UNDEFINED,
+  OBJECT_SECTION_TEXT,
+  OBJECT_SECTION_BSS,
+} ObjectSection;
+
+typedef struct ObjectSymbol ObjectSymbol;
+
+struct ObjectSymbol {
+  Symbol *symbol;
+  ObjectSection section;
+  size_t offset;
+  size_t size;
+};
+
+typedef enum {
+  // rel32 of call, resolved through the PLT for functions defined elsewhere.
+  RELOCATION_KIND_CALL,
+
+  // disp32 of a RIP-relative memory operand.
+  RELOCATION_KIND_PC_RELATIVE,
+} RelocationKind;
+
+typedef struct Relocation Relocation;
+
+// 32-bit field at offset in text, to be filled with the address of the symbol + addend - the address of the field.
+struct Relocation {
+  size_t offset;
+  int symbol_index;
+  RelocationKind kind;
+  int addend;
+};
+
+typedef struct ObjectFile ObjectFile;
+
+// Machine code and symbols of a program, written as a relocatable ELF64 object.
+// Global variables are zero-initialized, so they are only reserved in .bss.
+struct ObjectFile {
+  unsigned char *text;
+  size_t text_length;
+  size_t text_capacity;
+  size_t bss_size;
+
+  ObjectSymbol *symbols;
+  int symbols_count;
+  int symbols_capacity;
+
+  // Index + 1 into symbols, indexed by the ID of Symbol.
+  int *symbol_indices;
+  int symbol_indices_capacity;
+
+  Relocation *relocations;
+  int relocations_count;
+  int relocations_capacity;
+};
+
+// Object file the code generator encodes into, or NULL to emit assembly.
+extern ObjectFile *object_file;
+
+ObjectFile *new_object_file(void);
+void free_object_file(ObjectFile *object);
+int find_object_symbol(ObjectFile *object, Symbol *symbol);
+void append_text(ObjectFile *object, void *data, size_t length);
+void add_relocation(ObjectFile *object, Symbol *symbol, RelocationKind kind, int addend);
+void define_object_function(ObjectFile *object, Symbol *symbol, InstructionList *list);
+void define_object_variable(ObjectFile *object, Symbol *symbol, int size);
+void write_object_file(ObjectFile *object, Output *output_);
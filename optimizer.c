@@ -0,0 +1,282 @@
+#include "optimizer.h"
+#include "frame.h"  // layout_frame
+#include <limits.h> // INT_MIN
+
+Node *fold(Node *node);
+
+bool is_number(Node *node, int value) {
+  return node->kind == NODE_KIND_NUMBER && node->value == value;
+}
+
+bool has_side_effects(Node *node) {
+  switch (node->kind) {
+  case NODE_KIND_ASSIGN:
+  case NODE_KIND_FUNCTION_CALL:
+    return true;
+  case NODE_KIND_ADDRESS:
+  case NODE_KIND_DEREFERENCE:
+    return has_side_effects(node->node);
+  case NODE_KIND_LOCAL_VARIABLE:
+  case NODE_KIND_NUMBER:
+    return false;
+  default:
+    return has_side_effects(node->binary.lhs) || has_side_effects(node->binary.rhs);
+  }
+}
+
+// Turns node into a number node in place, so that no allocation is needed.
+Node *become_number(Node *node, int value) {
+  node->kind = NODE_KIND_NUMBER;
+  node->type = int_type;
+  node->value = value;
+  return node;
+}
+
+// Evaluates a binary operation on two numbers. Returns false when it cannot be evaluated at compile time.
+bool evaluate(NodeKind kind, int lhs, int rhs, int *result) {
+  long value;
+  switch (kind) {
+  case NODE_KIND_ADD:
+    value = (long)lhs + rhs;
+    break;
+  case NODE_KIND_SUBTRACT:
+    value = (long)lhs - rhs;
+    break;
+  case NODE_KIND_MULTIPLY:
+    value = (long)lhs * rhs;
+    break;
+  case NODE_KIND_DIVIDE:
+    if (rhs == 0) {
+      return false;
+    }
+    value = (long)lhs / rhs;
+    break;
+  case NODE_KIND_EQ:
+    value = lhs == rhs;
+    break;
+  case NODE_KIND_NE:
+    value = lhs != rhs;
+    break;
+  case NODE_KIND_LT:
+    value = lhs < rhs;
+    break;
+  case NODE_KIND_LE:
+    value = lhs <= rhs;
+    break;
+  default:
+    return false;
+  }
+  // Results that do not fit in int are left to run time rather than folded with wraparound.
+  if (value < INT_MIN || value > INT_MAX) {
+    return false;
+  }
+  *result = value;
+  return true;
+}
+
+// Merges constant terms of nested additions and subtractions, like (x + 1) - 3 into x + -2.
+Node *reassociate(Node *node) {
+  Node *lhs = node->binary.lhs;
+  Node *rhs = node->binary.rhs;
+  if (node->kind != NODE_KIND_ADD && node->kind != NODE_KIND_SUBTRACT || rhs->kind != NODE_KIND_NUMBER) {
+    return node;
+  }
+  if (lhs->kind != NODE_KIND_ADD && lhs->kind != NODE_KIND_SUBTRACT || lhs->binary.rhs->kind != NODE_KIND_NUMBER) {
+    return node;
+  }
+  long inner = lhs->kind == NODE_KIND_ADD ? lhs->binary.rhs->value : -(long)lhs->binary.rhs->value;
+  long outer = node->kind == NODE_KIND_ADD ? rhs->value : -(long)rhs->value;
+  if (inner + outer < INT_MIN || inner + outer > INT_MAX) {
+    return node;
+  }
+  node->kind = NODE_KIND_ADD;
+  node->binary.lhs = lhs->binary.lhs;
+  node->binary.rhs = become_number(rhs, inner + outer);
+  return node;
+}
+
+// x + 0, 0 + x, x - 0, x * 1, 1 * x, x / 1, x * 0 and 0 * x
+Node *simplify_identity(Node *node) {
+  Node *lhs = node->binary.lhs;
+  Node *rhs = node->binary.rhs;
+  switch (node->kind) {
+  case NODE_KIND_ADD:
+    if (is_number(rhs, 0)) {
+      return lhs;
+    }
+    if (is_number(lhs, 0)) {
+      return rhs;
+    }
+    break;
+  case NODE_KIND_SUBTRACT:
+    if (is_number(rhs, 0)) {
+      return lhs;
+    }
+    break;
+  case NODE_KIND_MULTIPLY:
+    if (is_number(rhs, 1)) {
+      return lhs;
+    }
+    if (is_number(lhs, 1)) {
+      return rhs;
+    }
+    if (is_number(rhs, 0) && !has_side_effects(lhs) || is_number(lhs, 0) && !has_side_effects(rhs)) {
+      return become_number(node, 0);
+    }
+    break;
+  case NODE_KIND_DIVIDE:
+    if (is_number(rhs, 1)) {
+      return lhs;
+    }
+    break;
+  default:
+    break;
+  }
+  return node;
+}
+
+// p + 0 and p - 0, and merges constant offsets of nested pointer arithmetic, like (p + 1) + 2 into p + 3.
+Node *simplify_pointer_arithmetic(Node *node) {
+  Node *lhs = node->binary.lhs;
+  Node *rhs = node->binary.rhs;
+  if (rhs->kind != NODE_KIND_NUMBER) {
+    return node;
+  }
+  int offset = node->kind == NODE_KIND_ADD_POINTER ? rhs->value : -(unsigned int)rhs->value;
+  if (offset == 0) {
+    return lhs;
+  }
+  if ((lhs->kind == NODE_KIND_ADD_POINTER || lhs->kind == NODE_KIND_SUBTRACT_POINTER) && lhs->type == node->type && lhs->binary.rhs->kind == NODE_KIND_NUMBER) {
+    int inner_offset = lhs->kind == NODE_KIND_ADD_POINTER ? lhs->binary.rhs->value : -(unsigned int)lhs->binary.rhs->value;
+    node->kind = NODE_KIND_ADD_POINTER;
+    node->binary.lhs = lhs->binary.lhs;
+    node->binary.rhs = become_number(rhs, (unsigned int)offset + (unsigned int)inner_offset);
+    return simplify_pointer_arithmetic(node);
+  }
+  return node;
+}
+
+Node *fold_binary(Node *node) {
+  node->binary.lhs = fold(node->binary.lhs);
+  node->binary.rhs = fold(node->binary.rhs);
+  if (node->kind == NODE_KIND_ADD_POINTER || node->kind == NODE_KIND_SUBTRACT_POINTER) {
+    return simplify_pointer_arithmetic(node);
+  }
+  int value;
+  if (node->binary.lhs->kind == NODE_KIND_NUMBER && node->binary.rhs->kind == NODE_KIND_NUMBER && evaluate(node->kind, node->binary.lhs->value, node->binary.rhs->value, &value)) {
+    return become_number(node, value);
+  }
+  return simplify_identity(reassociate(node));
+}
+
+void fold_nodes(Nodes *nodes) {
+  for (; nodes != NULL; nodes = nodes->next) {
+    nodes->node = fold(nodes->node);
+  }
+}
+
+// Statements whose condition is constant are replaced with the branch to be taken.
+Node *fold_if(Node *node) {
+  Node *condition = node->if_statement.condition = fold(node->if_statement.condition);
+  node->if_statement.true_statement = fold(node->if_statement.true_statement);
+  node->if_statement.false_statement = fold(node->if_statement.false_statement);
+  if (condition->kind == NODE_KIND_NUMBER) {
+    return condition->value ? node->if_statement.true_statement : node->if_statement.false_statement;
+  }
+  return node;
+}
+
+Node *fold_while(Node *node) {
+  Node *condition = node->while_statement.condition = fold(node->while_statement.condition);
+  node->while_statement.statement = fold(node->while_statement.statement);
+  if (is_number(condition, 0)) {
+    return NULL;
+  }
+  return node;
+}
+
+Node *fold_for(Node *node) {
+  node->for_statement.initialization = fold(node->for_statement.initialization);
+  node->for_statement.condition = fold(node->for_statement.condition);
+  node->for_statement.afterthrough = fold(node->for_statement.afterthrough);
+  node->for_statement.statement = fold(node->for_statement.statement);
+  if (node->for_statement.condition && is_number(node->for_statement.condition, 0)) {
+    return node->for_statement.initialization;
+  }
+  return node;
+}
+
+// Returns the node to be used in place of node.
+Node *fold(Node *node) {
+  if (node == NULL) {
+    return NULL;
+  }
+
+  switch (node->kind) {
+  case NODE_KIND_ADDRESS:
+  case NODE_KIND_DEREFERENCE:
+    node->node = fold(node->node);
+    return node;
+  case NODE_KIND_ASSIGN:
+    node->binary.lhs = fold(node->binary.lhs);
+    node->binary.rhs = fold(node->binary.rhs);
+    return node;
+  case NODE_KIND_BLOCK:
+    fold_nodes(node->block.nodes);
+    return node;
+  case NODE_KIND_FOR:
+    return fold_for(node);
+  case NODE_KIND_FUNCTION_CALL:
+    fold_nodes(node->function_call.parameters);
+    return node;
+  case NODE_KIND_FUNCTION_DEFINITION:
+    node->function_definition.block = fold(node->function_definition.block);
+    return node;
+  case NODE_KIND_IF:
+    return fold_if(node);
+  case NODE_KIND_PROGRAM:
+    fold_nodes(node->program.nodes);
+    return node;
+  case NODE_KIND_RETURN:
+    node->return_statement.expression = fold(node->return_statement.expression);
+    return node;
+  case NODE_KIND_WHILE:
+    return fold_while(node);
+  case NODE_KIND_ADD:
+  case NODE_KIND_ADD_POINTER:
+  case NODE_KIND_DIFF_POINTER:
+  case NODE_KIND_DIVIDE:
+  case NODE_KIND_EQ:
+  case NODE_KIND_LE:
+  case NODE_KIND_LT:
+  case NODE_KIND_MULTIPLY:
+  case NODE_KIND_NE:
+  case NODE_KIND_SUBTRACT:
+  case NODE_KIND_SUBTRACT_POINTER:
+    return fold_binary(node);
+  default:
+    return node;
+  }
+}
+
+void layout_frames(Node *node) {
+  switch (node->kind) {
+  case NODE_KIND_FUNCTION_DEFINITION:
+    layout_frame(node);
+    break;
+  case NODE_KIND_PROGRAM:
+    for (Nodes *nodes = node->program.nodes; nodes != NULL; nodes = nodes->next) {
+      layout_frames(nodes->node);
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+// Folds constant subtrees and simplifies algebraic identities of the program in place,
+// then lays out the frames of its functions, which folding may have left with fewer variables to hold.
+void optimize(Node *program) {
+  fold(program);
+  layout_frames(program);
+}
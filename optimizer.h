@@ -0,0 +1,5 @@
+#pragma once
+
+#include "parser.h" // Node
+
+void optimize(Node *program);
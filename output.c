@@ -0,0 +1,117 @@
+#define _POSIX_C_SOURCE 200809L // ssize_t
+
+#include "output.h"
+#include <stdarg.h> // va_list
+#include <stdio.h>  // fprintf
+#include <stdlib.h> // calloc, exit, free, malloc, realloc
+#include <string.h> // memcpy, strlen
+#include <unistd.h> // write
+
+#define OUTPUT_FLUSH_THRESHOLD (256 * 1024)
+
+// Output that emit appends into. Each thread has its own, so that threads can print functions in parallel.
+_Thread_local Output *output;
+
+Output *new_output(int fd) {
+  Output *output_ = calloc(1, sizeof(Output));
+  output_->capacity = OUTPUT_FLUSH_THRESHOLD;
+  output_->data = malloc(output_->capacity);
+  output_->fd = fd;
+  return output_;
+}
+
+void free_output(Output *output_) {
+  free(output_->data);
+  free(output_);
+}
+
+void flush_output(Output *output_) {
+  if (output_->fd < 0) {
+    return;
+  }
+  size_t written = 0;
+  while (written < output_->length) {
+    ssize_t result = write(output_->fd, output_->data + written, output_->length - written);
+    if (result < 0) {
+      fprintf(stderr, "Failed to write output.\n");
+      exit(1);
+    }
+    written += result;
+  }
+  output_->length = 0;
+}
+
+static void reserve_output(Output *output_, size_t length) {
+  if (output_->length + length <= output_->capacity) {
+    return;
+  }
+  if (output_->fd >= 0) {
+    flush_output(output_);
+  }
+  while (output_->length + length > output_->capacity) {
+    output_->capacity *= 2;
+  }
+  output_->data = realloc(output_->data, output_->capacity);
+}
+
+void write_output(Output *output_, char *data, size_t length) {
+  reserve_output(output_, length);
+  memcpy(output_->data + output_->length, data, length);
+  output_->length += length;
+}
+
+static void write_integer(Output *output_, int value) {
+  char buffer[16];
+  char *end = buffer + sizeof(buffer);
+  char *p = end;
+  unsigned int magnitude = value < 0 ? -(unsigned int)value : (unsigned int)value;
+  do {
+    *--p = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude);
+  if (value < 0) {
+    *--p = '-';
+  }
+  write_output(output_, p, end - p);
+}
+
+// Appends formatted text to output. Only %d, %i, %s and %.*s are supported.
+void emit(char *format, ...) {
+  va_list arguments;
+  va_start(arguments, format);
+  char *p = format;
+  while (*p) {
+    char *q = p;
+    while (*q && *q != '%') {
+      q++;
+    }
+    write_output(output, p, q - p);
+    if (*q == '\0') {
+      break;
+    }
+    switch (q[1]) {
+    case 'd':
+    case 'i':
+      write_integer(output, va_arg(arguments, int));
+      p = q + 2;
+      break;
+    case 's': {
+      char *string = va_arg(arguments, char *);
+      write_output(output, string, strlen(string));
+      p = q + 2;
+      break;
+    }
+    case '.': {
+      int length = va_arg(arguments, int);
+      char *string = va_arg(arguments, char *);
+      write_output(output, string, length);
+      p = q + 4;
+      break;
+    }
+    default:
+      fprintf(stderr, "Unsupported format: %s\n", format);
+      exit(1);
+    }
+  }
+  va_end(arguments);
+}
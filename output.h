@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h> // size_t
+
+typedef struct Output Output;
+
+// Growable text buffer, flushed to fd in large blocks.
+struct Output {
+  char *data;
+  size_t length;
+  size_t capacity;
+
+  // File descriptor to flush into, or -1 to keep everything in memory.
+  int fd;
+};
+
+extern _Thread_local Output *output;
+
+Output *new_output(int fd);
+void free_output(Output *output);
+void write_output(Output *output, char *data, size_t length);
+void flush_output(Output *output);
+void emit(char *format, ...);
@@ -1,99 +1,235 @@
+#define _POSIX_C_SOURCE 200809L // sysconf
+
 #include "parser.h"
 #include "tokenizer.h"
+#include <limits.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <string.h>
+#include <unistd.h>
 
 Node *statement();
 Node *statement_block();
 Node *expression();
 
-Token *token;
-char *begin;
-Scope *scope;
+typedef struct PendingFunction PendingFunction;
+
+// Function definition whose declaration is recorded, but whose parameters and body are yet to be parsed.
+struct PendingFunction {
+  Node *node;
+
+  // Index of the "(" token of the parameters.
+  int token_index;
+
+  // Diagnostic of the first error in the function, or NULL.
+  char *error;
+  size_t error_length;
+};
+
+int parser_jobs;
+
+// Tokens read by begin_parse from its source.
+static TokenStream *source_tokens;
+
+// Shared by every thread, and only read while function bodies are parsed.
+TokenStream *token_stream;
+Source *source;
+Scope *global_scope;
+
+// Arena of what outlives a definition: the global scope, its variables and the interned types.
+Arena *global_arena;
+
+// Whether every declaration of the program is known before function bodies are parsed, which is not the case
+// when definitions are parsed one at a time.
+static bool parses_whole_program;
+
+// State of the parsing thread. Each thread parses into its own arena and scopes.
+_Thread_local Arena *arena;
+_Thread_local int token_index;
+_Thread_local Scope *scope;
+
+// Functions recorded by the first pass, taken by parsing threads in turn.
+static PendingFunction *pending_functions;
+static int pending_functions_count;
+static int pending_functions_capacity;
+static atomic_int next_pending_function;
+
+// Index of the earliest pending function known to have an error. Later functions need not be parsed.
+static atomic_int first_failed_function;
+
+// Function whose body the thread is parsing. Its first error is recorded on it, and the thread jumps to
+// error_handler, so that the error of the earliest function is reported whichever thread finds it first.
+static _Thread_local PendingFunction *current_function;
+static _Thread_local jmp_buf error_handler;
+
+static FILE *begin_error(void) {
+  if (current_function == NULL) {
+    return stderr;
+  }
+  return open_memstream(&current_function->error, &current_function->error_length);
+}
+
+static _Noreturn void end_error(FILE *file) {
+  if (current_function == NULL) {
+    exit(1);
+  }
+  fclose(file);
+  longjmp(error_handler, 1);
+}
+
+_Noreturn void error(char *position, char *message) {
+  FILE *file = begin_error();
+  print_error_at(file, source, position, message);
+  end_error(file);
+}
+
+// Reports an error without a position, formatted like printf.
+_Noreturn void parse_error(char *format, ...) {
+  FILE *file = begin_error();
+  va_list arguments;
+  va_start(arguments, format);
+  vfprintf(file, format, arguments);
+  va_end(arguments);
+  end_error(file);
+}
+
+Token *current_token(void) {
+  return &token_stream->tokens[token_index];
+}
 
-void error(char *position, char *message) {
-  int index = position - begin;
-  fprintf(stderr, "%s\n", begin);
-  fprintf(stderr, "%*s^ %s\n", index, "", message);
-  exit(1);
+char *token_string(Token *token) {
+  return source->text + token->offset;
 }
 
 bool at_type(void) {
-  return token->kind == TOKEN_KIND_INTEGER || token->kind == TOKEN_KIND_CHAR;
+  TokenKind kind = current_token()->kind;
+  return kind == TOKEN_KIND_INTEGER || kind == TOKEN_KIND_CHAR;
 }
 
 Token *consume(TokenKind kind) {
-  Token *token_;
+  Token *token = current_token();
   if (token->kind == kind) {
-    token_ = token;
-    token = token->next;
-    return token_;
+    token_index++;
+    return token;
   }
   return NULL;
 }
 
 Token *expect(TokenKind kind) {
+  Token *token = current_token();
   if (token->kind != kind) {
-    error(token->string, "Unexpected token kind.");
+    error(token_string(token), "Unexpected token kind.");
   }
-  Token *token_ = token;
-  token = token->next;
-  return token_;
+  token_index++;
+  return token;
+}
+
+Symbol *expect_identifier(void) {
+  return find_symbol(expect(TOKEN_KIND_IDENTIFIER)->value);
 }
 
 int expect_number(void) {
+  Token *token = current_token();
   if (token->kind != TOKEN_KIND_NUMBER) {
-    error(token->string, "Expected number token.");
+    error(token_string(token), "Expected number token.");
   }
-  int value = token->value;
-  token = token->next;
-  return value;
+  token_index++;
+  return token->value;
 }
 
-LocalVariable *new_local_variable(Type *type, char *name, int name_length, LocalVariable *next) {
-  LocalVariable *local_variable = calloc(1, sizeof(LocalVariable));
+LocalVariable *new_local_variable(Type *type, Symbol *symbol, LocalVariable *next) {
+  LocalVariable *local_variable = arena_allocate(arena, sizeof(LocalVariable), ARENA_OBJECT_KIND_LOCAL_VARIABLE);
   local_variable->type = type;
-  local_variable->name = name;
-  local_variable->name_length = name_length;
-  local_variable->offset = (next == NULL ? 0 : next->offset) + type->size;
+  local_variable->symbol = symbol;
+  // Variables are addressed downward from the end of their area, so the offset is rounded up to keep them aligned.
+  int offset = (next == NULL ? 0 : next->offset) + type->size;
+  local_variable->offset = (offset + type->alignment - 1) / type->alignment * type->alignment;
   local_variable->next = next;
   return local_variable;
 }
 
-LocalVariable *find_local_variable(Scope *scope, char *name, int name_length) {
-  for (LocalVariable *local_variable = scope->local_variable; local_variable; local_variable = local_variable->next) {
-    if (local_variable->name_length == name_length && !memcmp(local_variable->name, name, local_variable->name_length)) {
+LocalVariable *find_local_variable_in_scope(Scope *scope, Symbol *symbol) {
+  if (scope->table_capacity == 0) {
+    return NULL;
+  }
+  int mask = scope->table_capacity - 1;
+  for (int i = symbol->hash & mask;; i = (i + 1) & mask) {
+    LocalVariable *local_variable = scope->table[i];
+    if (local_variable == NULL || local_variable->symbol == symbol) {
       return local_variable;
     }
   }
-  if (scope->parent) {
-    return find_local_variable(scope->parent, name, name_length);
+}
+
+LocalVariable *find_local_variable(Scope *scope, Symbol *symbol) {
+  for (; scope != NULL; scope = scope->parent) {
+    LocalVariable *local_variable = find_local_variable_in_scope(scope, symbol);
+    if (local_variable != NULL) {
+      return local_variable;
+    }
   }
   return NULL;
 }
 
-LocalVariable *declare_local_variable(Type *type, char *name, int name_length) {
-  LocalVariable *local_variable = find_local_variable(scope, name, name_length);
-  if (local_variable != NULL) {
-    fprintf(stderr, "Local variable `%.*s` is already defined.\n", name_length, name);
-    exit(1);
+void insert_local_variable_into_table(LocalVariable **table, int capacity, LocalVariable *local_variable) {
+  int mask = capacity - 1;
+  int i = local_variable->symbol->hash & mask;
+  while (table[i] != NULL) {
+    i = (i + 1) & mask;
   }
+  table[i] = local_variable;
+}
 
-  local_variable = new_local_variable(type, name, name_length, scope->local_variable);
+// Keeps the load factor of the table of scope at most 1/2.
+void add_local_variable_to_scope(Scope *scope, LocalVariable *local_variable) {
+  if ((scope->local_variables_count + 1) * 2 > scope->table_capacity) {
+    int capacity = scope->table_capacity == 0 ? 8 : scope->table_capacity * 2;
+    LocalVariable **table = arena_allocate(arena, sizeof(LocalVariable *) * capacity, ARENA_OBJECT_KIND_SYMBOL_TABLE);
+    for (int i = 0; i < scope->table_capacity; i++) {
+      if (scope->table[i] != NULL) {
+        insert_local_variable_into_table(table, capacity, scope->table[i]);
+      }
+    }
+    scope->table = table;
+    scope->table_capacity = capacity;
+  }
+  insert_local_variable_into_table(scope->table, scope->table_capacity, local_variable);
+  scope->local_variables_count++;
   scope->local_variable = local_variable;
+}
+
+LocalVariable *declare_local_variable(Type *type, Symbol *symbol) {
+  LocalVariable *local_variable = find_local_variable(scope, symbol);
+  if (local_variable != NULL) {
+    parse_error("Local variable `%.*s` is already defined.\n", symbol->name_length, symbol->name);
+  }
+
+  local_variable = new_local_variable(type, symbol, scope->local_variable);
+  add_local_variable_to_scope(scope, local_variable);
+  return local_variable;
+}
+
+// Global declarations are kept for the whole compilation, even when the definition declaring them is released.
+LocalVariable *declare_global_variable(Type *type, Symbol *symbol) {
+  Arena *definition_arena = arena;
+  arena = global_arena;
+  LocalVariable *local_variable = declare_local_variable(type, symbol);
+  arena = definition_arena;
   return local_variable;
 }
 
 Scope *new_scope(Scope *parent) {
-  Scope *scope_ = calloc(1, sizeof(Scope));
+  Scope *scope_ = arena_allocate(arena, sizeof(Scope), ARENA_OBJECT_KIND_SCOPE);
   scope_->parent = parent;
   return scope_;
 }
 
 Node *new_node(NodeKind kind) {
-  Node *node = calloc(1, sizeof(Node));
+  Node *node = arena_allocate(arena, sizeof(Node), ARENA_OBJECT_KIND_NODE);
   node->kind = kind;
   return node;
 }
@@ -107,31 +243,29 @@ Node *new_binary_node(NodeKind kind, Node *lhs, Node *rhs) {
 }
 
 Node *new_add_node(Node *lhs, Node *rhs) {
-  if (lhs->type->kind == TYPE_KIND_INTEGER && rhs->type->kind == TYPE_KIND_INTEGER) {
+  if (lhs->type == int_type && rhs->type == int_type) {
     return new_binary_node(NODE_KIND_ADD, lhs, rhs);
   }
-  if (lhs->type->pointed_type && rhs->type->kind == TYPE_KIND_INTEGER) {
+  if (lhs->type->pointed_type && rhs->type == int_type) {
     return new_binary_node(NODE_KIND_ADD_POINTER, lhs, rhs);
   }
-  if (lhs->type->kind == TYPE_KIND_INTEGER && rhs->type->pointed_type) {
+  if (lhs->type == int_type && rhs->type->pointed_type) {
     return new_binary_node(NODE_KIND_ADD_POINTER, rhs, lhs);
   }
-  fprintf(stderr, "Unexpected operands on `+`.\n");
-  exit(1);
+  parse_error("Unexpected operands on `+`.\n");
 }
 
 Node *new_subtract_node(Node *lhs, Node *rhs) {
-  if (lhs->type->kind == TYPE_KIND_INTEGER && rhs->type->kind == TYPE_KIND_INTEGER) {
+  if (lhs->type == int_type && rhs->type == int_type) {
     return new_binary_node(NODE_KIND_SUBTRACT, lhs, rhs);
   }
-  if (lhs->type->pointed_type && rhs->type->kind == TYPE_KIND_INTEGER) {
+  if (lhs->type->pointed_type && rhs->type == int_type) {
     return new_binary_node(NODE_KIND_SUBTRACT_POINTER, lhs, rhs);
   }
-  if (lhs->type->pointed_type && rhs->type->pointed_type) {
+  if (lhs->type->pointed_type && lhs->type->pointed_type == rhs->type->pointed_type) {
     return new_binary_node(NODE_KIND_DIFF_POINTER, lhs, rhs);
   }
-  fprintf(stderr, "Unexpected operands on `-`.\n");
-  exit(1);
+  parse_error("Unexpected operands on `-`.\n");
 }
 
 Node *new_unary_node(NodeKind kind, Node *child) {
@@ -142,7 +276,7 @@ Node *new_unary_node(NodeKind kind, Node *child) {
 
 Node *new_address_node(Node *operand) {
   Node *node = new_unary_node(NODE_KIND_ADDRESS, operand);
-  node->type = new_pointer_type(operand->type);
+  node->type = new_pointer_type(global_arena, operand->type);
   return node;
 }
 
@@ -171,13 +305,13 @@ Node *new_local_variable_node(LocalVariable *local_variable) {
 }
 
 Nodes *new_nodes(void) {
-  return calloc(1, sizeof(Nodes));
+  return arena_allocate(arena, sizeof(Nodes), ARENA_OBJECT_KIND_NODES);
 }
 
 // type_postfix = ("[" number "]")*
 Type *type_postfix(Type *type) {
   while (consume(TOKEN_KIND_BRACKET_LEFT)) {
-    type = new_array_type(type, expect_number());
+    type = new_array_type(global_arena, type, expect_number());
     expect(TOKEN_KIND_BRACKET_RIGHT);
   }
   return type;
@@ -193,20 +327,20 @@ Type *base_type(void) {
   if (consume(TOKEN_KIND_INTEGER)) {
     return int_type;
   }
-  error(token->string, "Unexpected token.");
+  error(token_string(current_token()), "Unexpected token.");
 }
 
 // type = base_type "*"*
 Type *type_part(void) {
   Type *type = base_type();
   while (consume(TOKEN_KIND_ASTERISK)) {
-    type = new_pointer_type(type);
+    type = new_pointer_type(global_arena, type);
   }
   return type;
 }
 
 // function_call = identifier "(" (identifier ("," identifier)*)? ")"
-Node *function_call(Token *identifier) {
+Node *function_call(Symbol *symbol) {
   expect(TOKEN_KIND_PARENTHESIS_LEFT);
   Nodes *head = new_nodes();
   Nodes *nodes = head;
@@ -216,30 +350,35 @@ Node *function_call(Token *identifier) {
     nodes->node = expression();
   }
   Node *node = new_node(NODE_KIND_FUNCTION_CALL);
-  node->function_call.name = identifier->string;
-  node->function_call.name_length = identifier->length;
+  node->function_call.symbol = symbol;
   node->function_call.parameters = head->next;
-  node->type = find_local_variable(scope, identifier->string, identifier->length)->type;
+  // A function the program does not define is external and returns int, as if implicitly declared.
+  // The linker, or the host process when running in memory, provides it. Until the whole program has been seen,
+  // the callee may be defined later with another type, so it is an error instead.
+  LocalVariable *function = find_local_variable(scope, symbol);
+  if (function == NULL && !parses_whole_program) {
+    parse_error("Undefined function: %.*s\n", symbol->name_length, symbol->name);
+  }
+  node->type = function == NULL ? int_type : function->type;
   return node;
 }
 
 // local_variable = identifier
-Node *local_variable(Token *identifier) {
-  LocalVariable *local_variable = find_local_variable(scope, identifier->string, identifier->length);
+Node *local_variable(Symbol *symbol) {
+  LocalVariable *local_variable = find_local_variable(scope, symbol);
   if (local_variable == NULL) {
-    fprintf(stderr, "Undefined local variable: %.*s\n", identifier->length, identifier->string);
-    exit(1);
+    parse_error("Undefined local variable: %.*s\n", symbol->name_length, symbol->name);
   }
   return new_local_variable_node(local_variable);
 }
 
 // function_call_or_local_variable = function_call | local_variable
 Node *function_call_or_local_variable(void) {
-  Token *identifier = expect(TOKEN_KIND_IDENTIFIER);
-  if (token->kind == TOKEN_KIND_PARENTHESIS_LEFT) {
-    return function_call(identifier);
+  Symbol *symbol = expect_identifier();
+  if (current_token()->kind == TOKEN_KIND_PARENTHESIS_LEFT) {
+    return function_call(symbol);
   } else {
-    return local_variable(identifier);
+    return local_variable(symbol);
   }
 }
 
@@ -260,7 +399,7 @@ Node *number(void) {
 //         | function_call_or_local_variable
 //         | number
 Node *primary(void) {
-  switch (token->kind) {
+  switch (current_token()->kind) {
   case TOKEN_KIND_PARENTHESIS_LEFT:
     return expression_in_parentheses();
   case TOKEN_KIND_IDENTIFIER: {
@@ -290,21 +429,21 @@ Node *postfix(void) {
 //       | "*" unary
 //       | "&" unary
 Node *unary(void) {
-  switch (token->kind) {
+  switch (current_token()->kind) {
   case TOKEN_KIND_SIZEOF:
-    token = token->next;
+    token_index++;
     return new_sizeof_node(unary());
   case TOKEN_KIND_AMPERSAND:
-    token = token->next;
+    token_index++;
     return new_address_node(unary());
   case TOKEN_KIND_ASTERISK:
-    token = token->next;
+    token_index++;
     return new_dereference_node(unary());
   case TOKEN_KIND_MINUS:
-    token = token->next;
+    token_index++;
     return new_binary_node(NODE_KIND_SUBTRACT, new_number_node(0), primary());
   case TOKEN_KIND_PLUS:
-    token = token->next;
+    token_index++;
   default:
     return postfix();
   }
@@ -379,8 +518,7 @@ Node *assign(void) {
   Node *node = equality();
   if (consume(TOKEN_KIND_ASSIGN)) {
     if (node->kind != NODE_KIND_LOCAL_VARIABLE && node->kind != NODE_KIND_DEREFERENCE) {
-      fprintf(stderr, "Left value in assignment must be a local variable.");
-      exit(1);
+      parse_error("Left value in assignment must be a local variable.");
     }
     node = new_binary_node(NODE_KIND_ASSIGN, node, assign());
   }
@@ -395,9 +533,9 @@ Node *expression(void) {
 // statement_local_variable_declaration = type identifier ("[" number "]")* ("=" expression)? ";"
 Node *statement_local_variable_declaration(void) {
   Type *type = type_part();
-  Token *identifier = expect(TOKEN_KIND_IDENTIFIER);
+  Symbol *symbol = expect_identifier();
   type = type_postfix(type);
-  LocalVariable *local_variable = declare_local_variable(type, identifier->string, identifier->length);
+  LocalVariable *local_variable = declare_local_variable(type, symbol);
 
   Node *node;
   if (consume(TOKEN_KIND_ASSIGN)) {
@@ -498,7 +636,7 @@ Node *statement_while(void) {
 //   | statement_local_variable_declaration
 //   | statement_expression
 Node *statement(void) {
-  switch (token->kind) {
+  switch (current_token()->kind) {
   case TOKEN_KIND_RETURN:
     return statement_return();
   case TOKEN_KIND_FOR:
@@ -537,39 +675,135 @@ Node *statement_block(void) {
 Nodes *function_definition_parameters(void) {
   Nodes *head = new_nodes();
   Nodes *nodes = head;
-  while (consume(TOKEN_KIND_COMMA) != NULL || token->kind != TOKEN_KIND_PARENTHESIS_RIGHT) {
+  while (consume(TOKEN_KIND_COMMA) != NULL || current_token()->kind != TOKEN_KIND_PARENTHESIS_RIGHT) {
     nodes->next = new_nodes();
     nodes = nodes->next;
     Type *type = type_part();
-    Token *identifier_ = consume(TOKEN_KIND_IDENTIFIER);
-    LocalVariable *local_variable = declare_local_variable(type, identifier_->string, identifier_->length);
+    LocalVariable *local_variable = declare_local_variable(type, expect_identifier());
     nodes->node = new_local_variable_node(local_variable);
   }
   return head->next;
 }
 
+// Skips tokens up to and including the one closing the bracket at the current token.
+void skip_brackets(TokenKind left, TokenKind right) {
+  int depth = 0;
+  do {
+    TokenKind kind = current_token()->kind;
+    if (kind == TOKEN_KIND_EOF) {
+      return;
+    }
+    if (kind == left) {
+      depth++;
+    } else if (kind == right) {
+      depth--;
+    }
+    token_index++;
+  } while (depth > 0);
+}
+
+// Declares the function and skips its parameters and body, which are parsed later by parse_function_body.
+Node *function_definition(Type *type, Symbol *symbol) {
+  declare_global_variable(type, symbol);
+  Node *node = new_node(NODE_KIND_FUNCTION_DEFINITION);
+  node->function_definition.return_value_type = type;
+  node->function_definition.symbol = symbol;
+  if (pending_functions_count == pending_functions_capacity) {
+    pending_functions_capacity = pending_functions_capacity == 0 ? 64 : pending_functions_capacity * 2;
+    pending_functions = realloc(pending_functions, sizeof(PendingFunction) * pending_functions_capacity);
+  }
+  pending_functions[pending_functions_count++] = (PendingFunction){node, token_index};
+  skip_brackets(TOKEN_KIND_PARENTHESIS_LEFT, TOKEN_KIND_PARENTHESIS_RIGHT);
+  if (current_token()->kind == TOKEN_KIND_BRACE_LEFT) {
+    skip_brackets(TOKEN_KIND_BRACE_LEFT, TOKEN_KIND_BRACE_RIGHT);
+  }
+  return node;
+}
+
 // function_definition = type identifier "(" function_definition_parameters? ")" statement_block
-Node *function_definition(Type *type, Token *identifier) {
-  declare_local_variable(type, identifier->string, identifier->length);
-  scope = new_scope(scope);
+void parse_function_body(PendingFunction *function) {
+  Node *node = function->node;
+  token_index = function->token_index;
+  scope = new_scope(global_scope);
   expect(TOKEN_KIND_PARENTHESIS_LEFT);
-  Nodes *parameters = function_definition_parameters();
+  node->function_definition.parameters = function_definition_parameters();
   expect(TOKEN_KIND_PARENTHESIS_RIGHT);
-  Node *node = new_node(NODE_KIND_FUNCTION_DEFINITION);
-  node->function_definition.return_value_type = type;
-  node->function_definition.name = identifier->string;
-  node->function_definition.name_length = identifier->length;
-  node->function_definition.parameters = parameters;
   node->function_definition.block = statement_block();
   node->function_definition.scope = scope;
-  scope = scope->parent;
-  return node;
+  node->function_definition.frame_size = scope->local_variable == NULL ? 0 : scope->local_variable->offset;
+}
+
+void *parse_function_bodies(void *arena_) {
+  arena = arena_;
+  int index;
+  while ((index = atomic_fetch_add(&next_pending_function, 1)) < pending_functions_count) {
+    parse_function_body(&pending_functions[index]);
+  }
+  return NULL;
+}
+
+// Parses function bodies on a thread of a parallel parse, recording the first error of each function on it.
+// Functions after the earliest one known to have an error are left unparsed, since that error is reported anyway.
+void *parse_function_bodies_recording_errors(void *arena_) {
+  arena = arena_;
+  int index;
+  while ((index = atomic_fetch_add(&next_pending_function, 1)) < pending_functions_count && index < atomic_load(&first_failed_function)) {
+    current_function = &pending_functions[index];
+    if (setjmp(error_handler) == 0) {
+      parse_function_body(current_function);
+      continue;
+    }
+    int failed = atomic_load(&first_failed_function);
+    while (index < failed && !atomic_compare_exchange_weak(&first_failed_function, &failed, index)) {
+    }
+  }
+  current_function = NULL;
+  return NULL;
+}
+
+// Parses function bodies on parser_jobs threads, or one per online processor when it is 0.
+// Each thread allocates from its own arena, which is merged into the arena of the compilation afterwards.
+// Errors are reported after every thread has finished, taking the one of the earliest function as -j 1 would.
+void parse_function_bodies_in_parallel(void) {
+  int jobs = parser_jobs > 0 ? parser_jobs : sysconf(_SC_NPROCESSORS_ONLN);
+  if (jobs > pending_functions_count) {
+    jobs = pending_functions_count;
+  }
+  atomic_store(&next_pending_function, 0);
+  atomic_store(&first_failed_function, INT_MAX);
+  if (jobs <= 1) {
+    parse_function_bodies(arena);
+    return;
+  }
+  pthread_t *threads = calloc(jobs, sizeof(pthread_t));
+  Arena **arenas = calloc(jobs, sizeof(Arena *));
+  for (int i = 0; i < jobs; i++) {
+    arenas[i] = new_arena();
+    if (pthread_create(&threads[i], NULL, parse_function_bodies_recording_errors, arenas[i]) != 0) {
+      fprintf(stderr, "Failed to create a thread.\n");
+      exit(1);
+    }
+  }
+  // Workers intern types into the arena of the compilation, so nothing is merged into it until every one has finished.
+  for (int i = 0; i < jobs; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  int failed = atomic_load(&first_failed_function);
+  if (failed != INT_MAX) {
+    fwrite(pending_functions[failed].error, 1, pending_functions[failed].error_length, stderr);
+    exit(1);
+  }
+  for (int i = 0; i < jobs; i++) {
+    merge_arena(arena, arenas[i]);
+  }
+  free(arenas);
+  free(threads);
 }
 
 // global_variable = type identifier type_postfix ";"
-Node *global_variable_definition(Type *type, Token *identifier) {
+Node *global_variable_definition(Type *type, Symbol *symbol) {
   type = type_postfix(type);
-  LocalVariable *local_variable = declare_local_variable(type, identifier->string, identifier->length);
+  LocalVariable *local_variable = declare_global_variable(type, symbol);
   local_variable->is_global = true;
   expect(TOKEN_KIND_SEMICOLON);
   Node *node = new_node(NODE_KIND_GLOBAL_VARIABLE_DEFINITION);
@@ -582,17 +816,24 @@ Node *global_variable_definition(Type *type, Token *identifier) {
 //   | global_variable_definition
 Node *function_definition_or_global_variable_definition() {
   Type *type = type_part();
-  Token *identifier = expect(TOKEN_KIND_IDENTIFIER);
-  if (token->kind == TOKEN_KIND_PARENTHESIS_LEFT) {
-    return function_definition(type, identifier);
+  Symbol *symbol = expect_identifier();
+  if (current_token()->kind == TOKEN_KIND_PARENTHESIS_LEFT) {
+    return function_definition(type, symbol);
   } else {
-    return global_variable_definition(type, identifier);
+    return global_variable_definition(type, symbol);
   }
 }
 
+void parse_pending_functions(void) {
+  parse_function_bodies_in_parallel();
+  pending_functions_count = 0;
+}
+
 // program = function_definition_or_global_variable*
+// A first pass records every global variable and function declaration, skipping function bodies by matching brackets.
+// Function bodies are then parsed in parallel, and they can refer to any global declaration, even a later one.
 Node *program(void) {
-  scope = new_scope(NULL);
+  scope = global_scope;
   Node *node = new_node(NODE_KIND_PROGRAM);
   Nodes *head = new_nodes();
   Nodes *nodes = head;
@@ -602,11 +843,55 @@ Node *program(void) {
     nodes->node = function_definition_or_global_variable_definition();
   }
   node->program.nodes = head->next;
+  parse_pending_functions();
   return node;
 }
 
-Node *parse(char *input) {
-  begin = input;
-  token = tokenize(input);
-  return program();
+void begin_parse(Arena *arena_, Source *source_) {
+  global_arena = arena = arena_;
+  parses_whole_program = false;
+  source = source_;
+  source_tokens = new_token_stream();
+  global_scope = new_scope(NULL);
+}
+
+void end_parse(void) {
+  free_token_stream(source_tokens);
+  free(pending_functions);
+  pending_functions = NULL;
+  pending_functions_capacity = 0;
+}
+
+// Parses source_ into a program node. Every node, scope, variable and type is allocated from arena_.
+Node *parse(Arena *arena_, Source *source_) {
+  begin_parse(arena_, source_);
+  parses_whole_program = true;
+  token_stream = source_tokens;
+  tokenize(token_stream, source);
+  token_index = 0;
+  Node *node = program();
+  end_parse();
+  return node;
+}
+
+// Parses the next top-level definition of the source given to begin_parse, or returns NULL at its end.
+// Only the tokens of the definition are held. Its nodes and scope are allocated from definition_arena,
+// which can be reset once the definition is generated, while global declarations go to the arena of begin_parse.
+Node *parse_definition(Arena *definition_arena) {
+  tokenize_definition(source_tokens, source);
+  return parse_tokenized_definition(definition_arena, source_tokens);
+}
+
+// Parses a top-level definition from tokens made by tokenize_definition, or returns NULL if there is none.
+Node *parse_tokenized_definition(Arena *definition_arena, TokenStream *tokens) {
+  arena = definition_arena;
+  token_stream = tokens;
+  token_index = 0;
+  if (!at_type()) {
+    return NULL;
+  }
+  scope = global_scope;
+  Node *node = function_definition_or_global_variable_definition();
+  parse_pending_functions();
+  return node;
 }
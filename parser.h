@@ -1,4 +1,8 @@
 #pragma once
+#include "arena.h"
+#include "source.h"
+#include "symbol.h"
+#include "tokenizer.h"
 #include "type.h"
 #include <stdbool.h>
 
@@ -7,19 +11,41 @@ typedef struct LocalVariable LocalVariable;
 struct LocalVariable {
   LocalVariable *next;
   Type *type;
-  char *name;
-  int name_length;
+  Symbol *symbol;
   bool is_global;
 
-  // Offset from RBP. (e.g. 8, 16, 24)
+  // Offset from RBP, a multiple of the alignment of the type. (e.g. 4, 8, 16)
+  // Variables may share an offset once layout_frame has found their lifetimes disjoint.
   int offset;
+
+  // Range of statements referring to the variable, or -1 when none does, computed by layout_frame.
+  int first_use;
+  int last_use;
+
+  // Whether the variable may be accessed through a pointer, which keeps it alive for the whole function.
+  bool is_address_taken;
+
+  // References weighted by the depth of the loops they are in, computed by layout_frame.
+  int use_weight;
+
+  // Whether the variable lives in a register instead of the frame, chosen by promote_variables,
+  // and its position among the promoted variables of its function.
+  bool is_promoted;
+  int promoted_index;
 };
 
 typedef struct Scope Scope;
 
 struct Scope {
   Scope *parent;
+
+  // Variables in declaration order, from the latest one.
   LocalVariable *local_variable;
+
+  // Open addressing hash table of the variables, keyed by symbol.
+  LocalVariable **table;
+  int table_capacity;
+  int local_variables_count;
 };
 
 typedef enum {
@@ -60,6 +86,9 @@ struct Node {
 
   Type *type;
 
+  // Number of registers needed to evaluate this node, computed lazily by the code generator.
+  int register_need;
+
   union {
     int value;
 
@@ -84,18 +113,19 @@ struct Node {
     } for_statement;
 
     struct {
-      char *name;
-      int name_length;
+      Symbol *symbol;
       Nodes *parameters;
     } function_call;
 
     struct {
       Type *return_value_type;
-      char *name;
-      int name_length;
+      Symbol *symbol;
       Nodes *parameters;
       Node *block;
       Scope *scope;
+
+      // Bytes of local variables below RBP.
+      int frame_size;
     } function_definition;
 
     struct {
@@ -124,4 +154,11 @@ struct Nodes {
   Nodes *next;
 };
 
-Node *parse(char *string);
+// Number of threads parsing function bodies, or 0 for one per online processor.
+extern int parser_jobs;
+
+Node *parse(Arena *arena, Source *source);
+void begin_parse(Arena *arena, Source *source);
+Node *parse_definition(Arena *definition_arena);
+Node *parse_tokenized_definition(Arena *definition_arena, TokenStream *tokens);
+void end_parse(void);
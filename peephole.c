@@ -0,0 +1,517 @@
+#include "peephole.h"
+#include <pthread.h> // pthread_mutex_lock, pthread_mutex_unlock
+#include <stdbool.h> // bool
+#include <stdlib.h>  // calloc, free
+
+// Instructions scanned forward from a store when looking for a load of the same memory.
+#define STORE_TO_LOAD_WINDOW 8
+
+PeepholeStatistics peephole_statistics;
+
+static char *peephole_rule_names[] = {
+    [PEEPHOLE_RULE_PUSH_POP] = "push-pop",
+    [PEEPHOLE_RULE_SELF_MOVE] = "self-move",
+    [PEEPHOLE_RULE_COPY_PROPAGATION] = "copy-propagation",
+    [PEEPHOLE_RULE_UPDATE_IN_PLACE] = "update-in-place",
+    [PEEPHOLE_RULE_STORE_TO_LOAD] = "store-to-load",
+    [PEEPHOLE_RULE_DEAD_MOVE] = "dead-move",
+    [PEEPHOLE_RULE_COMPARE_AND_BRANCH] = "compare-and-branch",
+    [PEEPHOLE_RULE_JUMP_TO_NEXT] = "jump-to-next",
+};
+
+// Bit set of registers, indexed by Register.
+typedef unsigned int RegisterSet;
+
+#define REGISTER_BIT(register_) (1u << (register_))
+
+static const RegisterSet argument_registers = REGISTER_BIT(REGISTER_RAX) | REGISTER_BIT(REGISTER_RDI) | REGISTER_BIT(REGISTER_RSI) | REGISTER_BIT(REGISTER_RDX) | REGISTER_BIT(REGISTER_RCX) | REGISTER_BIT(REGISTER_R8) | REGISTER_BIT(REGISTER_R9);
+static const RegisterSet caller_saved_registers = REGISTER_BIT(REGISTER_RAX) | REGISTER_BIT(REGISTER_RCX) | REGISTER_BIT(REGISTER_RDX) | REGISTER_BIT(REGISTER_RSI) | REGISTER_BIT(REGISTER_RDI) | REGISTER_BIT(REGISTER_R8) | REGISTER_BIT(REGISTER_R9) | REGISTER_BIT(REGISTER_R10) | REGISTER_BIT(REGISTER_R11);
+static const RegisterSet callee_saved_registers = REGISTER_BIT(REGISTER_RBX) | REGISTER_BIT(REGISTER_RSP) | REGISTER_BIT(REGISTER_RBP) | REGISTER_BIT(REGISTER_R12) | REGISTER_BIT(REGISTER_R13) | REGISTER_BIT(REGISTER_R14) | REGISTER_BIT(REGISTER_R15);
+
+// The stack and frame pointers are never treated as dead.
+static const RegisterSet pinned_registers = REGISTER_BIT(REGISTER_RSP) | REGISTER_BIT(REGISTER_RBP);
+
+// State of the function being optimized. Functions may be optimized on several threads at once.
+static _Thread_local InstructionList *list;
+static _Thread_local RegisterSet *live_out;
+
+// Instructions changed in the current sweep, whose liveness is stale until the next one.
+static _Thread_local bool *dirty;
+
+// Statistics of the function being optimized, added to peephole_statistics once it is done.
+static _Thread_local PeepholeStatistics statistics;
+static pthread_mutex_t statistics_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static RegisterSet register_set(Register register_) {
+  return register_ < REGISTER_RIP ? REGISTER_BIT(register_) : 0;
+}
+
+// Registers read to evaluate operand, including base and index registers of memory.
+static RegisterSet operand_registers(Operand operand) {
+  switch (operand.kind) {
+  case OPERAND_KIND_MEMORY:
+    return register_set(operand.base) | register_set(operand.index);
+  case OPERAND_KIND_REGISTER:
+    return register_set(operand.base);
+  default:
+    return 0;
+  }
+}
+
+// Set instructions only write the lowest byte, but the code generator never reads the rest of the register afterwards.
+static bool reads_destination(Opcode opcode) {
+  switch (opcode) {
+  case OPCODE_ADD:
+  case OPCODE_AND:
+  case OPCODE_CMP:
+  case OPCODE_IMUL:
+  case OPCODE_PUSH:
+  case OPCODE_SUB:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static bool writes_destination(Opcode opcode) {
+  switch (opcode) {
+  case OPCODE_ADD:
+  case OPCODE_AND:
+  case OPCODE_IMUL:
+  case OPCODE_LEA:
+  case OPCODE_MOV:
+  case OPCODE_MOVSX:
+  case OPCODE_MOVZX:
+  case OPCODE_POP:
+  case OPCODE_SETE:
+  case OPCODE_SETG:
+  case OPCODE_SETGE:
+  case OPCODE_SETL:
+  case OPCODE_SETLE:
+  case OPCODE_SETNE:
+  case OPCODE_SUB:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static RegisterSet used_registers(Instruction *instruction) {
+  Operand destination = instruction->operands[0];
+  switch (instruction->opcode) {
+  case OPCODE_CALL:
+    return argument_registers;
+  case OPCODE_CQO:
+    return REGISTER_BIT(REGISTER_RAX);
+  case OPCODE_IDIV:
+    return REGISTER_BIT(REGISTER_RAX) | REGISTER_BIT(REGISTER_RDX) | operand_registers(destination);
+  case OPCODE_RET:
+    return REGISTER_BIT(REGISTER_RAX) | callee_saved_registers;
+  default: {
+    RegisterSet registers = operand_registers(instruction->operands[1]);
+    if (destination.kind == OPERAND_KIND_MEMORY || reads_destination(instruction->opcode)) {
+      registers |= operand_registers(destination);
+    }
+    return registers;
+  }
+  }
+}
+
+static RegisterSet defined_registers(Instruction *instruction) {
+  Operand destination = instruction->operands[0];
+  switch (instruction->opcode) {
+  case OPCODE_CALL:
+    return caller_saved_registers;
+  case OPCODE_CQO:
+    return REGISTER_BIT(REGISTER_RDX);
+  case OPCODE_IDIV:
+    return REGISTER_BIT(REGISTER_RAX) | REGISTER_BIT(REGISTER_RDX);
+  default:
+    if (destination.kind == OPERAND_KIND_REGISTER && writes_destination(instruction->opcode)) {
+      return register_set(destination.base);
+    }
+    return 0;
+  }
+}
+
+static bool writes_memory(Instruction *instruction) {
+  return instruction->operands[0].kind == OPERAND_KIND_MEMORY && writes_destination(instruction->opcode);
+}
+
+// Backward dataflow over the instructions, with successors given by fallthrough and jumps.
+static void compute_liveness(void) {
+  int minimum_label = 0;
+  int maximum_label = -1;
+  for (int i = 0; i < list->length; i++) {
+    if (list->instructions[i].opcode == OPCODE_LABEL) {
+      int label = list->instructions[i].operands[0].value;
+      if (maximum_label < minimum_label) {
+        minimum_label = maximum_label = label;
+      } else if (label < minimum_label) {
+        minimum_label = label;
+      } else if (label > maximum_label) {
+        maximum_label = label;
+      }
+    }
+  }
+  int *label_indices = calloc(maximum_label - minimum_label + 1, sizeof(int));
+  for (int i = 0; i < list->length; i++) {
+    if (list->instructions[i].opcode == OPCODE_LABEL) {
+      label_indices[list->instructions[i].operands[0].value - minimum_label] = i;
+    }
+  }
+
+  RegisterSet *live_in = calloc(list->length, sizeof(RegisterSet));
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = list->length - 1; i >= 0; i--) {
+      Instruction *instruction = &list->instructions[i];
+      RegisterSet out = 0;
+      if (instruction->opcode != OPCODE_JMP && instruction->opcode != OPCODE_RET && i + 1 < list->length) {
+        out |= live_in[i + 1];
+      }
+      if (is_jump(instruction->opcode)) {
+        out |= live_in[label_indices[instruction->operands[0].value - minimum_label]];
+      }
+      RegisterSet in = used_registers(instruction) | (out & ~defined_registers(instruction)) | pinned_registers;
+      live_out[i] = out | pinned_registers;
+      if (in != live_in[i]) {
+        live_in[i] = in;
+        changed = true;
+      }
+    }
+  }
+  free(live_in);
+  free(label_indices);
+}
+
+// Returns the index of the next instruction to be executed after i falls through, or -1.
+static int next_instruction(int i) {
+  for (i++; i < list->length; i++) {
+    if (list->instructions[i].opcode != OPCODE_NOP) {
+      return dirty[i] ? -1 : i;
+    }
+  }
+  return -1;
+}
+
+static bool is_live_after(int i, Register register_) {
+  return (live_out[i] & register_set(register_)) != 0;
+}
+
+static void record(PeepholeRule rule, int removed_instructions) {
+  statistics.applications[rule]++;
+  statistics.removed_instructions[rule] += removed_instructions;
+}
+
+static void remove_instruction(int i) {
+  list->instructions[i].opcode = OPCODE_NOP;
+  dirty[i] = true;
+}
+
+// push A; pop B => mov B, A
+static bool apply_push_pop(int i) {
+  Instruction *push = &list->instructions[i];
+  int j = next_instruction(i);
+  if (push->opcode != OPCODE_PUSH || j < 0 || list->instructions[j].opcode != OPCODE_POP) {
+    return false;
+  }
+  Instruction *pop = &list->instructions[j];
+  if (is_same_operand(push->operands[0], pop->operands[0])) {
+    remove_instruction(i);
+    remove_instruction(j);
+    record(PEEPHOLE_RULE_PUSH_POP, 2);
+    return true;
+  }
+  if (pop->operands[0].kind != OPERAND_KIND_REGISTER) {
+    return false;
+  }
+  push->opcode = OPCODE_MOV;
+  push->operands[1] = push->operands[0];
+  push->operands[0] = pop->operands[0];
+  dirty[i] = true;
+  remove_instruction(j);
+  record(PEEPHOLE_RULE_PUSH_POP, 1);
+  return true;
+}
+
+// mov R, R
+static bool apply_self_move(int i) {
+  Instruction *instruction = &list->instructions[i];
+  if (instruction->opcode != OPCODE_MOV || instruction->operands[0].kind != OPERAND_KIND_REGISTER || !is_same_operand(instruction->operands[0], instruction->operands[1])) {
+    return false;
+  }
+  remove_instruction(i);
+  record(PEEPHOLE_RULE_SELF_MOVE, 1);
+  return true;
+}
+
+// mov R, S; op X, R => op X, S when R is dead afterwards, including push R => push S and cmp R, X => cmp S, X.
+static bool apply_copy_propagation(int i) {
+  Instruction *move = &list->instructions[i];
+  int j = next_instruction(i);
+  if (move->opcode != OPCODE_MOV || move->operands[0].kind != OPERAND_KIND_REGISTER || move->operands[0].size != 8 || j < 0) {
+    return false;
+  }
+  Register copy = move->operands[0].base;
+  Operand source = move->operands[1];
+  Instruction *user = &list->instructions[j];
+  int slot;
+  switch (user->opcode) {
+  case OPCODE_PUSH:
+    slot = 0;
+    break;
+  case OPCODE_CMP:
+    // cmp only reads its destination, so a register copied into it can be compared directly.
+    if (is_register(user->operands[0], copy) && source.kind == OPERAND_KIND_REGISTER && !(operand_registers(user->operands[1]) & register_set(copy))) {
+      slot = 0;
+      break;
+    }
+    // fallthrough
+  case OPCODE_ADD:
+  case OPCODE_AND:
+  case OPCODE_IMUL:
+  case OPCODE_MOV:
+  case OPCODE_SUB:
+    slot = 1;
+    if (operand_registers(user->operands[0]) & register_set(copy)) {
+      return false;
+    }
+    break;
+  default:
+    return false;
+  }
+  if (!is_register(user->operands[slot], copy) || is_live_after(j, copy)) {
+    return false;
+  }
+
+  Operand replacement;
+  if (user->operands[slot].size != 8) {
+    if (source.kind == OPERAND_KIND_MEMORY || source.kind == OPERAND_KIND_IMMEDIATE && user->operands[slot].size == 1) {
+      return false;
+    }
+    replacement = source.kind == OPERAND_KIND_REGISTER ? register_operand(source.base, user->operands[slot].size) : source;
+  } else if (source.kind == OPERAND_KIND_MEMORY && user->opcode != OPCODE_PUSH && user->operands[0].kind != OPERAND_KIND_REGISTER) {
+    return false;
+  } else {
+    replacement = source;
+  }
+  user->operands[slot] = replacement;
+  dirty[j] = true;
+  remove_instruction(i);
+  record(PEEPHOLE_RULE_COPY_PROPAGATION, 1);
+  return true;
+}
+
+// mov R, S; op R, X; mov S, R => op S, X when R is dead afterwards, which updates a variable in its register.
+static bool apply_update_in_place(int i) {
+  Instruction *move = &list->instructions[i];
+  if (move->opcode != OPCODE_MOV || move->operands[0].kind != OPERAND_KIND_REGISTER || move->operands[0].size != 8 || move->operands[1].kind != OPERAND_KIND_REGISTER) {
+    return false;
+  }
+  Register copy = move->operands[0].base;
+  Register variable = move->operands[1].base;
+  int j = next_instruction(i);
+  if (j < 0) {
+    return false;
+  }
+  Instruction *update = &list->instructions[j];
+  switch (update->opcode) {
+  case OPCODE_ADD:
+  case OPCODE_AND:
+  case OPCODE_IMUL:
+  case OPCODE_SUB:
+    break;
+  default:
+    return false;
+  }
+  if (!is_register(update->operands[0], copy) || (operand_registers(update->operands[1]) & register_set(copy))) {
+    return false;
+  }
+  int k = next_instruction(j);
+  if (k < 0) {
+    return false;
+  }
+  Instruction *store = &list->instructions[k];
+  if (store->opcode != OPCODE_MOV || !is_register(store->operands[0], variable) || store->operands[0].size != 8 || !is_register(store->operands[1], copy) || is_live_after(k, copy)) {
+    return false;
+  }
+  update->operands[0] = move->operands[1];
+  dirty[j] = true;
+  remove_instruction(i);
+  remove_instruction(k);
+  record(PEEPHOLE_RULE_UPDATE_IN_PLACE, 2);
+  return true;
+}
+
+// mov [M], R; ...; mov S, [M] => mov [M], R; ...; mov S, R
+static bool apply_store_to_load(int i) {
+  Instruction *store = &list->instructions[i];
+  if (store->opcode != OPCODE_MOV || store->operands[0].kind != OPERAND_KIND_MEMORY || store->operands[1].kind != OPERAND_KIND_REGISTER) {
+    return false;
+  }
+  Operand memory = store->operands[0];
+  Register value = store->operands[1].base;
+  RegisterSet inputs = operand_registers(memory) | register_set(value);
+  int j = i;
+  for (int distance = 0; distance < STORE_TO_LOAD_WINDOW; distance++) {
+    j = next_instruction(j);
+    if (j < 0) {
+      return false;
+    }
+    Instruction *instruction = &list->instructions[j];
+    bool is_load = instruction->opcode == (memory.size == 8 ? OPCODE_MOV : OPCODE_MOVSX) && instruction->operands[0].kind == OPERAND_KIND_REGISTER;
+    if (is_load && is_same_operand(instruction->operands[1], memory)) {
+      instruction->operands[1] = register_operand(value, memory.size);
+      for (int k = i; k <= j; k++) {
+        dirty[k] = true;
+      }
+      record(PEEPHOLE_RULE_STORE_TO_LOAD, 0);
+      return true;
+    }
+    switch (instruction->opcode) {
+    case OPCODE_CALL:
+    case OPCODE_LABEL:
+    case OPCODE_POP:
+    case OPCODE_PUSH:
+    case OPCODE_RET:
+      return false;
+    default:
+      if (is_jump(instruction->opcode) || writes_memory(instruction) || (defined_registers(instruction) & inputs)) {
+        return false;
+      }
+    }
+  }
+  return false;
+}
+
+// mov R, X where R is dead afterwards, and likewise for lea, movsx and movzx.
+static bool apply_dead_move(int i) {
+  Instruction *instruction = &list->instructions[i];
+  switch (instruction->opcode) {
+  case OPCODE_LEA:
+  case OPCODE_MOV:
+  case OPCODE_MOVSX:
+  case OPCODE_MOVZX:
+    break;
+  default:
+    return false;
+  }
+  if (instruction->operands[0].kind != OPERAND_KIND_REGISTER || is_live_after(i, instruction->operands[0].base)) {
+    return false;
+  }
+  remove_instruction(i);
+  record(PEEPHOLE_RULE_DEAD_MOVE, 1);
+  return true;
+}
+
+// setl al; movzx R, al; cmp R, 0; je L => jge L
+static bool apply_compare_and_branch(int i) {
+  Instruction *set = &list->instructions[i];
+  Opcode jump = jump_of_set(set->opcode);
+  if (jump == OPCODE_NOP) {
+    return false;
+  }
+  int j = next_instruction(i);
+  if (j < 0 || list->instructions[j].opcode != OPCODE_MOVZX || !is_register(list->instructions[j].operands[1], set->operands[0].base)) {
+    return false;
+  }
+  Register flag = list->instructions[j].operands[0].base;
+  int k = next_instruction(j);
+  if (k < 0 || list->instructions[k].opcode != OPCODE_CMP || !is_register(list->instructions[k].operands[0], flag) || list->instructions[k].operands[1].kind != OPERAND_KIND_IMMEDIATE || list->instructions[k].operands[1].value != 0) {
+    return false;
+  }
+  int l = next_instruction(k);
+  if (l < 0 || list->instructions[l].opcode != OPCODE_JE && list->instructions[l].opcode != OPCODE_JNE) {
+    return false;
+  }
+  if (is_live_after(l, flag) || is_live_after(l, set->operands[0].base)) {
+    return false;
+  }
+  Instruction *branch = &list->instructions[l];
+  branch->opcode = branch->opcode == OPCODE_JE ? negate_condition(jump) : jump;
+  dirty[l] = true;
+  remove_instruction(i);
+  remove_instruction(j);
+  remove_instruction(k);
+  record(PEEPHOLE_RULE_COMPARE_AND_BRANCH, 3);
+  return true;
+}
+
+// jmp L; L:
+static bool apply_jump_to_next(int i) {
+  Instruction *jump = &list->instructions[i];
+  if (jump->opcode != OPCODE_JMP) {
+    return false;
+  }
+  for (int j = i + 1; j < list->length; j++) {
+    Instruction *instruction = &list->instructions[j];
+    if (instruction->opcode == OPCODE_LABEL && instruction->operands[0].value == jump->operands[0].value) {
+      remove_instruction(i);
+      record(PEEPHOLE_RULE_JUMP_TO_NEXT, 1);
+      return true;
+    }
+    if (instruction->opcode != OPCODE_LABEL && instruction->opcode != OPCODE_NOP) {
+      return false;
+    }
+  }
+  return false;
+}
+
+static bool apply_rules(int i) {
+  return apply_push_pop(i) ||
+         apply_self_move(i) ||
+         apply_compare_and_branch(i) ||
+         apply_copy_propagation(i) ||
+         apply_update_in_place(i) ||
+         apply_store_to_load(i) ||
+         apply_dead_move(i) ||
+         apply_jump_to_next(i);
+}
+
+// Rewrites the instructions of a function in place until no rule applies.
+// Each sweep leaves instructions it has changed alone, and liveness is recomputed between sweeps.
+void optimize_peephole(InstructionList *instructions) {
+  list = instructions;
+  statistics = (PeepholeStatistics){0};
+  statistics.input_instructions = list->length;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    live_out = calloc(list->length, sizeof(RegisterSet));
+    dirty = calloc(list->length, sizeof(bool));
+    compute_liveness();
+    for (int i = 0; i < list->length; i++) {
+      if (!dirty[i] && list->instructions[i].opcode != OPCODE_NOP && apply_rules(i)) {
+        changed = true;
+      }
+    }
+    free(live_out);
+    free(dirty);
+    compact_instruction_list(list);
+  }
+  statistics.output_instructions = list->length;
+
+  pthread_mutex_lock(&statistics_mutex);
+  peephole_statistics.input_instructions += statistics.input_instructions;
+  peephole_statistics.output_instructions += statistics.output_instructions;
+  for (PeepholeRule rule = 0; rule < PEEPHOLE_RULES_COUNT; rule++) {
+    peephole_statistics.applications[rule] += statistics.applications[rule];
+    peephole_statistics.removed_instructions[rule] += statistics.removed_instructions[rule];
+  }
+  pthread_mutex_unlock(&statistics_mutex);
+}
+
+void print_peephole_statistics(FILE *file) {
+  size_t total_applications = 0;
+  size_t total_removed_instructions = 0;
+  fprintf(file, "%-20s %10s %10s\n", "rule", "applied", "removed");
+  for (int rule = 0; rule < PEEPHOLE_RULES_COUNT; rule++) {
+    fprintf(file, "%-20s %10zu %10zu\n", peephole_rule_names[rule], peephole_statistics.applications[rule], peephole_statistics.removed_instructions[rule]);
+    total_applications += peephole_statistics.applications[rule];
+    total_removed_instructions += peephole_statistics.removed_instructions[rule];
+  }
+  fprintf(file, "%-20s %10zu %10zu\n", "total", total_applications, total_removed_instructions);
+  fprintf(file, "%-20s %10zu -> %zu\n", "instructions", peephole_statistics.input_instructions, peephole_statistics.output_instructions);
+}
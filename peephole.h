@@ -0,0 +1,32 @@
+#pragma once
+
+#include "instruction.h" // InstructionList
+#include <stddef.h>      // size_t
+#include <stdio.h>       // FILE
+
+typedef enum {
+  PEEPHOLE_RULE_PUSH_POP,
+  PEEPHOLE_RULE_SELF_MOVE,
+  PEEPHOLE_RULE_COPY_PROPAGATION,
+  PEEPHOLE_RULE_UPDATE_IN_PLACE,
+  PEEPHOLE_RULE_STORE_TO_LOAD,
+  PEEPHOLE_RULE_DEAD_MOVE,
+  PEEPHOLE_RULE_COMPARE_AND_BRANCH,
+  PEEPHOLE_RULE_JUMP_TO_NEXT,
+  PEEPHOLE_RULES_COUNT,
+} PeepholeRule;
+
+typedef struct PeepholeStatistics PeepholeStatistics;
+
+// Accumulated over every function passed to optimize_peephole.
+struct PeepholeStatistics {
+  size_t input_instructions;
+  size_t output_instructions;
+  size_t applications[PEEPHOLE_RULES_COUNT];
+  size_t removed_instructions[PEEPHOLE_RULES_COUNT];
+};
+
+extern PeepholeStatistics peephole_statistics;
+
+void optimize_peephole(InstructionList *list);
+void print_peephole_statistics(FILE *file);
@@ -0,0 +1,154 @@
+#define _POSIX_C_SOURCE 200809L // sched_yield
+
+#include "pipeline.h"
+#include "code_generator.h" // begin_generation, generate_definition
+#include "optimizer.h"      // optimize
+#include "output.h"         // output
+#include "parser.h"         // begin_parse, parse_tokenized_definition, end_parse
+#include "tokenizer.h"      // new_token_stream, tokenize_definition, raise_token_error, free_token_stream
+#include <pthread.h>        // pthread_create, pthread_join
+#include <sched.h>          // sched_yield
+#include <stdatomic.h>      // atomic_size_t, atomic_load_explicit, atomic_store_explicit
+#include <stdbool.h>        // bool
+#include <stdio.h>          // fprintf
+#include <stdlib.h>         // calloc, exit, free, malloc
+
+// Items a stage can get ahead of the next one by.
+#define RING_CAPACITY 256
+
+typedef struct Ring Ring;
+
+// Lock-free queue between a single producer thread and a single consumer thread.
+// Each index is written by one side only, and published with release so that the item it covers is visible.
+struct Ring {
+  void *items[RING_CAPACITY];
+  atomic_size_t head;
+  atomic_size_t tail;
+};
+
+typedef struct PipelinedDefinition PipelinedDefinition;
+
+// Definition handed from the parser to the code generator, along with the arena its nodes live in.
+struct PipelinedDefinition {
+  Node *node;
+  Arena *arena;
+};
+
+typedef struct GenerationStage GenerationStage;
+
+struct GenerationStage {
+  Ring *definitions;
+
+  // Output of the main thread, since output is thread-local.
+  Output *output;
+};
+
+static Source *tokenized_source;
+
+// Blocks by yielding while the ring is full.
+static void push_ring(Ring *ring, void *item) {
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  while (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == RING_CAPACITY) {
+    sched_yield();
+  }
+  ring->items[tail % RING_CAPACITY] = item;
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+// Blocks by yielding while the ring is empty.
+static void *pop_ring(Ring *ring) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  while (atomic_load_explicit(&ring->tail, memory_order_acquire) == head) {
+    sched_yield();
+  }
+  void *item = ring->items[head % RING_CAPACITY];
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+  return item;
+}
+
+// Pushes the tokens of each top-level definition. The last chunk has nothing but EOF, or a lexical error,
+// which the parser raises in order, so that an error in an earlier definition is reported first as with --stream.
+static void *tokenize_stage(void *chunks) {
+  int offset = 0;
+  while (true) {
+    TokenStream *chunk = new_token_stream();
+    chunk->offset = offset;
+    chunk->defers_errors = true;
+    tokenize_definition(chunk, tokenized_source);
+    offset = chunk->offset;
+    // The parser owns the chunk once it is pushed.
+    bool last = chunk->length == 1 || chunk->error_position != NULL;
+    push_ring(chunks, chunk);
+    if (last) {
+      return NULL;
+    }
+  }
+}
+
+// Optimizes and generates each definition, and releases it. A NULL definition ends the stage.
+static void *generate_stage(void *stage_) {
+  GenerationStage *stage = stage_;
+  output = stage->output;
+  begin_generation();
+  PipelinedDefinition *definition;
+  while ((definition = pop_ring(stage->definitions)) != NULL) {
+    optimize(definition->node);
+    generate_definition(definition->node);
+    free_arena(definition->arena);
+    free(definition);
+  }
+  return NULL;
+}
+
+static void start_thread(pthread_t *thread, void *(*function)(void *), void *argument) {
+  if (pthread_create(thread, NULL, function, argument) != 0) {
+    fprintf(stderr, "Failed to create a thread.\n");
+    exit(1);
+  }
+}
+
+// Compiles source one top-level definition at a time, like --stream, but with tokenizing, parsing and generating
+// running at once on their own threads. The tokenizer streams token chunks to the parser on this thread,
+// which hands each parsed definition to the code generator.
+// Symbols and types are shared, and the rings order their creation before their use by the next stage.
+void compile_pipelined(Arena *arena, Source *source) {
+  Ring *chunks = calloc(1, sizeof(Ring));
+  Ring *definitions = calloc(1, sizeof(Ring));
+  GenerationStage stage = {definitions, output};
+  tokenized_source = source;
+  begin_parse(arena, source);
+
+  pthread_t tokenizer;
+  pthread_t generator;
+  start_thread(&tokenizer, tokenize_stage, chunks);
+  start_thread(&generator, generate_stage, &stage);
+
+  // Chunks are drained up to the end even after something other than a definition, so that the tokenizer finishes.
+  bool parsing = true;
+  bool last = false;
+  while (!last) {
+    TokenStream *chunk = pop_ring(chunks);
+    last = chunk->length == 1 || chunk->error_position != NULL;
+    if (parsing) {
+      raise_token_error(chunk);
+      Arena *definition_arena = new_arena();
+      Node *node = parse_tokenized_definition(definition_arena, chunk);
+      if (node == NULL) {
+        free_arena(definition_arena);
+        parsing = false;
+      } else {
+        PipelinedDefinition *definition = malloc(sizeof(PipelinedDefinition));
+        *definition = (PipelinedDefinition){node, definition_arena};
+        push_ring(definitions, definition);
+      }
+    }
+    free_token_stream(chunk);
+  }
+  push_ring(definitions, NULL);
+
+  pthread_join(tokenizer, NULL);
+  pthread_join(generator, NULL);
+  end_parse();
+  free(definitions);
+  free(chunks);
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "arena.h"  // Arena
+#include "source.h" // Source
+
+void compile_pipelined(Arena *arena, Source *source);
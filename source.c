@@ -0,0 +1,117 @@
+#define _POSIX_C_SOURCE 200809L // fdopen
+
+#include "source.h"
+#include <fcntl.h>    // open
+#include <limits.h>   // INT_MAX
+#include <stdio.h>    // fprintf, fread
+#include <stdlib.h>   // calloc, exit, free, realloc
+#include <string.h>   // strcmp, strlen
+#include <sys/mman.h> // mmap, munmap
+#include <sys/stat.h> // fstat
+#include <unistd.h>   // close
+
+static void check_source_length(size_t length) {
+  if (length > INT_MAX) {
+    fprintf(stderr, "Source is too large.\n");
+    exit(1);
+  }
+}
+
+Source *new_source(char *text) {
+  size_t length = strlen(text);
+  check_source_length(length);
+  Source *source = calloc(1, sizeof(Source));
+  source->text = text;
+  source->length = length;
+  return source;
+}
+
+static Source *read_source_stream(FILE *file, char *path) {
+  size_t capacity = 4096;
+  size_t length = 0;
+  char *text = malloc(capacity);
+  size_t read_length;
+  while ((read_length = fread(text + length, 1, capacity - length, file)) > 0) {
+    length += read_length;
+    if (length == capacity) {
+      capacity *= 2;
+      text = realloc(text, capacity);
+    }
+  }
+  check_source_length(length);
+  Source *source = calloc(1, sizeof(Source));
+  source->path = path;
+  source->text = text;
+  source->length = length;
+  return source;
+}
+
+// Reads a program from the file at path, or from stdin when path is "-".
+// Regular files are memory-mapped read-only instead of being copied.
+Source *read_source(char *path) {
+  if (!strcmp(path, "-")) {
+    return read_source_stream(stdin, "<stdin>");
+  }
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to open %s.\n", path);
+    exit(1);
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode) && file_stat.st_size > 0) {
+    check_source_length(file_stat.st_size);
+    char *text = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (text != MAP_FAILED) {
+      close(fd);
+      Source *source = calloc(1, sizeof(Source));
+      source->path = path;
+      source->text = text;
+      source->length = file_stat.st_size;
+      source->mapped_length = file_stat.st_size;
+      return source;
+    }
+  }
+
+  FILE *file = fdopen(fd, "r");
+  Source *source = read_source_stream(file, path);
+  fclose(file);
+  return source;
+}
+
+void free_source(Source *source) {
+  if (source->mapped_length) {
+    munmap(source->text, source->mapped_length);
+  } else if (source->path) {
+    free(source->text);
+  }
+  free(source);
+}
+
+// Prints an error at position with the line containing it.
+void print_error_at(FILE *file, Source *source, char *position, char *message) {
+  char *end = source->text + source->length;
+  char *line = position;
+  while (source->text < line && line[-1] != '\n') {
+    line--;
+  }
+  char *line_end = position;
+  while (line_end < end && *line_end != '\n') {
+    line_end++;
+  }
+  if (source->path) {
+    int line_number = 1;
+    for (char *p = source->text; p < line; p++) {
+      line_number += *p == '\n';
+    }
+    fprintf(file, "%s:%d:\n", source->path, line_number);
+  }
+  fprintf(file, "%.*s\n", (int)(line_end - line), line);
+  fprintf(file, "%*s^ %s\n", (int)(position - line), "", message);
+}
+
+// Reports an error at position with the line containing it, then exits.
+void error_at(Source *source, char *position, char *message) {
+  print_error_at(stderr, source, position, message);
+  exit(1);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h> // size_t
+#include <stdio.h>  // FILE
+
+typedef struct Source Source;
+
+// Program text. The text is not NUL-terminated when it is memory-mapped from a file.
+struct Source {
+  char *path;
+  char *text;
+  int length;
+
+  // Length of the mapping when text is memory-mapped, otherwise 0.
+  size_t mapped_length;
+};
+
+Source *new_source(char *text);
+Source *read_source(char *path);
+void free_source(Source *source);
+void print_error_at(FILE *file, Source *source, char *position, char *message);
+void error_at(Source *source, char *position, char *message);
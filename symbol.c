@@ -0,0 +1,90 @@
+#include "symbol.h"
+#include <stdio.h>  // fprintf
+#include <stdlib.h> // calloc, exit, malloc
+#include <string.h> // memcmp
+
+// Symbols are stored in fixed-size chunks, so that a Symbol never moves once it is interned.
+#define SYMBOL_CHUNK_SIZE 4096
+#define SYMBOL_CHUNKS_CAPACITY 4096
+
+static Symbol *symbol_chunks[SYMBOL_CHUNKS_CAPACITY];
+static int symbols_count;
+
+// Open addressing hash table of symbol IDs + 1, so that 0 means an empty slot.
+static int *symbol_table;
+static int symbol_table_capacity;
+
+// FNV-1a
+static unsigned int hash_name(char *name, int name_length) {
+  unsigned int hash = 2166136261u;
+  for (int i = 0; i < name_length; i++) {
+    hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+  }
+  return hash;
+}
+
+Symbol *find_symbol(int id) {
+  return &symbol_chunks[id / SYMBOL_CHUNK_SIZE][id % SYMBOL_CHUNK_SIZE];
+}
+
+static void insert_symbol_id(int *table, int capacity, int id) {
+  int mask = capacity - 1;
+  int i = find_symbol(id)->hash & mask;
+  while (table[i] != 0) {
+    i = (i + 1) & mask;
+  }
+  table[i] = id + 1;
+}
+
+// Keeps the load factor of the table at most 1/2.
+static void grow_symbol_table(void) {
+  int capacity = symbol_table_capacity == 0 ? 1024 : symbol_table_capacity * 2;
+  int *table = calloc(capacity, sizeof(int));
+  for (int i = 0; i < symbol_table_capacity; i++) {
+    if (symbol_table[i] != 0) {
+      insert_symbol_id(table, capacity, symbol_table[i] - 1);
+    }
+  }
+  free(symbol_table);
+  symbol_table = table;
+  symbol_table_capacity = capacity;
+}
+
+static int new_symbol(char *name, int name_length, unsigned int hash) {
+  int id = symbols_count;
+  if (id % SYMBOL_CHUNK_SIZE == 0) {
+    if (id / SYMBOL_CHUNK_SIZE == SYMBOL_CHUNKS_CAPACITY) {
+      fprintf(stderr, "Too many identifiers.\n");
+      exit(1);
+    }
+    symbol_chunks[id / SYMBOL_CHUNK_SIZE] = malloc(sizeof(Symbol) * SYMBOL_CHUNK_SIZE);
+  }
+  Symbol *symbol = find_symbol(id);
+  symbol->name = name;
+  symbol->name_length = name_length;
+  symbol->id = id;
+  symbol->hash = hash;
+  symbols_count++;
+  return id;
+}
+
+// Returns the ID of the symbol for the given name, interning it on first sight.
+// The name is not copied, so it must outlive the symbol.
+int intern(char *name, int name_length) {
+  if ((symbols_count + 1) * 2 > symbol_table_capacity) {
+    grow_symbol_table();
+  }
+  unsigned int hash = hash_name(name, name_length);
+  int mask = symbol_table_capacity - 1;
+  for (int i = hash & mask;; i = (i + 1) & mask) {
+    if (symbol_table[i] == 0) {
+      int id = new_symbol(name, name_length, hash);
+      symbol_table[i] = id + 1;
+      return id;
+    }
+    Symbol *symbol = find_symbol(symbol_table[i] - 1);
+    if (symbol->hash == hash && symbol->name_length == name_length && !memcmp(symbol->name, name, name_length)) {
+      return symbol->id;
+    }
+  }
+}
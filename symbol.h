@@ -0,0 +1,14 @@
+#pragma once
+
+typedef struct Symbol Symbol;
+
+// Interned identifier. There is exactly one Symbol for each distinct name, so names can be compared by pointer.
+struct Symbol {
+  char *name;
+  int name_length;
+  int id;
+  unsigned int hash;
+};
+
+int intern(char *name, int name_length);
+Symbol *find_symbol(int id);
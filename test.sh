@@ -14,6 +14,91 @@ assert() {
     echo "$input => $expected expected, but got $actual"
     exit 1
   fi
+
+  ./r7cc -c -o tmp.o "$input"
+  gcc -o tmp tmp.o
+  ./tmp
+  actual="$?"
+
+  if [ "$actual" != "$expected" ]; then
+    echo "-c $input => $expected expected, but got $actual"
+    exit 1
+  fi
+
+  ./r7cc --run "$input"
+  actual="$?"
+
+  if [ "$actual" != "$expected" ]; then
+    echo "--run $input => $expected expected, but got $actual"
+    exit 1
+  fi
+
+  ./r7cc --ssa --run "$input"
+  actual="$?"
+
+  if [ "$actual" != "$expected" ]; then
+    echo "--ssa --run $input => $expected expected, but got $actual"
+    exit 1
+  fi
+
+  ./r7cc --vm "$input"
+  actual="$?"
+
+  if [ "$actual" != "$expected" ]; then
+    echo "--vm $input => $expected expected, but got $actual"
+    exit 1
+  fi
+}
+
+assert_file() {
+  expected="$1"
+  input="$2"
+
+  printf "%s" "$input" > tmp.src
+  ./r7cc -o tmp.s -f tmp.src
+  gcc -o tmp tmp.s
+  ./tmp
+  actual="$?"
+
+  if [ "$actual" = "$expected" ]; then
+    echo "-f $input => $actual"
+  else
+    echo "-f $input => $expected expected, but got $actual"
+    exit 1
+  fi
+}
+
+assert_stream() {
+  expected="$1"
+  input="$2"
+
+  ./r7cc --stream "$input" > tmp.s
+  gcc -o tmp tmp.s
+  ./tmp
+  actual="$?"
+
+  if [ "$actual" = "$expected" ]; then
+    echo "--stream $input => $actual"
+  else
+    echo "--stream $input => $expected expected, but got $actual"
+    exit 1
+  fi
+
+  ./r7cc --stream --run "$input"
+  actual="$?"
+
+  if [ "$actual" != "$expected" ]; then
+    echo "--stream --run $input => $expected expected, but got $actual"
+    exit 1
+  fi
+
+  ./r7cc --pipeline --run "$input"
+  actual="$?"
+
+  if [ "$actual" != "$expected" ]; then
+    echo "--pipeline --run $input => $expected expected, but got $actual"
+    exit 1
+  fi
 }
 
 # minimal example
@@ -71,6 +156,9 @@ assert 1 "int main() { int foo; foo = 1; return foo; }"
 assert 1 "int main() { int foo; int bar; foo = 1; bar = 2; return foo; }"
 assert 2 "int main() { int foo; int bar; foo = 1; bar = 2; return foo * bar; }"
 
+# identifier starting with keyword
+assert 3 "int main() { int iff; int format; iff = 1; format = 2; return iff + format; }"
+
 # if
 assert 2 "int main() { if (1) return 2; }"
 assert 3 "int main() { if (0) return 2; return 3; }"
@@ -92,6 +180,15 @@ assert 6 "int multiply(int a, int b) { return a * b; } int main() { return multi
 # recursive function
 assert 8 "int fib(int a) { if (a < 2) return a; return fib(a - 2) + fib(a - 1); } int main() { return fib(6); }"
 
+# external function, resolved by the linker or, with --run, in the host process
+program="int main() { int a = 0 - 3; return abs(a) + abs(4); }"
+./r7cc --run "$program"
+[ "$?" = 7 ] || { echo "--run $program => 7 expected"; exit 1; }
+./r7cc -c -o tmp.o "$program"
+gcc -o tmp tmp.o
+./tmp
+[ "$?" = 7 ] || { echo "-c $program => 7 expected"; exit 1; }
+
 # address and dereference
 assert 2 "int main() { int a; int *b; a = 2; b = &a; return *b; }"
 
@@ -102,23 +199,23 @@ assert 2 "int main() { int a = 2; return a; }"
 assert 1 "int *f() { int a = 0; int *b = &a; return b; } int main() { return 1; }"
 
 # pointer add
-assert 1 "int main() { int a = 1; int b = 2; return *(&b + 1); }"
-assert 1 "int main() { int a = 1; int b = 2; return *(1 + &b); }"
+assert 1 "int main() { int a[2]; a[0] = 2; a[1] = 1; return *(&a[0] + 1); }"
+assert 1 "int main() { int a[2]; a[0] = 2; a[1] = 1; return *(1 + &a[0]); }"
 
 # pointer subtract
-assert 2 "int main() { int a = 1; int b = 2; return *(&a - 1); }"
+assert 2 "int main() { int a[2]; a[0] = 2; a[1] = 1; return *(&a[1] - 1); }"
 assert 1 "int main() { int a = 1; return *((&a + 1) - 1); }"
 
 # pointer diff
 assert 1 "int main() { int a = 10; return (&a + 1) - &a; }"
 
 # sizeof operator
-assert 8 "int main() { int a; return sizeof(a); }"
-assert 16 "int main() { int a; return sizeof(&a); }"
-assert 8 "int main() { int a; return sizeof(*&a); }"
+assert 4 "int main() { int a; return sizeof(a); }"
+assert 8 "int main() { int a; return sizeof(&a); }"
+assert 4 "int main() { int a; return sizeof(*&a); }"
 
 # array declaration
-assert 80 "int main() { int a[10]; return sizeof(a); }"
+assert 40 "int main() { int a[10]; return sizeof(a); }"
 
 # array access via pointer
 assert 1 "int main() { int a[2]; *a = 1; return *a; }"
@@ -143,4 +240,106 @@ assert 2 "int main() { char a = 1; char b = 2; return b; }"
 assert 1 "int main() { char a; return sizeof(a); }"
 assert 10 "int main() { char a[10]; return sizeof(a); }"
 
+# int is sign-extended from 32 bits
+assert 1 "int main() { int a = -1; int b[2]; b[1] = -3; return a - b[1] + (a < 0) - 2; }"
+assert 7 "char c; int *p; int g; int f(int x) { return x - 10; } int main() { char d = 1; int *q = &g; g = f(3); p = q; int x = d; return 0 - *p + x - 1; }"
+
+# stack slot sharing
+assert 8 "int main() { int s = 0; int i; for (i = 0; i < 3; i = i + 1) { int t = i * 2; s = s + t; } int u = s + 1; int v = u * 2; return v - s; }"
+assert 11 "int main() { int a = 0; int b; int i; for (i = 0; i < 3; i = i + 1) { if (i > 0) a = a + b; b = 5; } int c = 1; return a + c; }"
+assert 9 "int f(int x) { int y = x + 1; int z = y * 2; return z; } int main() { int unused; int a[3]; char c; int *p = &a[1]; a[2] = f(3); c = 1; int x = c; return a[2] + x + p[1] - 8; }"
+program="int main() { int a = 1; int b = 2; int c = 3; int d = 4; int e = 5; int i; for (i = 0; i < 2; i = i + 1) { a = a + b; b = b + c; c = c + d; d = d + e; e = e + a; } int unused; int p = a; a = a + p; int q = b; b = b + q; int r = c; c = c + r; int s = d; d = d + s; return a + b + c + d - e; }"
+[ "$(./r7cc "$program" | grep -c "sub rsp, 48")" = 1 ] || { echo "$program => i, p, q, r and s do not share one slot beside the five saved registers"; exit 1; }
+assert 90 "$program"
+
+# variables in registers
+assert 16 "int f(int x) { int a = x * 2; int b = a + 1; return b; } int main() { int s = 0; int i; for (i = 0; i < 4; i = i + 1) s = s + f(i); return s; }"
+assert 41 "int main() { int a = 1; int b = 2; int c = 3; int d = 4; int e = 5; int f = 6; int g = 7; int i; for (i = 0; i < 2; i = i + 1) { a = a + b; c = c + d; e = e + f; g = g + i; } return a + c + e + g; }"
+assert 44 "int main() { char c; c = 300; int x = c; return x; }"
+assert 8 "int main() { int a = 5; int *p = &a; int b = 0; while (b < 3) { *p = *p + b; b = b + 1; } return a; }"
+assert 4 "int g[4]; int main() { int *p = g; int i; for (i = 0; i < 4; i = i + 1) { *p = i; p = p + 1; } return g[3] + g[1]; }"
+
+# register spilling
+e=1
+for i in 1 2 3 4 5 6 7; do e="($e+$e)"; done
+assert 128 "int main() { return $e; }"
+assert 0 "int main() { return $e - $e; }"
+
+# function call in expression
+assert 51 "int add(int a, int b) { return a + b; } int main() { return (5 - add(1, 1)) * (add(1, 1) + add(add(1, 2), add(3, add(4, 5)))); }"
+assert 91 "int one() { return 1; } int g(int a, int b, int c, int d, int e, int f) { return a + b * 2 + c * 3 + d * 4 + e * 5 + f * 6; } int main() { return g(one(), 2, one() + 2, 4, 5, one() * 6); }"
+
+assert 7 "int one() { return 1; } int main() { int a = 1; return a + (a + (a + (one() + (a + (a + one()))))); }"
+
+# constant folding
+assert 4 "int main() { return 2 * 3 - 6 / 2 + (1 < 2); }"
+assert 5 "int main() { int a = 5; return a * 1 + 0 - a * 0 + 2 - 2; }"
+assert 7 "int main() { int a[4]; a[3] = 7; return *((a + 1) + 2); }"
+assert 7 "int main() { int a[4]; a[1] = 7; return *((a + 3) - 2); }"
+assert 2 "int main() { if (0) return 1; return 2; }"
+assert 3 "int main() { while (1 - 1) return 1; return 3; }"
+assert 4 "int main() { int a; for (a = 4; 0;) return 1; return a; }"
+assert 1 "int main() { return 65536 * 65536 / 65536 / 65536; }"
+
+# peephole optimization
+assert 10 "int main() { int i; for (i = 0; i < 10; i = i + 1) {} return i; }"
+assert 3 "int main() { int a = 0; int b = 0; while (a <= 4) { if (a == 2) b = b + 1; if (a != 3) b = b + 0; else b = b + 2; a = a + 1; } return b; }"
+assert 6 "int main() { int a = 1; int b = a; int c = b + a; return c * 3; }"
+
+# compare and branch
+assert 5 "int main() { int i; int s = 0; for (i = 0; i < 10; i = i + 1) { if (i > 4) s = s + 1; } return s; }"
+assert 6 "int main() { int i; int s = 0; for (i = 0; 9 >= i; i = i + 1) { if (4 <= i) s = s + 1; } return s; }"
+assert 4 "int main() { int a = 3; int b = 4; if (a == b) return 1; if (a != b) if (b > a) return b; return 2; }"
+assert 1 "int main() { int a = 3; return (a > 2) + (2 >= a) + (a == 4); }"
+
+# addressing modes
+assert 10 "int g[4]; int main() { int a[4]; int i; for (i = 0; i < 4; i = i + 1) { a[i] = i; g[i] = a[i] * 2; } return g[3] + a[3] + g[1] + a[1] - 2; }"
+assert 9 "int g[4]; int main() { int *p = &g[1]; g[2] = 5; *(p + 2) = 4; return p[1] + g[3]; }"
+assert 3 "char c[4]; int main() { char d[4]; int i = 2; c[i] = 1; d[i + 1] = 2; int x = c[2]; int y = d[3]; return x + y; }"
+assert 6 "int main() { int a[2][3]; int i = 1; int j = 2; a[i][j] = 6; return a[1][2]; }"
+
+# SSA form
+assert 231 "int main() { int a = 1; int b = 2; int c = 3; int i; for (i = 0; i < 4; i = i + 1) { int t = a; a = b; b = c; c = t; } return a * 100 + b * 10 + c; }"
+assert 12 "int f(int x) { return x + 1; } int main() { int a = 2; int b = 3; int c = f(a) + f(b); return a + b + c; }"
+assert 5 "int main() { int a = 2; if (a < 3) return 5; a = a + 1; return a; }"
+assert 7 "int f(int a, int b) { int *p = &a; return b; } int main() { return f(1, 7); }"
+program="int f(int a, int b) { return a * b + (a * b - 1) / 2; } int main() { return f(3, 4); }"
+[ "$(./r7cc --ssa --dump-ir "$program" 2>&1 >/dev/null | grep -c multiply)" = 1 ] || { echo "--ssa --dump-ir $program => a * b is computed more than once"; exit 1; }
+assert 17 "$program"
+
+# parallel code generation
+program="int f(int n) { if (n < 1) return 0; return n + f(n - 1); } int g(int a, int b) { while (a < b) a = a + 2; return a; } int main() { return f(4) + g(1, 6); }"
+./r7cc -j 1 "$program" > tmp.s
+./r7cc -j 3 "$program" | cmp -s tmp.s - || { echo "-j 3 $program => output differs from -j 1"; exit 1; }
+assert 17 "$program"
+assert 3 "int main() { return f(2) + g; } int f(int x) { return x + 1; } int g;"
+./r7cc "$program" -j >/dev/null 2>&1 && { echo "$program -j => usage expected"; exit 1; }
+for modes in "-j 2 --stream" "-j 2 --pipeline" "--stream --pipeline"; do
+  ./r7cc $modes "$program" >/dev/null 2>&1 && { echo "$modes $program => usage expected"; exit 1; }
+done
+program="int f() { return x; } int g() { return y; } int h() { return z; } int main() { return 0; }"
+[ "$(./r7cc -j 3 "$program" 2>&1 >/dev/null)" = "Undefined local variable: x" ] || { echo "-j 3 $program => the error of f expected"; exit 1; }
+
+# streaming compilation
+assert_stream 2 "int main() { return 2; }"
+assert_stream 12 "int g; int f(int *p) { *p = 5; return 2; } char c[3]; int main() { int a[2]; c[1] = 3; g = f(&a[1]); int x = c[1]; return a[1] + g + x + 2; }"
+assert_stream 9 "int f(int x) { if (x < 1) return 0; return x * 2 + 1; } int main() { return f(4); }"
+program="int main() { int a[3]; int *q; a[1] = 9; q = g(a) + 1; return *q; } int *g(int *p) { return p; }"
+assert 9 "$program"
+for mode in --stream --pipeline; do
+  [ "$(./r7cc $mode "$program" 2>&1 >/dev/null)" = "Undefined function: g" ] || { echo "$mode $program => Undefined function: g expected"; exit 1; }
+done
+program="int main() { return x; } int f() { return 1 @ 2; }"
+./r7cc --stream "$program" 2>tmp.s >/dev/null
+./r7cc --pipeline "$program" 2>&1 >/dev/null | cmp -s tmp.s - || { echo "--pipeline $program => the error of --stream expected"; exit 1; }
+
+# source file
+assert_file 2 "int main() { return 2; }"
+assert_file 3 "int main() {
+  int a = 1;
+  return a + 2;
+}"
+./r7cc -o tmp.s -f >/dev/null 2>&1 && { echo "-o tmp.s -f => usage expected"; exit 1; }
+./r7cc -f tmp.src -o >/dev/null 2>&1 && { echo "-f tmp.src -o => usage expected"; exit 1; }
+
 echo OK
@@ -0,0 +1,15 @@
+.intel_syntax noprefix
+.data
+.text
+.global main
+main:
+  push rbp
+  mov rbp, rsp
+  sub rsp, 16
+  mov QWORD PTR [rbp-8], rbx
+  mov rdi, 1
+  add rdi, 2
+  mov rax, rdi
+  mov rsp, rbp
+  pop rbp
+  ret
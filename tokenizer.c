@@ -1,149 +1,256 @@
 #include "tokenizer.h"
-#include <ctype.h>   // isdigit, isspace
+#include "symbol.h"
 #include <stdbool.h> // bool
-#include <stdio.h>   // fprintf
-#include <stdlib.h>  // exit, strtol
-#include <string.h>  // memcmp, strlen
+#include <stdlib.h>  // calloc, free, realloc
+#include <string.h>  // memcmp
 
-Token *new_token(TokenKind kind, char *begin, int length) {
-  Token *token = calloc(1, sizeof(Token));
-  token->kind = kind;
-  token->string = begin;
-  token->length = length;
-  return token;
+typedef enum {
+  CHARACTER_CLASS_INVALID,
+  CHARACTER_CLASS_SPACE,
+  CHARACTER_CLASS_ALPHA,
+  CHARACTER_CLASS_DIGIT,
+  CHARACTER_CLASS_PUNCTUATOR,
+} CharacterClass;
+
+static const unsigned char character_classes[256] = {
+    ['\t'] = CHARACTER_CLASS_SPACE,
+    ['\n'] = CHARACTER_CLASS_SPACE,
+    ['\v'] = CHARACTER_CLASS_SPACE,
+    ['\f'] = CHARACTER_CLASS_SPACE,
+    ['\r'] = CHARACTER_CLASS_SPACE,
+    [' '] = CHARACTER_CLASS_SPACE,
+    ['0' ... '9'] = CHARACTER_CLASS_DIGIT,
+    ['A' ... 'Z'] = CHARACTER_CLASS_ALPHA,
+    ['_'] = CHARACTER_CLASS_ALPHA,
+    ['a' ... 'z'] = CHARACTER_CLASS_ALPHA,
+    ['!'] = CHARACTER_CLASS_PUNCTUATOR,
+    ['&'] = CHARACTER_CLASS_PUNCTUATOR,
+    ['('] = CHARACTER_CLASS_PUNCTUATOR,
+    [')'] = CHARACTER_CLASS_PUNCTUATOR,
+    ['*'] = CHARACTER_CLASS_PUNCTUATOR,
+    ['+'] = CHARACTER_CLASS_PUNCTUATOR,
+    [','] = CHARACTER_CLASS_PUNCTUATOR,
+    ['-'] = CHARACTER_CLASS_PUNCTUATOR,
+    ['/'] = CHARACTER_CLASS_PUNCTUATOR,
+    [';'] = CHARACTER_CLASS_PUNCTUATOR,
+    ['<'] = CHARACTER_CLASS_PUNCTUATOR,
+    ['='] = CHARACTER_CLASS_PUNCTUATOR,
+    ['>'] = CHARACTER_CLASS_PUNCTUATOR,
+    ['['] = CHARACTER_CLASS_PUNCTUATOR,
+    [']'] = CHARACTER_CLASS_PUNCTUATOR,
+    ['{'] = CHARACTER_CLASS_PUNCTUATOR,
+    ['}'] = CHARACTER_CLASS_PUNCTUATOR,
+};
+
+typedef struct {
+  char *name;
+  int length;
+  TokenKind kind;
+} Keyword;
+
+// Indexed by keyword_hash. (first + last) & 15 happens to be collision-free for our keywords.
+static const Keyword keywords[16] = {
+    [0] = {"return", 6, TOKEN_KIND_RETURN},
+    [5] = {"char", 4, TOKEN_KIND_CHAR},
+    [8] = {"for", 3, TOKEN_KIND_FOR},
+    [9] = {"sizeof", 6, TOKEN_KIND_SIZEOF},
+    [10] = {"else", 4, TOKEN_KIND_ELSE},
+    [12] = {"while", 5, TOKEN_KIND_WHILE},
+    [13] = {"int", 3, TOKEN_KIND_INTEGER},
+    [15] = {"if", 2, TOKEN_KIND_IF},
+};
+
+static int keyword_hash(char *string, int length) {
+  return ((unsigned char)string[0] + (unsigned char)string[length - 1]) & 15;
 }
 
-bool is_alpha(char character) {
-  return 'a' <= character && character <= 'z' || 'A' <= character && character <= 'Z' || character == '_';
+static TokenKind identifier_or_keyword_kind(char *string, int length) {
+  const Keyword *keyword = &keywords[keyword_hash(string, length)];
+  if (keyword->length == length && !memcmp(keyword->name, string, length)) {
+    return keyword->kind;
+  }
+  return TOKEN_KIND_IDENTIFIER;
 }
 
-bool is_alnum(char character) {
-  return is_alpha(character) || '0' <= character && character <= '9';
+static bool is_alnum(char character) {
+  CharacterClass character_class = character_classes[(unsigned char)character];
+  return character_class == CHARACTER_CLASS_ALPHA || character_class == CHARACTER_CLASS_DIGIT;
 }
 
-bool starts_with(char *string, char *segment) {
-  return memcmp(string, segment, strlen(segment)) == 0;
+TokenStream *new_token_stream(void) {
+  return calloc(1, sizeof(TokenStream));
 }
 
-bool starts_and_ends_with(char *string, char *segment) {
-  int length = strlen(segment);
-  return memcmp(string, segment, length) == 0 && !is_alnum(string[length]);
+void free_token_stream(TokenStream *stream) {
+  free(stream->tokens);
+  free(stream);
 }
 
-Token *tokenize(char *input) {
-  char *p = input;
+Token *push_token(TokenStream *stream, TokenKind kind, char *begin, int length) {
+  if (stream->length == stream->capacity) {
+    stream->capacity = stream->capacity == 0 ? 1024 : stream->capacity * 2;
+    stream->tokens = realloc(stream->tokens, sizeof(Token) * stream->capacity);
+  }
+  Token *token = &stream->tokens[stream->length++];
+  token->kind = kind;
+  token->offset = begin - stream->source->text;
+  token->length = length;
+  token->value = 0;
+  return token;
+}
 
-  Token head;
-  head.next = NULL;
-  Token *current = &head;
+// Returns the kind of the punctuator at p, and stores its length.
+static TokenKind punctuator_kind(char character, char next, int *length) {
+  *length = 1;
+  switch (character) {
+  case '=':
+    if (next == '=') {
+      *length = 2;
+      return TOKEN_KIND_EQ;
+    }
+    return TOKEN_KIND_ASSIGN;
+  case '!':
+    if (next == '=') {
+      *length = 2;
+      return TOKEN_KIND_NE;
+    }
+    return TOKEN_KIND_EOF;
+  case '<':
+    if (next == '=') {
+      *length = 2;
+      return TOKEN_KIND_LE;
+    }
+    return TOKEN_KIND_LT;
+  case '>':
+    if (next == '=') {
+      *length = 2;
+      return TOKEN_KIND_GE;
+    }
+    return TOKEN_KIND_GT;
+  case '+':
+    return TOKEN_KIND_PLUS;
+  case '-':
+    return TOKEN_KIND_MINUS;
+  case '*':
+    return TOKEN_KIND_ASTERISK;
+  case '/':
+    return TOKEN_KIND_SLASH;
+  case ';':
+    return TOKEN_KIND_SEMICOLON;
+  case ',':
+    return TOKEN_KIND_COMMA;
+  case '&':
+    return TOKEN_KIND_AMPERSAND;
+  case '(':
+    return TOKEN_KIND_PARENTHESIS_LEFT;
+  case ')':
+    return TOKEN_KIND_PARENTHESIS_RIGHT;
+  case '{':
+    return TOKEN_KIND_BRACE_LEFT;
+  case '}':
+    return TOKEN_KIND_BRACE_RIGHT;
+  case '[':
+    return TOKEN_KIND_BRACKET_LEFT;
+  case ']':
+    return TOKEN_KIND_BRACKET_RIGHT;
+  default:
+    return TOKEN_KIND_EOF;
+  }
+}
 
-  while (*p) {
-    if (isspace(*p)) {
-      p++;
-    } else if (starts_with(p, "==")) {
-      current = current->next = new_token(TOKEN_KIND_EQ, p, 2);
-      p += 2;
-    } else if (starts_with(p, "!=")) {
-      current = current->next = new_token(TOKEN_KIND_NE, p, 2);
-      p += 2;
-    } else if (starts_with(p, "<=")) {
-      current = current->next = new_token(TOKEN_KIND_LE, p, 2);
-      p += 2;
-    } else if (starts_with(p, ">=")) {
-      current = current->next = new_token(TOKEN_KIND_GE, p, 2);
-      p += 2;
-    } else if (*p == '+') {
-      current = current->next = new_token(TOKEN_KIND_PLUS, p, 1);
-      p++;
-    } else if (*p == '-') {
-      current = current->next = new_token(TOKEN_KIND_MINUS, p, 1);
-      p++;
-    } else if (*p == '*') {
-      current = current->next = new_token(TOKEN_KIND_ASTERISK, p, 1);
-      p++;
-    } else if (*p == '/') {
-      current = current->next = new_token(TOKEN_KIND_SLASH, p, 1);
-      p++;
-    } else if (*p == ';') {
-      current = current->next = new_token(TOKEN_KIND_SEMICOLON, p, 1);
-      p++;
-    } else if (*p == '=') {
-      current = current->next = new_token(TOKEN_KIND_ASSIGN, p, 1);
-      p++;
-    } else if (*p == ',') {
-      current = current->next = new_token(TOKEN_KIND_COMMA, p, 1);
-      p++;
-    } else if (*p == '&') {
-      current = current->next = new_token(TOKEN_KIND_AMPERSAND, p, 1);
-      p++;
-    } else if (*p == '<') {
-      current = current->next = new_token(TOKEN_KIND_LT, p, 1);
-      p++;
-    } else if (*p == '>') {
-      current = current->next = new_token(TOKEN_KIND_GT, p, 1);
-      p++;
-    } else if (*p == '(') {
-      current = current->next = new_token(TOKEN_KIND_PARENTHESIS_LEFT, p, 1);
-      p++;
-    } else if (*p == ')') {
-      current = current->next = new_token(TOKEN_KIND_PARENTHESIS_RIGHT, p, 1);
-      p++;
-    } else if (*p == '{') {
-      current = current->next = new_token(TOKEN_KIND_BRACE_LEFT, p, 1);
-      p++;
-    } else if (*p == '}') {
-      current = current->next = new_token(TOKEN_KIND_BRACE_RIGHT, p, 1);
-      p++;
-    } else if (*p == '[') {
-      current = current->next = new_token(TOKEN_KIND_BRACKET_LEFT, p, 1);
-      p++;
-    } else if (*p == ']') {
-      current = current->next = new_token(TOKEN_KIND_BRACKET_RIGHT, p, 1);
+// Scans the token at p, pushing it onto stream unless it is a space, and returns the position after it.
+// Reports an unexpected character at p, or records it and skips to end when the stream defers errors.
+static char *unexpected_character(TokenStream *stream, char *p, char *end) {
+  stream->error_position = p;
+  if (!stream->defers_errors) {
+    raise_token_error(stream);
+  }
+  return end;
+}
+
+// Reports the lexical error recorded in a stream that defers errors, if any.
+void raise_token_error(TokenStream *stream) {
+  if (stream->error_position != NULL) {
+    error_at(stream->source, stream->error_position, "Unexpected character.");
+  }
+}
+
+static char *scan_token(TokenStream *stream, char *p, char *end) {
+  switch (character_classes[(unsigned char)*p]) {
+  case CHARACTER_CLASS_SPACE:
+    return p + 1;
+  case CHARACTER_CLASS_ALPHA: {
+    char *q = p;
+    p++;
+    while (p < end && is_alnum(*p)) {
       p++;
-    } else if (starts_and_ends_with(p, "if")) {
-      current = current->next = new_token(TOKEN_KIND_IF, p, 2);
-      p += 2;
-    } else if (starts_and_ends_with(p, "int")) {
-      current = current->next = new_token(TOKEN_KIND_INTEGER, p, 3);
-      p += 3;
-    } else if (starts_and_ends_with(p, "for")) {
-      current = current->next = new_token(TOKEN_KIND_FOR, p, 3);
-      p += 3;
-    } else if (starts_and_ends_with(p, "char")) {
-      current = current->next = new_token(TOKEN_KIND_CHAR, p, 4);
-      p += 4;
-    } else if (starts_and_ends_with(p, "else")) {
-      current = current->next = new_token(TOKEN_KIND_ELSE, p, 4);
-      p += 4;
-    } else if (starts_and_ends_with(p, "while")) {
-      current = current->next = new_token(TOKEN_KIND_WHILE, p, 5);
-      p += 5;
-    } else if (starts_and_ends_with(p, "return")) {
-      current = current->next = new_token(TOKEN_KIND_RETURN, p, 6);
-      p += 6;
-    } else if (starts_and_ends_with(p, "sizeof")) {
-      current = current->next = new_token(TOKEN_KIND_SIZEOF, p, 6);
-      p += 6;
-    } else if (is_alpha(*p)) {
-      char *q = p;
+    }
+    TokenKind kind = identifier_or_keyword_kind(q, p - q);
+    Token *token = push_token(stream, kind, q, p - q);
+    if (kind == TOKEN_KIND_IDENTIFIER) {
+      token->value = intern(q, p - q);
+    }
+    return p;
+  }
+  case CHARACTER_CLASS_DIGIT: {
+    char *q = p;
+    int value = 0;
+    while (p < end && character_classes[(unsigned char)*p] == CHARACTER_CLASS_DIGIT) {
+      value = value * 10 + (*p - '0');
       p++;
-      while (is_alnum(*p)) {
-        p++;
-      }
-      current = current->next = new_token(TOKEN_KIND_IDENTIFIER, q, p - q);
-    } else if (isdigit(*p)) {
-      char *q = p;
-      int value = strtol(p, &p, 10);
-      current = current->next = new_token(TOKEN_KIND_NUMBER, p, p - q);
-      current->value = value;
-    } else {
-      int position = p - input;
-      fprintf(stderr, "%s\n", input);
-      fprintf(stderr, "%*s^ Unexpected character.\n", position, "");
-      exit(1);
     }
+    push_token(stream, TOKEN_KIND_NUMBER, q, p - q)->value = value;
+    return p;
   }
+  case CHARACTER_CLASS_PUNCTUATOR: {
+    int length;
+    TokenKind kind = punctuator_kind(*p, p + 1 < end ? p[1] : '\0', &length);
+    if (kind == TOKEN_KIND_EOF) {
+      return unexpected_character(stream, p, end);
+    }
+    push_token(stream, kind, p, length);
+    return p + length;
+  }
+  default:
+    return unexpected_character(stream, p, end);
+  }
+}
 
-  current->next = new_token(TOKEN_KIND_EOF, p, 0);
-  return head.next;
+// Tokenizes source into stream. The buffer of stream is reused, so that a stream can be recycled across inputs.
+// Tokens point into the text of source, which is never copied.
+void tokenize(TokenStream *stream, Source *source) {
+  char *p = source->text;
+  char *end = p + source->length;
+  stream->source = source;
+  stream->length = 0;
+  while (p < end) {
+    p = scan_token(stream, p, end);
+  }
+  push_token(stream, TOKEN_KIND_EOF, p, 0);
+}
+
+// Replaces the tokens of stream with those of the next top-level definition in source, followed by EOF,
+// so that only one definition is held at a time. A definition ends at a ";" or "}" outside of braces.
+// Only EOF is left once source is exhausted.
+void tokenize_definition(TokenStream *stream, Source *source) {
+  char *p = source->text + stream->offset;
+  char *end = source->text + source->length;
+  stream->source = source;
+  stream->length = 0;
+  int depth = 0;
+  while (p < end) {
+    int length = stream->length;
+    p = scan_token(stream, p, end);
+    if (stream->length == length) {
+      continue;
+    }
+    TokenKind kind = stream->tokens[length].kind;
+    if (kind == TOKEN_KIND_BRACE_LEFT) {
+      depth++;
+    } else if (kind == TOKEN_KIND_BRACE_RIGHT && --depth <= 0 || kind == TOKEN_KIND_SEMICOLON && depth == 0) {
+      break;
+    }
+  }
+  stream->offset = p - source->text;
+  push_token(stream, TOKEN_KIND_EOF, p, 0);
 }
@@ -1,5 +1,8 @@
 #pragma once
 
+#include "source.h"
+#include <stdbool.h>
+
 typedef enum {
   TOKEN_KIND_AMPERSAND,
   TOKEN_KIND_ASSIGN,
@@ -38,10 +41,36 @@ typedef struct Token Token;
 
 struct Token {
   TokenKind kind;
-  Token *next;
-  char *string;
+
+  // Offset from the beginning of the source.
+  int offset;
+
   int length;
+
+  // Number value, or symbol ID of identifier.
   int value;
 };
 
-Token *tokenize();
+typedef struct TokenStream TokenStream;
+
+// Tokens are stored contiguously, so that the parser can walk them by index.
+struct TokenStream {
+  Token *tokens;
+  int length;
+  int capacity;
+  Source *source;
+
+  // Offset of the first character tokenize_definition has not consumed yet.
+  int offset;
+
+  // When set, a lexical error ends tokenizing and is recorded in error_position, to be raised by
+  // raise_token_error, instead of being reported at once.
+  bool defers_errors;
+  char *error_position;
+};
+
+TokenStream *new_token_stream(void);
+void free_token_stream(TokenStream *stream);
+void tokenize(TokenStream *stream, Source *source);
+void tokenize_definition(TokenStream *stream, Source *source);
+void raise_token_error(TokenStream *stream);
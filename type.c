@@ -1,29 +1,91 @@
 #include "type.h"
-#include <stdlib.h>
+#include <pthread.h> // pthread_mutex_lock, pthread_mutex_unlock
+#include <stdlib.h>  // calloc, free
 
 Type *char_type = &(Type){
     .kind = TYPE_KIND_CHAR,
     .size = 1,
+    .alignment = 1,
 };
 
 Type *int_type = &(Type){
     .kind = TYPE_KIND_INTEGER,
-    .size = 8,
+    .size = 4,
+    .alignment = 4,
 };
 
-Type *new_array_type(Type *pointed_type, int array_length) {
-  Type *type = calloc(1, sizeof(Type));
-  type->array_length = array_length;
-  type->kind = TYPE_KIND_ARRAY;
-  type->pointed_type = pointed_type;
-  type->size = pointed_type->size * array_length;
-  return type;
+// Open addressing hash table of every derived type, so that each distinct type exists only once.
+static Type **type_table;
+static int type_table_capacity;
+static int types_count;
+
+// Types are interned by every thread parsing function bodies.
+static pthread_mutex_t type_table_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int hash_type(TypeKind kind, Type *pointed_type, size_t array_length) {
+  size_t hash = (size_t)pointed_type;
+  hash ^= hash >> 17;
+  hash = hash * 31 + kind;
+  hash = hash * 31 + array_length;
+  return hash * 2654435761u;
+}
+
+static void insert_type(Type **table, int capacity, Type *type) {
+  int mask = capacity - 1;
+  int i = hash_type(type->kind, type->pointed_type, type->array_length) & mask;
+  while (table[i] != NULL) {
+    i = (i + 1) & mask;
+  }
+  table[i] = type;
+}
+
+// Keeps the load factor of the table at most 1/2.
+static void grow_type_table(void) {
+  int capacity = type_table_capacity == 0 ? 64 : type_table_capacity * 2;
+  Type **table = calloc(capacity, sizeof(Type *));
+  for (int i = 0; i < type_table_capacity; i++) {
+    if (type_table[i] != NULL) {
+      insert_type(table, capacity, type_table[i]);
+    }
+  }
+  free(type_table);
+  type_table = table;
+  type_table_capacity = capacity;
+}
+
+// Returns the unique type of the given shape, allocating it from arena on first sight.
+// Interned types are shared across the whole compilation, so arena must live as long as the compilation one.
+static Type *intern_type(Arena *arena, TypeKind kind, Type *pointed_type, size_t array_length, int size, int alignment) {
+  pthread_mutex_lock(&type_table_mutex);
+  if ((types_count + 1) * 2 > type_table_capacity) {
+    grow_type_table();
+  }
+  int mask = type_table_capacity - 1;
+  for (int i = hash_type(kind, pointed_type, array_length) & mask;; i = (i + 1) & mask) {
+    Type *type = type_table[i];
+    if (type == NULL) {
+      type = arena_allocate(arena, sizeof(Type), ARENA_OBJECT_KIND_TYPE);
+      type->kind = kind;
+      type->pointed_type = pointed_type;
+      type->array_length = array_length;
+      type->size = size;
+      type->alignment = alignment;
+      type_table[i] = type;
+      types_count++;
+      pthread_mutex_unlock(&type_table_mutex);
+      return type;
+    }
+    if (type->kind == kind && type->pointed_type == pointed_type && type->array_length == array_length) {
+      pthread_mutex_unlock(&type_table_mutex);
+      return type;
+    }
+  }
+}
+
+Type *new_array_type(Arena *arena, Type *pointed_type, int array_length) {
+  return intern_type(arena, TYPE_KIND_ARRAY, pointed_type, array_length, pointed_type->size * array_length, pointed_type->alignment);
 }
 
-Type *new_pointer_type(Type *pointed_type) {
-  Type *type = calloc(1, sizeof(Type));
-  type->kind = TYPE_KIND_POINTER;
-  type->pointed_type = pointed_type;
-  type->size = 16;
-  return type;
+Type *new_pointer_type(Arena *arena, Type *pointed_type) {
+  return intern_type(arena, TYPE_KIND_POINTER, pointed_type, 0, 8, 8);
 }
@@ -1,3 +1,6 @@
+#pragma once
+
+#include "arena.h"
 #include <stddef.h>
 
 typedef enum {
@@ -9,15 +12,17 @@ typedef enum {
 
 typedef struct Type Type;
 
+// Types are interned, so that two types are the same if and only if they are pointer-equal.
 struct Type {
   TypeKind kind;
   int size;
+  int alignment;
   Type *pointed_type;
   size_t array_length;
 };
 
-Type *new_array_type(Type *pointed_type, int array_length);
-Type *new_pointer_type(Type *pointed_type);
+Type *new_array_type(Arena *arena, Type *pointed_type, int array_length);
+Type *new_pointer_type(Arena *arena, Type *pointed_type);
 
 extern Type *char_type;
 extern Type *int_type;
@@ -0,0 +1,244 @@
+#include "vm.h"
+#include <stdio.h>  // fprintf
+#include <stdlib.h> // calloc, exit, free, realloc
+#include <string.h> // memcpy
+
+// Bytes of the stack that holds the variables and registers of every active call.
+#define STACK_SIZE (8 * 1024 * 1024)
+
+typedef struct VmFrame VmFrame;
+
+// State of a caller while its callee runs.
+struct VmFrame {
+  VmInstruction *return_pc;
+  long *registers;
+  char *frame_pointer;
+  char *stack_top;
+  int result_register;
+};
+
+static int align_to(int size, int unit) {
+  return (size + unit - 1) / unit * unit;
+}
+
+// Runs main of program and returns what it returns.
+// Dispatch is threaded by computed goto: each handler jumps straight to the handler of the next instruction,
+// instead of going back through a single switch, so that each handler has its own indirect branch to predict.
+// Local variables live below the frame pointer and registers above it, so pointers to them are plain host pointers.
+int run_vm_program(VmProgram *program) {
+  static void *handlers[VM_OPCODES_COUNT] = {
+      [VM_OPCODE_ADD] = &&add,
+      [VM_OPCODE_ADD_IMMEDIATE] = &&add_immediate,
+      [VM_OPCODE_CALL] = &&call,
+      [VM_OPCODE_DIVIDE] = &&divide,
+      [VM_OPCODE_DIVIDE_IMMEDIATE] = &&divide_immediate,
+      [VM_OPCODE_EQ] = &&eq,
+      [VM_OPCODE_GLOBAL_ADDRESS] = &&global_address,
+      [VM_OPCODE_JUMP] = &&jump,
+      [VM_OPCODE_JUMP_IF_ZERO] = &&jump_if_zero,
+      [VM_OPCODE_JUMP_UNLESS_EQ] = &&jump_unless_eq,
+      [VM_OPCODE_JUMP_UNLESS_LE] = &&jump_unless_le,
+      [VM_OPCODE_JUMP_UNLESS_LT] = &&jump_unless_lt,
+      [VM_OPCODE_JUMP_UNLESS_NE] = &&jump_unless_ne,
+      [VM_OPCODE_LE] = &&le,
+      [VM_OPCODE_LOAD_BYTE] = &&load_byte,
+      [VM_OPCODE_LOAD_LOCAL_LONG] = &&load_local_long,
+      [VM_OPCODE_LOAD_LOCAL_QUAD] = &&load_local_quad,
+      [VM_OPCODE_LOAD_LONG] = &&load_long,
+      [VM_OPCODE_LOAD_QUAD] = &&load_quad,
+      [VM_OPCODE_LOCAL_ADDRESS] = &&local_address,
+      [VM_OPCODE_LT] = &&lt,
+      [VM_OPCODE_MOVE_IMMEDIATE] = &&move_immediate,
+      [VM_OPCODE_MULTIPLY] = &&multiply,
+      [VM_OPCODE_MULTIPLY_IMMEDIATE] = &&multiply_immediate,
+      [VM_OPCODE_NE] = &&ne,
+      [VM_OPCODE_RETURN] = &&return_,
+      [VM_OPCODE_STORE_BYTE] = &&store_byte,
+      [VM_OPCODE_STORE_LOCAL_LONG] = &&store_local_long,
+      [VM_OPCODE_STORE_LOCAL_QUAD] = &&store_local_quad,
+      [VM_OPCODE_STORE_LONG] = &&store_long,
+      [VM_OPCODE_STORE_QUAD] = &&store_quad,
+      [VM_OPCODE_SUBTRACT] = &&subtract,
+  };
+
+  VmFunction *main_function = NULL;
+  for (int i = 0; i < program->functions_count; i++) {
+    if (program->functions[i].symbol->name_length == 4 && !memcmp(program->functions[i].symbol->name, "main", 4)) {
+      main_function = &program->functions[i];
+    }
+  }
+  if (main_function == NULL) {
+    fprintf(stderr, "main is not defined.\n");
+    exit(1);
+  }
+
+  char *globals = calloc(program->globals_size + 16, 1);
+  char *globals_end = globals + program->globals_size;
+  char *stack = calloc(STACK_SIZE, 1);
+  char *stack_end = stack + STACK_SIZE;
+  int frames_capacity = 256;
+  int frames_count = 0;
+  VmFrame *frames = calloc(frames_capacity, sizeof(VmFrame));
+
+  char *frame_pointer = stack + main_function->frame_size;
+  long *registers = (long *)frame_pointer;
+  char *stack_top = frame_pointer + align_to(main_function->registers_count * sizeof(long), 16);
+  if (stack_top > stack_end) {
+    fprintf(stderr, "Stack overflow.\n");
+    exit(1);
+  }
+  VmInstruction *pc = main_function->code;
+  long result;
+
+#define DISPATCH() goto *handlers[pc->opcode]
+#define NEXT() \
+  pc++;        \
+  DISPATCH()
+
+  DISPATCH();
+
+add:
+  registers[pc->a] = (unsigned long)registers[pc->b] + (unsigned long)registers[pc->c];
+  NEXT();
+add_immediate:
+  registers[pc->a] = (unsigned long)registers[pc->b] + (unsigned long)(long)pc->c;
+  NEXT();
+call: {
+  VmFunction *callee = &program->functions[pc->b];
+  int registers_count = callee->registers_count > pc->c ? callee->registers_count : pc->c;
+  char *callee_frame_pointer = stack_top + callee->frame_size;
+  char *callee_stack_top = callee_frame_pointer + align_to(registers_count * sizeof(long), 16);
+  if (callee_stack_top > stack_end) {
+    fprintf(stderr, "Stack overflow.\n");
+    exit(1);
+  }
+  if (frames_count == frames_capacity) {
+    frames_capacity *= 2;
+    frames = realloc(frames, sizeof(VmFrame) * frames_capacity);
+  }
+  frames[frames_count++] = (VmFrame){pc + 1, registers, frame_pointer, stack_top, pc->a};
+  memcpy(callee_frame_pointer, registers + pc->a, sizeof(long) * pc->c);
+  registers = (long *)callee_frame_pointer;
+  frame_pointer = callee_frame_pointer;
+  stack_top = callee_stack_top;
+  pc = callee->code;
+  DISPATCH();
+}
+divide:
+  registers[pc->a] = registers[pc->b] / registers[pc->c];
+  NEXT();
+divide_immediate:
+  registers[pc->a] = registers[pc->b] / pc->c;
+  NEXT();
+eq:
+  registers[pc->a] = registers[pc->b] == registers[pc->c];
+  NEXT();
+global_address:
+  registers[pc->a] = (long)(globals_end - pc->b);
+  NEXT();
+jump:
+  pc += pc->c;
+  DISPATCH();
+jump_if_zero:
+  pc += registers[pc->a] == 0 ? pc->c : 1;
+  DISPATCH();
+jump_unless_eq:
+  pc += registers[pc->a] == registers[pc->b] ? 1 : pc->c;
+  DISPATCH();
+jump_unless_le:
+  pc += registers[pc->a] <= registers[pc->b] ? 1 : pc->c;
+  DISPATCH();
+jump_unless_lt:
+  pc += registers[pc->a] < registers[pc->b] ? 1 : pc->c;
+  DISPATCH();
+jump_unless_ne:
+  pc += registers[pc->a] != registers[pc->b] ? 1 : pc->c;
+  DISPATCH();
+le:
+  registers[pc->a] = registers[pc->b] <= registers[pc->c];
+  NEXT();
+load_byte:
+  registers[pc->a] = *(signed char *)registers[pc->b];
+  NEXT();
+load_local_long: {
+  int value;
+  memcpy(&value, frame_pointer - pc->b, sizeof(int));
+  registers[pc->a] = value;
+  NEXT();
+}
+load_local_quad:
+  memcpy(&registers[pc->a], frame_pointer - pc->b, sizeof(long));
+  NEXT();
+load_long: {
+  int value;
+  memcpy(&value, (char *)registers[pc->b], sizeof(int));
+  registers[pc->a] = value;
+  NEXT();
+}
+load_quad:
+  memcpy(&registers[pc->a], (char *)registers[pc->b], sizeof(long));
+  NEXT();
+local_address:
+  registers[pc->a] = (long)(frame_pointer - pc->b);
+  NEXT();
+lt:
+  registers[pc->a] = registers[pc->b] < registers[pc->c];
+  NEXT();
+move_immediate:
+  registers[pc->a] = pc->b;
+  NEXT();
+multiply:
+  registers[pc->a] = (unsigned long)registers[pc->b] * (unsigned long)registers[pc->c];
+  NEXT();
+multiply_immediate:
+  registers[pc->a] = (unsigned long)registers[pc->b] * (unsigned long)(long)pc->c;
+  NEXT();
+ne:
+  registers[pc->a] = registers[pc->b] != registers[pc->c];
+  NEXT();
+return_: {
+  long value = registers[pc->a];
+  if (frames_count == 0) {
+    result = value;
+    goto finish;
+  }
+  VmFrame *frame = &frames[--frames_count];
+  pc = frame->return_pc;
+  registers = frame->registers;
+  frame_pointer = frame->frame_pointer;
+  stack_top = frame->stack_top;
+  registers[frame->result_register] = value;
+  DISPATCH();
+}
+store_byte:
+  *(char *)registers[pc->a] = registers[pc->b];
+  NEXT();
+store_local_long: {
+  int value = registers[pc->b];
+  memcpy(frame_pointer - pc->a, &value, sizeof(int));
+  NEXT();
+}
+store_local_quad:
+  memcpy(frame_pointer - pc->a, &registers[pc->b], sizeof(long));
+  NEXT();
+store_long: {
+  int value = registers[pc->b];
+  memcpy((char *)registers[pc->a], &value, sizeof(int));
+  NEXT();
+}
+store_quad:
+  memcpy((char *)registers[pc->a], &registers[pc->b], sizeof(long));
+  NEXT();
+subtract:
+  registers[pc->a] = (unsigned long)registers[pc->b] - (unsigned long)registers[pc->c];
+  NEXT();
+
+#undef NEXT
+#undef DISPATCH
+
+finish:
+  free(frames);
+  free(stack);
+  free(globals);
+  return result;
+}
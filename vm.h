@@ -0,0 +1,5 @@
+#pragma once
+
+#include "bytecode.h" // VmProgram
+
+int run_vm_program(VmProgram *program);